@@ -1,11 +1,17 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "stdbool.h"
 #include "optparse.h"
 #include "utils.h"
@@ -34,9 +40,12 @@
 #define LICENSE "License: https://opensource.org/licenses/ISC"
 #define ISSUES "https://github.com/jakwings/ufold/issues"
 
+#define QUEUE_LIMIT 1048576
+#define INDEX_INTERVAL 1024
+
 #define P PROGRAM
 
-static const char* const manual =
+static const char* const manual[] = {
 "\n"
 "  NAME\n"
 "         " P " -- wrap each input line to fit in specified width\n"
@@ -49,7 +58,24 @@ static const char* const manual =
 "               [-p[CHARS] | --hang[=CHARS]]\n"
 "               [-i | --indent]\n"
 "               [-s | --spaces]\n"
+"               [--optimal]\n"
+"               [--unicode-breaks]\n"
+"               [--graphemes]\n"
+"               [--ansi]\n"
+"               [--truncate[=TEXT]]\n"
+"               [--max-lines=LINES]\n"
+"               [--trusted]\n"
+"               [--input-encoding=ENCODING]\n"
+"               [--cache=LINES]\n"
+"               [--ambiguous=WIDTH]\n"
+"               [--width-table=FILE]\n"
 "               [-b | --bytes]\n"
+"               [--count]\n"
+"               [--index=FILE]\n"
+"               [--emit=FORMAT]\n"
+"               [--nonblock[=BYTES]]\n"
+"               [--latency=MSECS]\n"
+"               [--pending=BYTES]\n"
 "               [-h | --help]\n"
 "               [-V | --version]\n"
 "               [--] [FILE]...\n"
@@ -81,9 +107,119 @@ static const char* const manual =
 "         -s, --spaces\n"
 "                Break lines at spaces.\n"
 "\n"
+"         --optimal\n"
+"                Break lines at spaces evenly.\n"
+"                Choose the line breaks of a paragraph to minimize the sum of"
+                 " squares of columns left on its lines but the last one,"
+                 " looking ahead at most 32 lines.\n"
+"\n"
+"         --unicode-breaks\n"
+"                Break lines at spaces and inside words by Unicode rules.\n"
+"                Also break where the Unicode line breaking algorithm (UAX #14)"
+                 " allows, e.g. between CJK characters or after a slash or a"
+                 " hyphen, and never at no-break spaces.  It conflicts with"
+                 " --optimal.\n"
+"\n"
+"         --graphemes\n"
+"                Keep grapheme clusters whole.\n"
+"                Count a letter with combining marks or an emoji sequence"
+                 " as wide as its first character, and never break a line"
+                 " inside it.  It is ignored with --bytes.\n"
+"\n"
+"         --ansi\n"
+"                Pass ANSI escape sequences through.\n"
+"                Keep escape sequences such as colors and hyperlinks as text"
+                 " of no width rather than replacing ESC with '?', never"
+                 " split them, and reset the colors before each line break"
+                 " or ellipsis and set them again after it.  It is ignored"
+                 " with --bytes.\n"
+"\n"
+"         --truncate[=<ellipsis>]\n"
+"                Cut lines rather than wrap them. Default: (none).\n"
+"                Keep what fits in the width along with the ellipsis, and skip"
+                 " the rest of each long line without decoding it.  Options to"
+                 " break lines and to keep indentation are ignored.\n"
+"\n"
+"         --max-lines <lines>\n"
+"                Maximum lines of output. Default: (none).\n"
+"                Stop reading input as soon as enough lines are written.\n"
+"\n"
+"         --trusted\n"
+"                Trust input to be clean.\n"
+"                Skip validation, sanitization and normalization of input,"
+                 " which must be well-formed UTF-8 (or ASCII with --bytes)"
+                 " without CR, NEL, LS, PS or control characters other than"
+                 " LF and TAB.  Otherwise output is undefined.\n"
+"\n"
+"         --input-encoding <encoding>\n"
+"                Encoding of input. Default: utf-8.\n"
+"                Transcode input from utf-16, utf-16le, utf-16be, latin-1 or"
+                 " cp1252 into UTF-8 while reading it.  A byte order mark at"
+                 " the start of UTF-16 input is dropped, and tells the byte"
+                 " order for utf-16 (big-endian without it).  It is ignored"
+                 " with --bytes.\n"
+"\n"
+,  // a string literal in C99 has no more than 4095 characters
+"         --cache <lines>\n"
+"                Input lines cached with output. Default: (none).\n"
+"                Output a line seen again among that many recent lines from"
+                 " the cache rather than wrap it again, which pays off for"
+                 " repetitive input such as logs.  With --count, the numbers"
+                 " of cache hits and misses are also printed.  It is ignored"
+                 " with --optimal and --ansi.\n"
+"\n"
+"         --ambiguous <width>\n"
+"                Columns of East Asian Ambiguous characters. Default: 1.\n"
+"                Count characters such as Greek letters, box drawings and"
+                 " circles as 2 columns wide, as terminals in CJK locales"
+                 " do.  It is ignored with --bytes.\n"
+"\n"
+"         --width-table <file>\n"
+"                Table of character widths. Default: $UFOLD_WIDTH_TABLE.\n"
+"                Take the widths of characters from a file made by mkwidths,"
+                 " e.g. measured on the terminal in use, rather than from the"
+                 " built-in Unicode data.  It is ignored with --bytes.\n"
+"\n"
 "         -b, --bytes\n"
 "                Count bytes rather than columns.\n"
 "\n"
+"         --count\n"
+"                Measure output rather than write it.\n"
+"                Print the number of lines, the maximum line width and the"
+                 " number of bytes of output, separated by spaces.\n"
+"\n"
+"         --index <file>\n"
+"                Write an index of output lines. Default: (none).\n"
+"                Record the input offset and the wrapping state about every"
+                 " 1024 output lines, so that wrapping can resume at any output"
+                 " line.  The width must not be zero unless with --count.\n"
+"\n"
+"         --emit <format>\n"
+"                Format of output: text, breaks. Default: text.\n"
+"                With breaks, write a record for each output line rather than"
+                 " the text: bytes of input skipped since the previous line,"
+                 " bytes of the line in input, the kind of line break (0: end"
+                 " of input, 1: line feed, 2: wrapped, 3: wrapped inside a word"
+                 " too long to fit), columns of the line and bytes of indent to"
+                 " put before it, as five unsigned LEB128 numbers.  Input is"
+                 " counted as is without sanitization.\n"
+"\n"
+"         --nonblock[=<bytes>]\n"
+"                Non-blocking I/O. Default: 1048576.\n"
+"                Keep reading input while output is blocked, until the pending"
+                 " output reaches the given size.\n"
+"\n"
+"         --latency <milliseconds>\n"
+"                Maximum delay of buffered output. Default: (none).\n"
+"                Coalesce output across lines until the delay is reached, the"
+                 " pending input exceeds the limit of --pending, or input"
+                 " becomes idle.\n"
+"\n"
+"         --pending <bytes>\n"
+"                Maximum input pending for output. Default: (none).\n"
+"                Coalesce output across lines until the size is reached, the"
+                 " delay of --latency is reached, or input becomes idle.\n"
+"\n"
 "         -h, --help\n"
 "                Show help information.\n"
 "\n"
@@ -120,7 +256,7 @@ static const char* const manual =
 "\n"
 "         " LICENSE "\n"
 "\n"
-;
+, NULL};
 
 static const char* const usage =
 "USAGE\n"
@@ -135,11 +271,81 @@ static const char* const usage =
 "    -p, --hang[=<chars>]  Hanging punctuation.\n"
 "    -i, --indent          Keep indentation for wrapped text.\n"
 "    -s, --spaces          Break lines at spaces.\n"
+"    --optimal             Break lines at spaces evenly.\n"
+"    --unicode-breaks      Break lines at spaces and by Unicode rules.\n"
+"    --graphemes           Keep grapheme clusters whole.\n"
+"    --ansi                Pass ANSI escape sequences through.\n"
+"    --truncate[=<text>]   Cut lines rather than wrap them.\n"
+"    --max-lines <lines>   Maximum lines of output.\n"
+"    --trusted             Trust input to be clean.\n"
+"    --input-encoding <encoding>\n"
+"                          Encoding of input.\n"
+"    --cache <lines>       Input lines cached with output.\n"
+"    --ambiguous <width>   Columns of East Asian Ambiguous characters.\n"
+"    --width-table <file>  Table of character widths.\n"
 "    -b, --bytes           Count bytes rather than columns.\n"
+"    --count               Measure output rather than write it.\n"
+"    --index <file>        Write an index of output lines.\n"
+"    --emit <format>       Format of output: text, breaks.\n"
+"    --nonblock[=<size>]   Non-blocking I/O.\n"
+"    --latency <msecs>     Maximum delay of buffered output.\n"
+"    --pending <size>      Maximum input pending for output.\n"
 "    -h, --help            Show help information.\n"
 "    -V, --version         Show version information.\n"
 ;
 
+//\ Program Settings
+typedef struct options_struct {
+    size_t queue_limit;    // limit of pending output for non-blocking I/O
+    size_t flush_latency;  // maximum delay of output (milliseconds)
+    size_t flush_size;     // maximum input pending for output
+    const char* index;     // path of index of output lines (NULL: none)
+    const char* widths;    // path of table of widths (NULL: built-in)
+    bool breaking;         // whether to write line breaks rather than text
+    bool nonblocking;      // whether to poll on non-blocking stdin and stdout
+    bool coalescing;       // whether to coalesce output across lines
+} options_t;
+
+//\ Output Queue for Non-blocking I/O
+static struct {
+    uint8_t* buf;
+    size_t size;
+    size_t head;  // start of pending output
+    size_t tail;  // end of pending output
+    size_t limit;
+} queue;
+
+//\ Input Pending for Output
+static struct {
+    struct timespec since;  // when the earliest pending input was read
+    size_t size;
+} backlog;
+
+//\ Index of Output Lines
+static struct {
+    ufold_index_t* writer;
+    FILE* file;
+    size_t offset;  // size of input fed so far
+} indexing;
+
+//\ Input Pending for Line Breaks
+static struct {
+    ufold_iter_t iter;
+    uint8_t* buf;
+    size_t size;
+    size_t capacity;
+    size_t offset;  // offset of buf in input
+    size_t last;  // offset of the end of the previous line in input
+    size_t lines;  // number of records written
+} breaks;
+
+//\ Table of Widths Mapped into Memory
+static struct {
+    ufold_width_table_t table;
+    void* data;  // (NULL: none)
+    size_t size;
+} widths;
+
 static bool write_to_stdout(const void* s, size_t n)
 {
     return (n > 0) ? (fwrite(s, n, 1, stdout) == 1) : true;
@@ -150,6 +356,141 @@ static bool write_to_stderr(const void* s, size_t n)
     return (n > 0) ? (fwrite(s, n, 1, stderr) == 1) : true;
 }
 
+static bool write_to_index(const void* s, size_t n)
+{
+    return (n > 0) ? (fwrite(s, n, 1, indexing.file) == 1) : true;
+}
+
+static bool write_to_queue(const void* s, size_t n)
+{
+    if (n <= 0) {
+        return true;
+    }
+    if (queue.size - queue.tail < n) {
+        size_t used = queue.tail - queue.head;
+
+        if (queue.size - used < n) {
+            size_t size = used;
+
+            if (!add(&size, n)) {
+                logged_return(false);
+            }
+            size = try_align(size);
+
+            uint8_t* buf = realloc(queue.buf, size);
+
+            if (buf == NULL) {
+                logged_return(false);
+            }
+            queue.buf = buf;
+            queue.size = size;
+        }
+        memmove(queue.buf, queue.buf + queue.head, used);
+        queue.head = 0;
+        queue.tail = used;
+    }
+    memcpy(queue.buf + queue.tail, s, n);
+    queue.tail += n;
+
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Write pending output after poll reports stdout writable.
+ /   At most PIPE_BUF bytes are written at a time, which a writable pipe takes
+ /   without blocking, so stdout is never switched to non-blocking mode.
+\*/
+static bool drain_queue(void)
+{
+    size_t size = queue.tail - queue.head;
+    ssize_t n = write(STDOUT_FILENO, queue.buf + queue.head,
+                      (size < PIPE_BUF) ? size : PIPE_BUF);
+
+    if (n < 0) {
+        if (errno != EINTR) {
+            logged_return(false);
+        }
+        errno = 0;
+        n = 0;
+    }
+    queue.head += n;
+
+    if (queue.head >= queue.tail) {
+        queue.head = 0;
+        queue.tail = 0;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Wait for stdout and write all pending output.
+\*/
+static bool drain_queue_fully(void)
+{
+    while (queue.head < queue.tail) {
+        struct pollfd fds[1] = {{STDOUT_FILENO, POLLOUT, 0}};
+
+        if (poll(fds, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logged_return(false);
+        }
+        if (!drain_queue()) {
+            logged_return(false);
+        }
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Map a table of widths into memory until unload_width_table.
+\*/
+static bool load_width_table(const char* path, ufold_vm_config_t* config)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd == -1) {
+        logged_return(false);
+    }
+    if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+        close(fd);
+        logged_return(false);
+    }
+    // the mapping stays after the file is closed
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        logged_return(false);
+    }
+    if (!ufold_width_table_init(&widths.table, data, st.st_size)) {
+        munmap(data, st.st_size);
+        logged_return(false);
+    }
+    widths.data = data;
+    widths.size = st.st_size;
+    config->width_table = &widths.table;
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Unmap the table of widths after all VMs referring to it are freed.
+\*/
+static void unload_width_table(void)
+{
+    if (widths.data != NULL) {
+        (void)munmap(widths.data, widths.size);
+        widths.data = NULL;
+        widths.size = 0;
+    }
+}
+
 static bool vwrite(const void* s, size_t n, ufold_vm_config_t config)
 {
     ufold_vm_t* vm = ufold_vm_new(&config);
@@ -174,8 +515,17 @@ static void print_manual(ufold_vm_config_t config)
     config.hang_punctuation = false;
     config.keep_indentation = true;
     config.break_at_spaces = true;
+    config.truncate = false;
+    config.trusted = false;
+    config.input_encoding = UFOLD_ENCODING_UTF8;
+    config.cache_lines = 0;
+    config.max_lines = 0;
 
-    bool done = vwrite(manual, strlen(manual), config);
+    bool done = true;
+
+    for (size_t i = 0; done && manual[i] != NULL; ++i) {
+        done = vwrite(manual[i], strlen(manual[i]), config);
+    }
     debug_assert(done);
 
     exit(done ? EXIT_SUCCESS : EXIT_FAILURE);
@@ -187,6 +537,11 @@ static void print_help(bool error, ufold_vm_config_t config)
     config.hang_punctuation = false;
     config.keep_indentation = true;
     config.break_at_spaces = true;
+    config.truncate = false;
+    config.trusted = false;
+    config.input_encoding = UFOLD_ENCODING_UTF8;
+    config.cache_lines = 0;
+    config.max_lines = 0;
 
     bool done = vwrite(usage, strlen(usage), config);
     debug_assert(done);
@@ -199,6 +554,10 @@ static void print_version(ufold_vm_config_t config)
     char* info = PROGRAM " " VERSION "\n" COPYRIGHT "\n" LICENSE "\n";
     config.write = write_to_stdout;
     config.max_width = 0;
+    config.max_lines = 0;
+    config.trusted = false;
+    config.input_encoding = UFOLD_ENCODING_UTF8;
+    config.cache_lines = 0;
 
     bool done = vwrite(info, strlen(info), config);
     debug_assert(done);
@@ -206,7 +565,32 @@ static void print_version(ufold_vm_config_t config)
     exit(done ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
-static bool parse_options(int* argc, char*** argv, ufold_vm_config_t* config)
+static bool parse_encoding(const char* str, ufold_encoding_t* encoding)
+{
+    static const struct {
+        const char* name;
+        ufold_encoding_t encoding;
+    } names[] = {
+        {"utf-8",        UFOLD_ENCODING_UTF8},
+        {"utf-16",       UFOLD_ENCODING_UTF16},
+        {"utf-16le",     UFOLD_ENCODING_UTF16LE},
+        {"utf-16be",     UFOLD_ENCODING_UTF16BE},
+        {"latin-1",      UFOLD_ENCODING_LATIN1},
+        {"iso-8859-1",   UFOLD_ENCODING_LATIN1},
+        {"cp1252",       UFOLD_ENCODING_CP1252},
+        {"windows-1252", UFOLD_ENCODING_CP1252},
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (!strcmp(names[i].name, str)) {
+            *encoding = names[i].encoding;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_options(int* argc, char*** argv, ufold_vm_config_t* config,
+                          options_t* options)
 {
     static const struct optparse_long optspecs[] = {
         {"width",    'w',  OPTPARSE_REQUIRED},
@@ -214,7 +598,24 @@ static bool parse_options(int* argc, char*** argv, ufold_vm_config_t* config)
         {"hang",     'p',  OPTPARSE_OPTIONAL},
         {"indent",   'i',  OPTPARSE_NONE},
         {"spaces",   's',  OPTPARSE_NONE},
+        {"optimal",   0,   OPTPARSE_NONE},
+        {"unicode-breaks", 0, OPTPARSE_NONE},
+        {"graphemes", 0,   OPTPARSE_NONE},
+        {"ansi",      0,   OPTPARSE_NONE},
+        {"truncate",  0,   OPTPARSE_OPTIONAL},
+        {"max-lines", 0,   OPTPARSE_REQUIRED},
+        {"trusted",   0,   OPTPARSE_NONE},
+        {"input-encoding", 0, OPTPARSE_REQUIRED},
+        {"cache",     0,   OPTPARSE_REQUIRED},
+        {"ambiguous", 0,   OPTPARSE_REQUIRED},
+        {"width-table", 0, OPTPARSE_REQUIRED},
         {"bytes",    'b',  OPTPARSE_NONE},
+        {"count",     0,   OPTPARSE_NONE},
+        {"index",     0,   OPTPARSE_REQUIRED},
+        {"emit",      0,   OPTPARSE_REQUIRED},
+        {"nonblock",  0,   OPTPARSE_OPTIONAL},
+        {"latency",   0,   OPTPARSE_REQUIRED},
+        {"pending",   0,   OPTPARSE_REQUIRED},
         {"help",     'h',  OPTPARSE_NONE},
         {"version",  'V',  OPTPARSE_NONE},
         {0}
@@ -222,21 +623,44 @@ static bool parse_options(int* argc, char*** argv, ufold_vm_config_t* config)
 
     size_t max_width = config->max_width;
     size_t tab_width = config->tab_width;
+    size_t max_lines = config->max_lines;
+    size_t cache_lines = config->cache_lines;
+    size_t ambiguous_width = config->ambiguous_width;
+    size_t queue_limit = options->queue_limit;
+    size_t flush_latency = options->flush_latency;
+    size_t flush_size = options->flush_size;
     char* punctuation = NULL;
+    char* ellipsis = NULL;
+    const char* index = options->index;
+    const char* widths = options->widths;
+    bool to_use_nonblocking = options->nonblocking;
+    bool to_coalesce_output = options->coalescing;
+    bool to_emit_breaks = options->breaking;
     bool to_hang_punctuation = false;
     bool to_print_help = false;
     bool to_print_manual = false;
     bool to_print_version = false;
     bool to_keep_indentation = false;
     bool to_break_at_spaces = false;
+    bool to_fill_optimally = false;
+    bool to_break_by_unicode = false;
+    bool to_keep_graphemes = false;
+    bool to_pass_escapes = false;
+    bool to_truncate = false;
+    bool to_trust_input = false;
+    ufold_encoding_t input_encoding = UFOLD_ENCODING_UTF8;
     bool to_count_bytes = false;
+    bool to_count_output = false;
 
     int c = -1;
     int t = -1;
+    int k = -1;
     struct optparse opt;
     optparse_init(&opt, *argv);
 
-    while ((c = optparse_long(&opt, optspecs, NULL)) != -1) {
+    while ((c = optparse_long(&opt, optspecs, &k)) != -1) {
+        const char* name = (c == 0) ? optspecs[k].longname : "";
+
         switch (c) {
             case 'i': to_keep_indentation = true; break;
             case 's': to_break_at_spaces = true; break;
@@ -274,6 +698,111 @@ static bool parse_options(int* argc, char*** argv, ufold_vm_config_t* config)
                     return false;
                 }
                 break;
+            case 0:
+                if (!strcmp("optimal", name)) {
+                    to_break_at_spaces = true;
+                    to_fill_optimally = true;
+                    break;
+                }
+                if (!strcmp("unicode-breaks", name)) {
+                    to_break_at_spaces = true;
+                    to_break_by_unicode = true;
+                    break;
+                }
+                if (!strcmp("graphemes", name)) {
+                    to_keep_graphemes = true;
+                    break;
+                }
+                if (!strcmp("ansi", name)) {
+                    to_pass_escapes = true;
+                    break;
+                }
+                if (!strcmp("truncate", name)) {
+                    to_truncate = true;
+                    ellipsis = (opt.optarg != NULL && strlen(opt.optarg) > 0)
+                        ? opt.optarg : NULL;
+                    break;
+                }
+                if (!strcmp("max-lines", name) || !strcmp("cache", name)) {
+                    bool is_max_lines = !strcmp("max-lines", name);
+                    size_t* lines = is_max_lines ? &max_lines : &cache_lines;
+
+                    if (!parse_integer(opt.optarg, lines)) {
+                        warn("option requires a non-negative integer -- '%s'",
+                             name);
+                        return false;
+                    }
+                    break;
+                }
+                if (!strcmp("ambiguous", name)) {
+                    if (!parse_integer(opt.optarg, &ambiguous_width) ||
+                            ambiguous_width < 1 || ambiguous_width > 2) {
+                        warn("option requires 1 or 2 -- '%s'", name);
+                        return false;
+                    }
+                    break;
+                }
+                if (!strcmp("width-table", name)) {
+                    widths = opt.optarg;
+                    break;
+                }
+                if (!strcmp("trusted", name)) {
+                    to_trust_input = true;
+                    break;
+                }
+                if (!strcmp("input-encoding", name)) {
+                    if (!parse_encoding(opt.optarg, &input_encoding)) {
+                        warn("option requires utf-8, utf-16, utf-16le,"
+                             " utf-16be, latin-1 or cp1252 -- '%s'", name);
+                        return false;
+                    }
+                    break;
+                }
+                if (!strcmp("count", name)) {
+                    to_count_output = true;
+                    break;
+                }
+                if (!strcmp("index", name)) {
+                    index = opt.optarg;
+                    break;
+                }
+                if (!strcmp("emit", name)) {
+                    if (!strcmp("text", opt.optarg)) {
+                        to_emit_breaks = false;
+                    } else if (!strcmp("breaks", opt.optarg)) {
+                        to_emit_breaks = true;
+                    } else {
+                        warn("option requires text or breaks -- '%s'", name);
+                        return false;
+                    }
+                    break;
+                }
+                if (!strcmp("nonblock", name)) {
+                    to_use_nonblocking = true;
+
+                    if (opt.optarg == NULL) {
+                        queue_limit = QUEUE_LIMIT;
+                    } else if (!parse_integer(opt.optarg, &queue_limit)) {
+                        warn("option requires a non-negative integer -- '%s'",
+                             name);
+                        return false;
+                    }
+                    break;
+                }
+                if (!strcmp("latency", name) || !strcmp("pending", name)) {
+                    bool is_latency = !strcmp("latency", name);
+                    size_t* limit = is_latency ? &flush_latency : &flush_size;
+
+                    if (!parse_integer(opt.optarg, limit)) {
+                        warn("option requires a non-negative integer -- '%s'",
+                             name);
+                        return false;
+                    }
+                    to_coalesce_output = true;
+                    break;
+                }
+                warn("unhandled option '%s', please report to %s", name, ISSUES);
+                exit(EXIT_FAILURE);
             case '?':
                 warn("%s", opt.errmsg);
                 return false;
@@ -291,14 +820,60 @@ static bool parse_options(int* argc, char*** argv, ufold_vm_config_t* config)
         warn("option requires well-formed non-control characters -- '%c'", t);
         return false;
     }
+    if (ellipsis != NULL && !check_text(ellipsis, strlen(ellipsis),
+                                        to_count_bytes)) {
+        warn("option requires well-formed non-control characters -- '%s'",
+             "truncate");
+        return false;
+    }
+    // output is not measured without wrapping
+    if (index != NULL && max_width == 0 && !to_count_output) {
+        warn("option requires a positive width -- '%s'", "index");
+        return false;
+    }
+    // line breaks are planned only at spaces
+    if (to_fill_optimally && to_break_by_unicode) {
+        warn("option conflicts with --optimal -- '%s'", "unicode-breaks");
+        return false;
+    }
+    // line breaks are found without VM
+    if (to_emit_breaks && (index != NULL || to_count_output ||
+                           to_fill_optimally ||
+                           input_encoding != UFOLD_ENCODING_UTF8)) {
+        warn("option conflicts with --index, --count, --optimal and"
+             " --input-encoding -- '%s'", "emit");
+        return false;
+    }
 
     config->max_width = max_width;
     config->tab_width = tab_width;
+    config->max_lines = max_lines;
     config->punctuation = punctuation;
     config->hang_punctuation = to_hang_punctuation;
     config->keep_indentation = to_keep_indentation;
     config->break_at_spaces = to_break_at_spaces;
+    config->optimal_fit = to_fill_optimally;
+    config->unicode_breaks = to_break_by_unicode;
+    config->graphemes = to_keep_graphemes;
+    config->ansi_escapes = to_pass_escapes;
+    config->ellipsis = ellipsis;
+    config->truncate = to_truncate;
+    config->trusted = to_trust_input;
+    config->input_encoding = input_encoding;
+    config->cache_lines = cache_lines;
+    config->ambiguous_width = ambiguous_width;
     config->ascii_mode = to_count_bytes;
+    config->count_only = to_count_output;
+    options->queue_limit = queue_limit;
+    options->flush_latency = flush_latency;
+    options->flush_size = flush_size;
+    options->index = index;
+    options->widths = widths;
+    options->breaking = to_emit_breaks;
+    // no output to wait for
+    options->nonblocking = to_use_nonblocking && !to_count_output
+                           && !to_emit_breaks;
+    options->coalescing = to_coalesce_output && !to_emit_breaks;
 
     if (to_print_manual) print_manual(*config);
     else if (to_print_help) print_help(false, *config);
@@ -307,25 +882,347 @@ static bool parse_options(int* argc, char*** argv, ufold_vm_config_t* config)
     return true;
 }
 
-static bool wrap_input(ufold_vm_t* vm, FILE* stream)
+#define BUFSIZE 4096
+
+/*\
+ / DESCRIPTION
+ /   Check whether no input is immediately available.
+\*/
+static bool is_idle(int fd)
+{
+    struct pollfd fds[1] = {{fd, POLLIN, 0}};
+    int n = -1;
+
+    do {
+        n = poll(fds, 1, 0);
+    } while (n < 0 && errno == EINTR);
+
+    return n == 0;
+}
+
+/*\
+ / DESCRIPTION
+ /   Get the milliseconds elapsed since the given time.
+\*/
+static size_t elapsed_msecs(const struct timespec* since)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        return SIZE_MAX;
+    }
+    if (now.tv_sec < since->tv_sec) {
+        return 0;
+    }
+    return (size_t)(now.tv_sec - since->tv_sec) * 1000
+        + (size_t)(now.tv_nsec / 1000000) - (size_t)(since->tv_nsec / 1000000);
+}
+
+/*\
+ / DESCRIPTION
+ /   Account for input fed into the VM and write a checkpoint when due.
+\*/
+static bool index_input(ufold_vm_t* vm, size_t size)
+{
+    if (indexing.writer == NULL) {
+        return true;
+    }
+    // check overflow
+    if (!add(&indexing.offset, size)) {
+        logged_return(false);
+    }
+    return ufold_index_update(indexing.writer, vm, indexing.offset);
+}
+
+static bool flush_output(ufold_vm_t* vm, const options_t* options)
+{
+    if (!ufold_vm_flush(vm)) {
+        logged_return(false);
+    }
+    if (!options->nonblocking && fflush(stdout) != 0) {
+        logged_return(false);
+    }
+    backlog.size = 0;
+
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Feed input into the VM and flush output according to the flush policy.
+ /   Without the policy, flush after every chunk that contains linefeeds.
+\*/
+static bool feed_input(ufold_vm_t* vm, const char* buf, size_t size,
+                       const options_t* options)
+{
+    if (!ufold_vm_feed(vm, buf, size)) {
+        logged_return(false);
+    }
+    if (!options->coalescing) {
+        if (has_linefeed((void*)buf, size, true) && !ufold_vm_flush(vm)) {
+            logged_return(false);
+        }
+        return index_input(vm, size);
+    }
+    if (size <= 0) {
+        return true;
+    }
+    if (backlog.size <= 0
+            && clock_gettime(CLOCK_MONOTONIC, &backlog.since) != 0) {
+        logged_return(false);
+    }
+    if (!add(&backlog.size, size)) {
+        backlog.size = SIZE_MAX;
+    }
+    if (backlog.size >= options->flush_size ||
+            elapsed_msecs(&backlog.since) >= options->flush_latency) {
+        if (!flush_output(vm, options)) {
+            logged_return(false);
+        }
+    }
+    return index_input(vm, size);
+}
+
+// records of the maximum lines have been written
+static bool is_emitted(void)
+{
+    return breaks.iter.config.max_lines > 0 &&
+        breaks.lines >= breaks.iter.config.max_lines;
+}
+
+/*\
+ / DESCRIPTION
+ /   Check whether the maximum lines of output have been written, so that no
+ /   more input needs to be read.
+\*/
+static bool is_done(const ufold_vm_t* vm, const options_t* options)
+{
+    return options->breaking ? is_emitted() : ufold_vm_done(vm);
+}
+
+/*\
+ / DESCRIPTION
+ /   Read input as long as the pending output is below the limit, and write
+ /   pending output whenever stdout is ready, so that neither side stalls the
+ /   other one.
+\*/
+static bool wrap_input_nonblocking(ufold_vm_t* vm, FILE* stream,
+                                   const options_t* options)
+{
+    int fd = fileno(stream);
+    char buf[BUFSIZE];
+
+    while (true) {
+        if (backlog.size > 0 && is_idle(fd) && !flush_output(vm, options)) {
+            logged_return(false);
+        }
+
+        size_t pending = queue.tail - queue.head;
+        struct pollfd fds[2] = {
+            {fd, (pending < queue.limit || pending == 0) ? POLLIN : 0, 0},
+            {STDOUT_FILENO, (pending > 0) ? POLLOUT : 0, 0},
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logged_return(false);
+        }
+        if (fds[1].revents != 0 && !drain_queue()) {
+            logged_return(false);
+        }
+        if (fds[0].revents != 0) {
+            ssize_t size = read(fd, buf, BUFSIZE);
+
+            if (size < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+                    errno = 0;
+                    continue;
+                }
+                logged_return(false);
+            }
+            if (size == 0) {
+                break;
+            }
+            if (!feed_input(vm, buf, size, options)) {
+                logged_return(false);
+            }
+            if (is_done(vm, options)) {
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Read whatever input is available and hold output until the flush policy
+ /   says otherwise, so that bursts of short lines cost a single write.
+\*/
+static bool wrap_input_coalesced(ufold_vm_t* vm, FILE* stream,
+                                 const options_t* options)
+{
+    int fd = fileno(stream);
+    char buf[BUFSIZE];
+
+    while (true) {
+        if (backlog.size > 0 && is_idle(fd) && !flush_output(vm, options)) {
+            logged_return(false);
+        }
+
+        ssize_t size = read(fd, buf, BUFSIZE);
+
+        if (size < 0) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
+            }
+            logged_return(false);
+        }
+        if (size == 0) {
+            break;
+        }
+        if (!feed_input(vm, buf, size, options)) {
+            logged_return(false);
+        }
+        if (is_done(vm, options)) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Write a record of line break for each wrapped line in input.
+\*/
+static bool emit_lines(void)
+{
+    ufold_span_t span;
+
+    while (!is_emitted() && ufold_iter_next(&breaks.iter, &span)) {
+        // NOTE: record :: skipped size brk width indent
+        size_t start = span.start;
+        size_t end = span.end;
+        size_t fields[5] = {
+            start - breaks.last, end - start, span.brk,
+            span.width, span.indent,
+        };
+        uint8_t record[sizeof(fields) / sizeof(size_t) * 10];
+        size_t n = 0;
+
+        for (size_t i = 0; i < sizeof(fields) / sizeof(size_t); ++i) {
+            size_t value = fields[i];
+
+            do {
+                record[n++] = (value & 0x7F) | ((value > 0x7F) ? 0x80 : 0);
+                value >>= 7;
+            } while (value > 0);
+        }
+        if (!write_to_stdout(record, n)) {
+            logged_return(false);
+        }
+        breaks.last = end;
+        breaks.lines += 1;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Write line breaks as soon as input decides them, and keep only the rest
+ /   of input that is still to be wrapped.
+\*/
+static bool emit_input(const char* buf, size_t size, bool stopped)
+{
+    if (breaks.capacity - breaks.size < size) {
+        size_t capacity = breaks.size;
+
+        // check overflow
+        if (!add(&capacity, size)) {
+            logged_return(false);
+        }
+        capacity = try_align(capacity);
+
+        uint8_t* bytes = realloc(breaks.buf, capacity);
+
+        if (bytes == NULL) {
+            logged_return(false);
+        }
+        breaks.buf = bytes;
+        breaks.capacity = capacity;
+    }
+    if (size > 0) {
+        memcpy(breaks.buf + breaks.size, buf, size);
+        breaks.size += size;
+    }
+
+    ufold_iter_feed(&breaks.iter, breaks.buf, breaks.size, !stopped);
+
+    if (!emit_lines()) {
+        logged_return(false);
+    }
+
+    // input before the line in progress is never read again
+    size_t n = ufold_iter_rest(&breaks.iter) - breaks.offset;
+
+    if (n > 0) {
+        memmove(breaks.buf, breaks.buf + n, breaks.size - n);
+        breaks.size -= n;
+        breaks.offset += n;
+    }
+    if (fflush(stdout) != 0) {
+        logged_return(false);
+    }
+    return true;
+}
+
+static bool emit_breaks(FILE* stream)
+{
+    char buf[BUFSIZE];
+
+    do {
+        size_t size = fread(buf, 1, BUFSIZE, stream);
+        if (ferror(stream)) {
+            logged_return(false);
+        }
+        if (!emit_input(buf, size, false)) {
+            logged_return(false);
+        }
+    } while (!feof(stream) && !is_emitted());
+
+    return true;
+}
+
+static bool wrap_input(ufold_vm_t* vm, FILE* stream, const options_t* options)
 {
+    if (options->breaking) {
+        return emit_breaks(stream);
+    }
+    if (options->nonblocking) {
+        return wrap_input_nonblocking(vm, stream, options);
+    }
+    if (options->coalescing) {
+        return wrap_input_coalesced(vm, stream, options);
+    }
+
     bool is_interactive = isatty(fileno(stream));
 
     if (!is_interactive) {
-#define BUFSIZE 4096
         char buf[BUFSIZE];
         do {
             size_t size = fread(buf, 1, BUFSIZE, stream);
             if (ferror(stream)) {
                 logged_return(false);
             }
-            if (!ufold_vm_feed(vm, buf, size)) {
-                logged_return(false);
-            }
-            if (has_linefeed((void*)buf, size, true) && !ufold_vm_flush(vm)) {
+            if (!feed_input(vm, buf, size, options)) {
                 logged_return(false);
             }
-        } while (!feof(stream));
+        } while (!feof(stream) && !ufold_vm_done(vm));
     } else {
         char c;
         do {
@@ -341,7 +1238,10 @@ static bool wrap_input(ufold_vm_t* vm, FILE* stream)
             if (is_linefeed(c, true) && !ufold_vm_flush(vm)) {
                 logged_return(false);
             }
-        } while (!feof(stream));
+            if (!index_input(vm, n)) {
+                logged_return(false);
+            }
+        } while (!feof(stream) && !ufold_vm_done(vm));
     }
 
     return true;
@@ -360,12 +1260,57 @@ int main(int argc, char** argv)
     config.write = NULL;
     config.realloc = NULL;
 
-    if (!parse_options(&argc, &argv, &config)) {
+    options_t options;
+    options.queue_limit = QUEUE_LIMIT;
+    options.flush_latency = SIZE_MAX;
+    options.flush_size = SIZE_MAX;
+    options.index = NULL;
+    options.widths = getenv("UFOLD_WIDTH_TABLE");
+    options.breaking = false;
+    options.nonblocking = false;
+    options.coalescing = false;
+
+    // an empty variable is the same as none
+    if (options.widths != NULL && *options.widths == '\0') {
+        options.widths = NULL;
+    }
+    if (!parse_options(&argc, &argv, &config, &options)) {
         fputc('\n', stderr);
         print_help(true, config);
     }
+    // a closed pipe is reported by EPIPE rather than killing the process
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        warn("%s", "failed to ignore SIGPIPE");
+        return EXIT_FAILURE;
+    }
+
+    if (options.widths != NULL) {
+        if (!load_width_table(options.widths, &config)) {
+            warn("failed to load width table \"%s\"", options.widths);
+            return EXIT_FAILURE;
+        }
+    }
+    // the VM and the iterator of line breaks share the set
+    ufold_punct_t* punct = NULL;
+
+    if (config.hang_punctuation) {
+        if ((punct = ufold_punct_new(&config)) == NULL) {
+            warn("%s", "failed to compile punctuation");
+            unload_width_table();
+            return EXIT_FAILURE;
+        }
+        config.punct = punct;
+    }
+    if (options.breaking) {
+        ufold_iter_init(&breaks.iter, &config, NULL, 0);
+    }
+    if (options.nonblocking) {
+        queue.limit = options.queue_limit;
+        config.write = write_to_queue;
+    }
 
     FILE* stream = NULL;
+    bool closed = false;  // whether stdout is a pipe closed by the reader
     ufold_vm_t* vm = ufold_vm_new(&config);
 
     if (vm == NULL) {
@@ -373,6 +1318,17 @@ int main(int argc, char** argv)
         goto FAIL;
     }
 
+    if (options.index != NULL) {
+        indexing.file = fopen(options.index, "wb");
+        indexing.writer = (indexing.file != NULL) ?
+            ufold_index_new(write_to_index, NULL, INDEX_INTERVAL) : NULL;
+
+        if (indexing.writer == NULL || !index_input(vm, 0)) {
+            warn("failed to write index \"%s\"", options.index);
+            goto FAIL;
+        }
+    }
+
     if (argc > 0) {
         for (int i = 0; i < argc; ++i) {
             const char* filepath = argv[i];
@@ -384,43 +1340,114 @@ int main(int argc, char** argv)
                 warn("failed to open \"%s\"", alias);
                 goto FAIL;
             }
-            if (!wrap_input(vm, stream)) {
-                warn("failed to process \"%s\"", alias);
+            if (!wrap_input(vm, stream, &options)) {
+                if (errno != EPIPE) {
+                    warn("failed to process \"%s\"", alias);
+                }
                 goto FAIL;
             }
-            if (stream != stdin && fclose(stream) != 0) {
-                warn("failed to close \"%s\"", alias);
-                goto FAIL;
+            if (stream != stdin) {
+                FILE* file = stream;
+
+                stream = NULL;  // a closed stream must not be touched again
+
+                if (fclose(file) != 0) {
+                    warn("failed to close \"%s\"", alias);
+                    goto FAIL;
+                }
+            }
+            if (is_done(vm, &options)) {
+                break;
             }
         }
     } else {
         stream = stdin;
 
-        if (!wrap_input(vm, stream)) {
-            warn("%s", "failed to process stdin");
+        if (!wrap_input(vm, stream, &options)) {
+            if (errno != EPIPE) {
+                warn("%s", "failed to process stdin");
+            }
             goto FAIL;
         }
     }
 
     if (stream != NULL && ferror(stream)) {
 FAIL:
-        if (errno != 0) {
+        if (errno == EPIPE) {
+            // the reader has gone, e.g. head(1), so stop quietly
+            closed = true;
+            errno = 0;
+        } else if (errno != 0) {
             warn("%s", strerror(errno));
             errno = 0;
         } else {
             warn("unknown error, please report bugs to %s", ISSUES);
         }
-        (void)fclose(stream);  // whatever
+        if (stream != NULL) {
+            (void)fclose(stream);  // whatever
+            stream = NULL;
+        }
 
-        exitcode = EXIT_FAILURE;
+        if (!closed) {
+            exitcode = EXIT_FAILURE;
+        }
     }
 
     // flush all output
-    if (!ufold_vm_stop(vm)) {
-        warn("%s", "failed to stop vm");
+    if (closed) {
+        // nothing more is worth writing
+    } else if (options.breaking && !emit_input(NULL, 0, true)) {
+        warn("%s", "failed to write line breaks");
+        exitcode = EXIT_FAILURE;
+    }
+    free(breaks.buf);
+    breaks.buf = NULL;
+
+    if (!closed && !ufold_vm_stop(vm)) {
+        if (errno != EPIPE) {
+            warn("%s", "failed to stop vm");
+        }
         goto FAIL;
     }
+    if (config.count_only && !closed) {
+        ufold_metrics_t metrics;
+        ufold_vm_metrics(vm, &metrics);
+
+        ufold_cache_stats_t stats;
+        ufold_vm_cache_stats(vm, &stats);
+
+        int k = (config.cache_lines > 0)
+            ? printf("%zu %zu %zu %zu %zu\n", metrics.lines, metrics.max_width,
+                     metrics.bytes, stats.hits, stats.misses)
+            : printf("%zu %zu %zu\n", metrics.lines, metrics.max_width,
+                     metrics.bytes);
+
+        if (k < 0) {
+            warn("%s", "failed to write metrics");
+            exitcode = EXIT_FAILURE;
+        }
+    }
     ufold_vm_free(vm);
+    ufold_punct_free(punct);
+    unload_width_table();
+
+    if (indexing.writer != NULL) {
+        bool finished = ufold_index_finish(indexing.writer);
+
+        ufold_index_free(indexing.writer);
+
+        if (fclose(indexing.file) != 0 || !finished) {
+            warn("failed to write index \"%s\"", options.index);
+            exitcode = EXIT_FAILURE;
+        }
+    }
+
+    if (options.nonblocking && !closed && !drain_queue_fully() &&
+            errno != EPIPE) {
+        warn("%s", strerror(errno));
+        exitcode = EXIT_FAILURE;
+    }
+    free(queue.buf);
 
     debug_assert(exitcode == EXIT_SUCCESS);
     return exitcode;
@@ -0,0 +1,376 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stdbool.h"
+#include "../utf8proc/utf8proc.h"
+#include "widthclass.h"
+
+#define PROGRAM "mklinebreak"
+
+//\ Line Breaking Classes of UAX #14 (in the order of the pair table)
+static const char* const names[] = {
+    "OP", "CL", "CP", "QU", "GL", "NS", "EX", "SY", "IS", "PR",
+    "PO", "NU", "AL", "HL", "ID", "IN", "HY", "BA", "BB", "B2",
+    "ZW", "CM", "WJ", "H2", "H3", "JL", "JV", "JT", "RI",
+};
+
+enum {
+    OP, CL, CP, QU, GL, NS, EX, SY, IS, PR,
+    PO, NU, AL, HL, ID, IN, HY, BA, BB, B2,
+    ZW, CM, WJ, H2, H3, JL, JV, JT, RI,
+    CLASSES
+};
+
+//\ Pair Table of UAX #14 (row: class before; column: class after)
+//   _ :: direct break
+//   % :: indirect break (only with spaces in between)
+//   # :: combining indirect break
+//   @ :: combining prohibited break
+//   ^ :: prohibited break
+static const char* const pairs[CLASSES] = {
+  /* OP CL CP QU GL NS EX SY IS PR PO NU AL HL ID IN HY BA BB B2 ZW CM WJ H2 H3 JL JV JT RI */
+    "^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  ^  @  ^  ^  ^  ^  ^  ^  ^",
+    "_  ^  ^  %  %  ^  ^  ^  ^  %  %  _  _  _  _  _  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "_  ^  ^  %  %  ^  ^  ^  ^  %  %  %  %  %  _  _  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "^  ^  ^  %  %  %  ^  ^  ^  %  %  %  %  %  %  %  %  %  %  %  ^  #  ^  %  %  %  %  %  %",
+    "%  ^  ^  %  %  %  ^  ^  ^  %  %  %  %  %  %  %  %  %  %  %  ^  #  ^  %  %  %  %  %  %",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  _  _  _  _  _  _  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  _  _  _  _  _  %  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  _  %  _  %  _  _  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  _  %  %  %  _  _  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "%  ^  ^  %  %  %  ^  ^  ^  _  _  %  %  %  %  _  %  %  _  _  ^  #  ^  %  %  %  %  %  _",
+    "%  ^  ^  %  %  %  ^  ^  ^  _  _  %  %  %  _  _  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "%  ^  ^  %  %  %  ^  ^  ^  %  %  %  %  %  _  %  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "%  ^  ^  %  %  %  ^  ^  ^  %  %  %  %  %  _  %  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "%  ^  ^  %  %  %  ^  ^  ^  %  %  %  %  %  _  %  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  %  _  _  _  _  %  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  _  _  _  _  _  %  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "_  ^  ^  %  _  %  ^  ^  ^  _  _  %  _  _  _  _  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "_  ^  ^  %  _  %  ^  ^  ^  _  _  _  _  _  _  _  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "%  ^  ^  %  %  %  ^  ^  ^  %  %  %  %  %  %  %  %  %  %  %  ^  #  ^  %  %  %  %  %  %",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  _  _  _  _  _  _  %  %  _  ^  ^  #  ^  _  _  _  _  _  _",
+    "_  _  _  _  _  _  _  _  _  _  _  _  _  _  _  _  _  _  _  _  ^  _  _  _  _  _  _  _  _",
+    "%  ^  ^  %  %  %  ^  ^  ^  _  _  %  %  %  _  %  %  %  _  _  ^  #  ^  _  _  _  _  _  _",
+    "%  ^  ^  %  %  %  ^  ^  ^  %  %  %  %  %  %  %  %  %  %  %  ^  #  ^  %  %  %  %  %  %",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  %  _  _  _  _  %  %  %  _  _  ^  #  ^  _  _  _  %  %  _",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  %  _  _  _  _  %  %  %  _  _  ^  #  ^  _  _  _  _  %  _",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  %  _  _  _  _  %  %  %  _  _  ^  #  ^  %  %  %  %  _  _",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  %  _  _  _  _  %  %  %  _  _  ^  #  ^  _  _  _  %  %  _",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  %  _  _  _  _  %  %  %  _  _  ^  #  ^  _  _  _  _  %  _",
+    "_  ^  ^  %  %  %  ^  ^  ^  _  _  _  _  _  _  _  %  %  _  _  ^  #  ^  _  _  _  _  _  %",
+};
+
+//\ Classes of ASCII Characters (line feeds and spaces are left to the VM)
+static const char ascii[] =
+    "CM CM CM CM CM CM CM CM CM BA BA BA BA BA CM CM "
+    "CM CM CM CM CM CM CM CM CM CM CM CM CM CM CM CM "
+    "BA EX QU AL PR PO AL QU OP CP AL PR IS HY IS SY "
+    "NU NU NU NU NU NU NU NU NU NU IS IS AL AL AL EX "
+    "AL AL AL AL AL AL AL AL AL AL AL AL AL AL AL AL "
+    "AL AL AL AL AL AL AL AL AL AL AL OP PR CP AL AL "
+    "AL AL AL AL AL AL AL AL AL AL AL AL AL AL AL AL "
+    "AL AL AL AL AL AL AL AL AL AL AL OP BA CL AL CM ";
+
+//\ Classes of Characters Not Derived from General Categories
+static const struct {
+    int32_t first;
+    int32_t last;
+    int klass;
+} ranges[] = {
+    {0x0085, 0x0085, BA}, {0x00A0, 0x00A0, GL}, {0x00A1, 0x00A1, OP},
+    {0x00A2, 0x00A2, PO}, {0x00AD, 0x00AD, BA}, {0x00B0, 0x00B0, PO},
+    {0x00B1, 0x00B1, PR}, {0x00B4, 0x00B4, BB}, {0x00BF, 0x00BF, OP},
+    {0x02C8, 0x02C8, BB}, {0x02CC, 0x02CC, BB}, {0x02DF, 0x02DF, BB},
+    {0x034F, 0x034F, GL}, {0x037E, 0x037E, IS}, {0x0589, 0x0589, IS},
+    {0x05D0, 0x05EA, HL}, {0x05EF, 0x05F2, HL}, {0x060C, 0x060D, IS},
+    {0x07F8, 0x07F8, IS}, {0x0F0C, 0x0F0C, GL}, {0x1100, 0x115F, JL},
+    {0x1160, 0x11A7, JV}, {0x11A8, 0x11FF, JT}, {0x180E, 0x180E, GL},
+    {0x1FFD, 0x1FFD, BB}, {0x2007, 0x2007, GL}, {0x200B, 0x200B, ZW},
+    {0x2010, 0x2010, BA}, {0x2011, 0x2011, GL}, {0x2012, 0x2013, BA},
+    {0x2014, 0x2014, B2}, {0x2018, 0x201F, QU}, {0x2024, 0x2026, IN},
+    {0x202F, 0x202F, GL}, {0x2030, 0x2037, PO}, {0x2039, 0x203A, QU},
+    {0x203C, 0x203D, NS}, {0x2044, 0x2044, IS}, {0x2047, 0x2049, NS},
+    {0x2060, 0x2060, WJ}, {0x2103, 0x2103, PO}, {0x2109, 0x2109, PO},
+    {0x2116, 0x2116, PR}, {0x2212, 0x2213, PR}, {0x22EF, 0x22EF, IN},
+    {0x2E3A, 0x2E3B, B2}, {0x3001, 0x3002, CL}, {0x3005, 0x3005, NS},
+    {0x301C, 0x301C, NS}, {0x303B, 0x303C, NS}, {0x3041, 0x3041, NS},
+    {0x3043, 0x3043, NS}, {0x3045, 0x3045, NS}, {0x3047, 0x3047, NS},
+    {0x3049, 0x3049, NS}, {0x3063, 0x3063, NS}, {0x3083, 0x3083, NS},
+    {0x3085, 0x3085, NS}, {0x3087, 0x3087, NS}, {0x308E, 0x308E, NS},
+    {0x3095, 0x3096, NS}, {0x309B, 0x309E, NS}, {0x30A0, 0x30A1, NS},
+    {0x30A3, 0x30A3, NS}, {0x30A5, 0x30A5, NS}, {0x30A7, 0x30A7, NS},
+    {0x30A9, 0x30A9, NS}, {0x30C3, 0x30C3, NS}, {0x30E3, 0x30E3, NS},
+    {0x30E5, 0x30E5, NS}, {0x30E7, 0x30E7, NS}, {0x30EE, 0x30EE, NS},
+    {0x30F5, 0x30F6, NS}, {0x30FB, 0x30FE, NS}, {0x31F0, 0x31FF, NS},
+    {0x3400, 0x4DBF, ID}, {0x4E00, 0x9FFF, ID}, {0xA960, 0xA97C, JL},
+    {0xD7B0, 0xD7C6, JV}, {0xD7CB, 0xD7FB, JT}, {0xF900, 0xFAFF, ID},
+    {0xFB1D, 0xFB4F, HL}, {0xFE10, 0xFE10, IS}, {0xFE13, 0xFE14, IS},
+    {0xFE19, 0xFE19, IN}, {0xFEFF, 0xFEFF, WJ}, {0xFF01, 0xFF01, EX},
+    {0xFF05, 0xFF05, PO}, {0xFF0C, 0xFF0C, CL}, {0xFF0E, 0xFF0E, CL},
+    {0xFF1A, 0xFF1B, NS}, {0xFF1F, 0xFF1F, EX}, {0xFF65, 0xFF65, NS},
+    {0xFF9E, 0xFF9F, NS}, {0xFFE0, 0xFFE0, PO}, {0x1F1E6, 0x1F1FF, RI},
+    {0x20000, 0x2FFFD, ID}, {0x30000, 0x3FFFD, ID},
+};
+
+/*\
+ / DESCRIPTION
+ /   Derive the line breaking class of a character.
+ /   Classes are taken from ranges known to UAX #14 first, then approximated
+ /   by general categories and widths.  Scripts of complex context (SA) are
+ /   left unbroken as alphabetic.
+\*/
+static int derive(int32_t codepoint)
+{
+    if (codepoint < 0x80) {
+        const char* name = ascii + codepoint * 3;
+
+        for (int k = 0; k < CLASSES; ++k) {
+            if (!strncmp(names[k], name, 2)) {
+                return k;
+            }
+        }
+        return AL;
+    }
+    for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i) {
+        if (ranges[i].first <= codepoint && codepoint <= ranges[i].last) {
+            return ranges[i].klass;
+        }
+    }
+    if (codepoint >= 0xAC00 && codepoint <= 0xD7A3) {
+        return (codepoint - 0xAC00) % 28 == 0 ? H2 : H3;
+    }
+    switch (utf8proc_category(codepoint)) {
+        case UTF8PROC_CATEGORY_MN:
+        case UTF8PROC_CATEGORY_MC:
+        case UTF8PROC_CATEGORY_ME:
+        case UTF8PROC_CATEGORY_CC:
+        case UTF8PROC_CATEGORY_CF:
+            return CM;
+        case UTF8PROC_CATEGORY_PS: return OP;
+        case UTF8PROC_CATEGORY_PE: return CL;
+        case UTF8PROC_CATEGORY_PI:
+        case UTF8PROC_CATEGORY_PF:
+            return QU;
+        case UTF8PROC_CATEGORY_ND: return NU;
+        case UTF8PROC_CATEGORY_PD: return BA;
+        case UTF8PROC_CATEGORY_ZS: return BA;
+        case UTF8PROC_CATEGORY_ZL:
+        case UTF8PROC_CATEGORY_ZP:
+            return BA;
+        case UTF8PROC_CATEGORY_SC: return PR;
+        default:
+            break;
+    }
+    return utf8proc_charwidth(codepoint) >= 2 ? ID : AL;
+}
+
+//\ Grapheme Cluster Break Properties of UAX #29 (CR and LF are controls)
+static const char* const properties[] = {
+    "CONTROL", "OTHER", "EXTEND", "ZWJ", "SPACINGMARK", "PREPEND", "RI",
+    "L", "V", "T", "LV", "LVT", "PICT",
+};
+
+enum {
+    G_CONTROL, G_OTHER, G_EXTEND, G_ZWJ, G_SPACINGMARK, G_PREPEND, G_RI,
+    G_L, G_V, G_T, G_LV, G_LVT, G_PICT,
+    PROPERTIES
+};
+
+/*\
+ / DESCRIPTION
+ /   Map the grapheme cluster break property of a character from utf8proc.
+\*/
+static int property(int32_t codepoint)
+{
+    switch (utf8proc_get_property(codepoint)->boundclass) {
+        case UTF8PROC_BOUNDCLASS_CR:
+        case UTF8PROC_BOUNDCLASS_LF:
+        case UTF8PROC_BOUNDCLASS_CONTROL:
+            return G_CONTROL;
+        case UTF8PROC_BOUNDCLASS_EXTEND:
+        case UTF8PROC_BOUNDCLASS_E_MODIFIER:
+            return G_EXTEND;
+        case UTF8PROC_BOUNDCLASS_ZWJ:
+        case UTF8PROC_BOUNDCLASS_E_ZWG:
+            return G_ZWJ;
+        case UTF8PROC_BOUNDCLASS_SPACINGMARK: return G_SPACINGMARK;
+        case UTF8PROC_BOUNDCLASS_PREPEND: return G_PREPEND;
+        case UTF8PROC_BOUNDCLASS_REGIONAL_INDICATOR: return G_RI;
+        case UTF8PROC_BOUNDCLASS_L: return G_L;
+        case UTF8PROC_BOUNDCLASS_V: return G_V;
+        case UTF8PROC_BOUNDCLASS_T: return G_T;
+        case UTF8PROC_BOUNDCLASS_LV: return G_LV;
+        case UTF8PROC_BOUNDCLASS_LVT: return G_LVT;
+        case UTF8PROC_BOUNDCLASS_E_BASE:
+        case UTF8PROC_BOUNDCLASS_GLUE_AFTER_ZWJ:
+        case UTF8PROC_BOUNDCLASS_E_BASE_GAZ:
+        case UTF8PROC_BOUNDCLASS_EXTENDED_PICTOGRAPHIC:
+            return G_PICT;
+        default:
+            return G_OTHER;
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Print a two-stage table of values with the block size of least memory.
+ /   Packed values take four bits each, two in a byte.
+\*/
+static void emit(const char* array, const char* macro,
+                 const uint8_t* values, bool packed)
+{
+    static uint8_t blocks[0x110000];
+    static uint16_t index[0x110000];
+    size_t best_shift = 0;
+    size_t best_size = SIZE_MAX;
+
+    for (size_t shift = 4; shift <= 10; ++shift) {
+        size_t block_size = (size_t)1 << shift;
+        size_t count = 0;
+
+        for (size_t i = 0; i < 0x110000; i += block_size) {
+            size_t k = 0;
+
+            while (k < count && memcmp(blocks + k * block_size,
+                                       values + i, block_size)) {
+                ++k;
+            }
+            if (k == count) {
+                memcpy(blocks + count * block_size, values + i, block_size);
+                ++count;
+            }
+        }
+
+        size_t size = (0x110000 >> shift) * (count > 256 ? 2 : 1)
+                      + count * (packed ? block_size / 2 : block_size);
+
+        if (size < best_size) {
+            best_size = size;
+            best_shift = shift;
+        }
+    }
+
+    size_t block_size = (size_t)1 << best_shift;
+    size_t count = 0;
+
+    for (size_t i = 0; i < 0x110000; i += block_size) {
+        size_t k = 0;
+
+        while (k < count && memcmp(blocks + k * block_size,
+                                   values + i, block_size)) {
+            ++k;
+        }
+        if (k == count) {
+            memcpy(blocks + count * block_size, values + i, block_size);
+            ++count;
+        }
+        index[i >> best_shift] = k;
+    }
+
+    printf("// %zu bytes in two stages\n", best_size);
+    printf("#define %s_SHIFT %zu\n\n", macro, best_shift);
+    printf("static const %s %s_index[0x110000 >> %s_SHIFT] = {",
+           count > 256 ? "uint16_t" : "uint8_t", array, macro);
+    for (size_t i = 0; i < (0x110000 >> best_shift); ++i) {
+        printf("%s%u,", (i % 16 == 0) ? "\n    " : " ", index[i]);
+    }
+    printf("\n};\n\n");
+
+    if (packed) {
+        printf("static const uint8_t %s_blocks[%zu << (%s_SHIFT - 1)] = {",
+               array, count, macro);
+        for (size_t i = 0; i < count * block_size; i += 2) {
+            printf("%s0x%02X,", (i % 32 == 0) ? "\n    " : " ",
+                   blocks[i] | (blocks[i + 1] << 4));
+        }
+    } else {
+        printf("static const uint8_t %s_blocks[%zu << %s_SHIFT] = {",
+               array, count, macro);
+        for (size_t i = 0; i < count * block_size; ++i) {
+            printf("%s%2d,", (i % 16 == 0) ? "\n    " : " ", blocks[i]);
+        }
+    }
+    printf("\n};\n\n");
+}
+
+int main(void)
+{
+    static uint8_t values[0x110000];
+
+    printf("// generated by " PROGRAM " with utf8proc %s\n\n",
+           utf8proc_unicode_version());
+
+    //\ Line Breaking Classes
+    for (int32_t codepoint = 0; codepoint < 0x110000; ++codepoint) {
+        values[codepoint] = derive(codepoint);
+    }
+
+    printf("enum {\n");
+    for (int k = 0; k < CLASSES; ++k) {
+        printf("    LB_%s,\n", names[k]);
+    }
+    printf("    LB_CLASSES\n};\n\n");
+
+    // only direct breaks are kept: spaces are always breakpoints in the VM
+    printf("static const uint32_t lb_pairs[LB_CLASSES] = {\n");
+    for (int k = 0; k < CLASSES; ++k) {
+        uint32_t bits = 0;
+        int n = 0;
+
+        for (const char* s = pairs[k]; *s != '\0'; ++s) {
+            if (*s == ' ') {
+                continue;
+            }
+            if (n >= CLASSES || strchr("_%#@^", *s) == NULL) {
+                fprintf(stderr, "[ERROR] malformed pair table at %s\n",
+                        names[k]);
+                return EXIT_FAILURE;
+            }
+            if (*s == '_') {
+                bits |= (uint32_t)1 << n;
+            }
+            ++n;
+        }
+        if (n != CLASSES) {
+            fprintf(stderr, "[ERROR] malformed pair table at %s\n", names[k]);
+            return EXIT_FAILURE;
+        }
+        printf("    0x%08lX,  // %s\n", (unsigned long)bits, names[k]);
+    }
+    printf("};\n\n");
+
+    printf("static const uint8_t lb_ascii[0x80] = {");
+    for (size_t i = 0; i < 0x80; ++i) {
+        printf("%s%2d,", (i % 16 == 0) ? "\n    " : " ", values[i]);
+    }
+    printf("\n};\n\n");
+
+    emit("lb", "LB", values, false);
+
+    //\ Grapheme Cluster Break Properties
+    for (int32_t codepoint = 0; codepoint < 0x110000; ++codepoint) {
+        values[codepoint] = property(codepoint);
+    }
+
+    printf("enum {\n");
+    for (int k = 0; k < PROPERTIES; ++k) {
+        printf("    GB_%s,\n", properties[k]);
+    }
+    printf("    GB_PROPERTIES\n};\n\n");
+
+    emit("gb", "GB", values, true);
+
+    //\ Width Classes
+    for (int32_t codepoint = 0; codepoint < 0x110000; ++codepoint) {
+        values[codepoint] = width_class(codepoint);
+    }
+
+    printf("#define CW_AMBIGUOUS %d\n\n", AMBIGUOUS);
+
+    emit("cw", "CW", values, true);
+
+    return (fflush(stdout) == 0 && !ferror(stdout)) ? EXIT_SUCCESS
+                                                    : EXIT_FAILURE;
+}
@@ -0,0 +1,233 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stdbool.h"
+#include "../utf8proc/utf8proc.h"
+#include "widthclass.h"
+
+#define PROGRAM "mkwidths"
+
+#define WT_MAGIC "ufcw"
+#define WT_VERSION 1
+
+static const char* const usage =
+"USAGE\n"
+"    " PROGRAM " [files]\n"
+"\n"
+"    Make a table of width classes for ufold --width-table, starting from\n"
+"    the widths of utf8proc %s with narrow East Asian Ambiguous\n"
+"    characters kept ambiguous, and applying lines of files in order:\n"
+"\n"
+"    XXXX[..YYYY];P  East Asian Width from EastAsianWidth.txt of UCD.\n"
+"                    W and F are wide, A is ambiguous, and N, Na and H\n"
+"                    are narrow.  Zero-width characters are kept.\n"
+"    XXXX[..YYYY] N  Width 0, 1 or 2 measured on a terminal.\n"
+"\n"
+"    Codepoints are hexadecimal, optionally after U+.  A comment starts\n"
+"    with #.  The table is written to standard output.\n"
+;
+
+static uint8_t values[0x110000];
+
+/*\
+ / DESCRIPTION
+ /   Parse a hexadecimal codepoint with an optional U+ prefix.
+\*/
+static bool parse_codepoint(const char** s, int32_t* codepoint)
+{
+    const char* p = *s;
+
+    if ((p[0] == 'U' || p[0] == 'u') && p[1] == '+') {
+        p += 2;
+    }
+
+    char* end = NULL;
+    unsigned long value = strtoul(p, &end, 16);
+
+    if (end == p || value > 0x10FFFF) {
+        return false;
+    }
+    *codepoint = (int32_t)value;
+    *s = end;
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Apply a line of East Asian Width or measured width to the classes.
+ /   Blank lines and comments are ignored.
+\*/
+static bool apply(const char* line)
+{
+    const char* s = line + strspn(line, " \t");
+    int32_t first = -1;
+    int32_t last = -1;
+
+    if (*s == '#' || *s == '\n' || *s == '\r' || *s == '\0') {
+        return true;
+    }
+    if (!parse_codepoint(&s, &first)) {
+        return false;
+    }
+    last = first;
+
+    if (s[0] == '.' && s[1] == '.') {
+        s += 2;
+
+        if (!parse_codepoint(&s, &last) || last < first) {
+            return false;
+        }
+    }
+    s += strspn(s, " \t");
+
+    if (*s == ';') {
+        s += 1 + strspn(s + 1, " \t");
+
+        size_t n = strcspn(s, " \t\r\n#");
+        int klass = -1;
+
+        if (n == 1 && (*s == 'W' || *s == 'F')) {
+            klass = 2;
+        } else if (n == 1 && *s == 'A') {
+            klass = AMBIGUOUS;
+        } else if ((n == 1 && (*s == 'N' || *s == 'H')) ||
+                   (n == 2 && !strncmp(s, "Na", 2))) {
+            klass = 1;
+        } else {
+            return false;
+        }
+        for (int32_t c = first; c <= last; ++c) {
+            if (values[c] != 0) {
+                values[c] = klass;
+            }
+        }
+    } else if (*s >= '0' && *s <= '2' && strchr(" \t\r\n#", s[1]) != NULL) {
+        for (int32_t c = first; c <= last; ++c) {
+            values[c] = *s - '0';
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Write a number in little-endian order.
+\*/
+static void put(uint32_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        putchar((value >> (i * 8)) & 0xFF);
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Count distinct blocks of a size, and number each range by its block.
+\*/
+static size_t deduplicate(size_t shift, uint8_t* blocks, uint16_t* index)
+{
+    size_t block_size = (size_t)1 << shift;
+    size_t count = 0;
+
+    for (size_t i = 0; i < 0x110000; i += block_size) {
+        size_t k = 0;
+
+        while (k < count && memcmp(blocks + k * block_size,
+                                   values + i, block_size)) {
+            ++k;
+        }
+        if (k == count) {
+            memcpy(blocks + count * block_size, values + i, block_size);
+            ++count;
+        }
+        if (index != NULL) {
+            index[i >> shift] = k;
+        }
+    }
+    return count;
+}
+
+int main(int argc, char** argv)
+{
+    static uint8_t blocks[0x110000];
+    static uint16_t index[0x110000];
+    static char line[4096];
+
+    if (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+        printf(usage, utf8proc_unicode_version());
+        return EXIT_SUCCESS;
+    }
+
+    // the same classes as the built-in table of linebreak.h
+    for (int32_t codepoint = 0; codepoint < 0x110000; ++codepoint) {
+        int klass = width_class(codepoint);
+        values[codepoint] = (klass < 0) ? 0 : klass;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        FILE* file = fopen(argv[i], "r");
+        size_t number = 0;
+
+        if (file == NULL) {
+            fprintf(stderr, "[ERROR] failed to open \"%s\"\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        while (fgets(line, sizeof(line), file) != NULL) {
+            ++number;
+
+            if (!apply(line)) {
+                fprintf(stderr, "[ERROR] malformed line %zu of \"%s\"\n",
+                        number, argv[i]);
+                fclose(file);
+                return EXIT_FAILURE;
+            }
+        }
+        if (ferror(file)) {
+            fprintf(stderr, "[ERROR] failed to read \"%s\"\n", argv[i]);
+            fclose(file);
+            return EXIT_FAILURE;
+        }
+        fclose(file);
+    }
+
+    // the block size of least memory
+    size_t best_shift = 0;
+    size_t best_size = SIZE_MAX;
+
+    for (size_t shift = 4; shift <= 10; ++shift) {
+        size_t count = deduplicate(shift, blocks, NULL);
+
+        // block numbers are 16-bit
+        if (count > 0x10000) {
+            continue;
+        }
+        size_t size = (0x110000 >> shift) * 2 + (count << (shift - 1));
+
+        if (size < best_size) {
+            best_size = size;
+            best_shift = shift;
+        }
+    }
+
+    size_t count = deduplicate(best_shift, blocks, index);
+
+    fputs(WT_MAGIC, stdout);
+    put(WT_VERSION, 1);
+    put(best_shift, 1);
+    put(0, 2);
+    put(count, 4);
+
+    for (size_t i = 0; i < (0x110000 >> best_shift); ++i) {
+        put(index[i], 2);
+    }
+    for (size_t i = 0; i < (count << best_shift); i += 2) {
+        putchar(blocks[i] | (blocks[i + 1] << 4));
+    }
+
+    return (fflush(stdout) == 0 && !ferror(stdout)) ? EXIT_SUCCESS
+                                                    : EXIT_FAILURE;
+}
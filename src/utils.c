@@ -112,6 +112,64 @@ bool check_punctuation(const char* bytes, size_t size, bool ascii_mode)
     return true;
 }
 
+// well-formed characters of a single line, with no tab
+bool check_text(const char* bytes, size_t size, bool ascii_mode)
+{
+    utf8proc_int32_t codepoint = -1;
+    utf8proc_ssize_t n_bytes = -1;
+
+    for (size_t i = 0; i < size; i += n_bytes) {
+        if (!ascii_mode) {
+            n_bytes = utf8proc_iterate((uint8_t*)bytes + i, size - i,
+                                       &codepoint);
+        } else {
+            n_bytes = 1;
+            codepoint = (uint8_t)bytes[i];
+        }
+
+        if (n_bytes <= 0 || n_bytes > 4 || (ascii_mode && codepoint > 0x7F)) {
+            logged_return(false);
+        }
+        if (get_charwidth(codepoint, ascii_mode) < 0 || codepoint == '\t' ||
+                is_linefeed(codepoint, ascii_mode) ||
+                is_controlchar(codepoint, ascii_mode)) {
+            logged_return(false);
+        }
+    }
+    return true;
+}
+
+// well-formed characters with no CR, NEL, LS, PS or control characters
+// other than LF and TAB
+bool check_clean(const uint8_t* bytes, size_t size, bool ascii_mode,
+                 bool ansi_escapes)
+{
+    utf8proc_int32_t codepoint = -1;
+    utf8proc_ssize_t n_bytes = -1;
+
+    for (size_t i = 0; i < size; i += n_bytes) {
+        if (!ascii_mode) {
+            n_bytes = utf8proc_iterate(bytes + i, size - i, &codepoint);
+        } else {
+            n_bytes = 1;
+            codepoint = bytes[i];
+        }
+
+        if (n_bytes <= 0 || n_bytes > 4 || (ascii_mode && codepoint > 0x7F)) {
+            logged_return(false);
+        }
+        if (ansi_escapes && codepoint == 0x1B) {
+            continue;  // escape sequences are kept as they are
+        }
+        if (get_charwidth(codepoint, ascii_mode) < 0 ||
+                is_controlchar(codepoint, ascii_mode) ||
+                codepoint == 0x2028 || codepoint == 0x2029) {
+            logged_return(false);
+        }
+    }
+    return true;
+}
+
 bool has_linefeed(const uint8_t* bytes, size_t size, bool ascii_mode)
 {
 #ifndef UFOLD_DEBUG
@@ -147,6 +205,76 @@ bool has_linefeed(const uint8_t* bytes, size_t size, bool ascii_mode)
 #endif
 }
 
+size_t skip_line(const uint8_t* bytes, size_t size, bool ascii_mode)
+{
+    const uint8_t* p = memchr(bytes, '\n', size);
+    size_t n = (p != NULL) ? (size_t)(p - bytes) : size;
+
+    if ((p = memchr(bytes, '\r', n)) != NULL) {
+        n = p - bytes;
+    }
+    if (ascii_mode) {
+        return n;
+    }
+    // NEL: C2 85
+    for (size_t i = 0; (p = memchr(bytes + i, 0xC2, n - i)) != NULL; ) {
+        i = p - bytes;
+
+        if (i + 1 >= size || bytes[i + 1] == 0x85) {
+            n = i;
+            break;
+        }
+        i += 1;
+    }
+    // LS: E2 80 A8, PS: E2 80 A9
+    for (size_t i = 0; (p = memchr(bytes + i, 0xE2, n - i)) != NULL; ) {
+        i = p - bytes;
+
+        if (i + 1 >= size || (bytes[i + 1] == 0x80 &&
+                              (i + 2 >= size || bytes[i + 2] == 0xA8 ||
+                               bytes[i + 2] == 0xA9))) {
+            n = i;
+            break;
+        }
+        i += 1;
+    }
+    return n;
+}
+
+uint64_t hash_bytes(const uint8_t* bytes, size_t size, uint64_t seed)
+{
+    return hash_end(hash_step(hash_start(seed), bytes, size), size);
+}
+
+uint64_t hash_start(uint64_t seed)
+{
+    return seed ^ 0xCBF29CE484222325ULL;
+}
+
+uint64_t hash_step(uint64_t hash, const uint8_t* bytes, size_t size)
+{
+    const uint64_t prime = 0x100000001B3ULL;  // of FNV-1a
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word = 0;
+
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * prime;
+    }
+    return hash;
+}
+
+uint64_t hash_end(uint64_t hash, size_t size)
+{
+    hash = (hash ^ size) * 0x100000001B3ULL;
+    return hash ^ (hash >> 32);
+}
+
 size_t utf8_valid_length(uint8_t byte)
 {
     static const uint8_t lengths[] = {
@@ -248,6 +376,134 @@ size_t utf8_sanitize(uint8_t* bytes, size_t size)
     return size;
 }
 
+uint8_t ansi_step(uint8_t state, uint8_t byte)
+{
+    switch (state) {
+    case ANSI_NONE:
+        return byte == 0x1B ? ANSI_ESC : ANSI_FAIL;
+    case ANSI_ESC:
+        if (byte == '[') {
+            return ANSI_CSI;
+        }
+        if (byte == ']' || byte == 'P' || byte == 'X' ||
+                byte == '^' || byte == '_') {
+            return ANSI_STRING;
+        }
+        // fall through
+    case ANSI_INTER:
+        if (byte >= 0x20 && byte <= 0x2F) {
+            return ANSI_INTER;
+        }
+        return (byte >= 0x30 && byte <= 0x7E) ? ANSI_END : ANSI_FAIL;
+    case ANSI_CSI:
+        if (byte >= 0x20 && byte <= 0x3F) {
+            return ANSI_CSI;
+        }
+        return (byte >= 0x40 && byte <= 0x7E) ? ANSI_END : ANSI_FAIL;
+    case ANSI_STRING:
+        if (byte == 0x07) {
+            return ANSI_END;  // BEL
+        }
+        if (byte == 0x1B) {
+            return ANSI_STRING_ESC;
+        }
+        if (byte >= 0x20 && byte <= 0x7E) {
+            return ANSI_STRING;
+        }
+        // NOTE: UTF-8 text in strings, e.g. URI or window title
+        if (byte >= 0xC2 && byte <= 0xDF) {
+            return ANSI_STRING_1;
+        }
+        if (byte == 0xE0 || byte == 0xED) {
+            return byte == 0xE0 ? ANSI_STRING_E0 : ANSI_STRING_ED;
+        }
+        if (byte >= 0xE1 && byte <= 0xEF) {
+            return ANSI_STRING_2;
+        }
+        if (byte == 0xF0 || byte == 0xF4) {
+            return byte == 0xF0 ? ANSI_STRING_F0 : ANSI_STRING_F4;
+        }
+        return (byte >= 0xF1 && byte <= 0xF3) ? ANSI_STRING_3 : ANSI_FAIL;
+    case ANSI_STRING_ESC:
+        return byte == '\\' ? ANSI_END : ANSI_FAIL;
+    case ANSI_STRING_1:
+    case ANSI_STRING_2:
+    case ANSI_STRING_3:
+        if (byte < 0x80 || byte > 0xBF) {
+            return ANSI_FAIL;
+        }
+        return (state == ANSI_STRING_1) ? ANSI_STRING : state - 1;
+    case ANSI_STRING_E0:
+        return (byte >= 0xA0 && byte <= 0xBF) ? ANSI_STRING_1 : ANSI_FAIL;
+    case ANSI_STRING_ED:
+        return (byte >= 0x80 && byte <= 0x9F) ? ANSI_STRING_1 : ANSI_FAIL;
+    case ANSI_STRING_F0:
+        return (byte >= 0x90 && byte <= 0xBF) ? ANSI_STRING_2 : ANSI_FAIL;
+    case ANSI_STRING_F4:
+        return (byte >= 0x80 && byte <= 0x8F) ? ANSI_STRING_2 : ANSI_FAIL;
+    default:
+        return ANSI_FAIL;
+    }
+}
+
+size_t ansi_length(const uint8_t* bytes, size_t size)
+{
+    uint8_t state = ANSI_NONE;
+
+    for (size_t i = 0; i < size && i < ANSI_MAX; ++i) {
+        state = ansi_step(state, bytes[i]);
+
+        if (state == ANSI_END) {
+            return i + 1;
+        }
+        if (state == ANSI_FAIL) {
+            break;
+        }
+    }
+    return 0;
+}
+
+bool ansi_cut(const uint8_t* bytes, size_t size)
+{
+    uint8_t state = ANSI_NONE;
+
+    if (size >= ANSI_MAX) {
+        return false;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        state = ansi_step(state, bytes[i]);
+
+        if (state == ANSI_END || state == ANSI_FAIL) {
+            return false;
+        }
+    }
+    return size > 0;
+}
+
+size_t ansi_sanitize(uint8_t* bytes, size_t size)
+{
+    size_t i = 0;
+
+    while (i < size) {
+        const uint8_t* esc = memchr(bytes + i, 0x1B, size - i);
+        size_t n = (esc != NULL) ? (size_t)(esc - bytes) - i : size - i;
+
+        (void)utf8_sanitize(bytes + i, n);
+        i += n;
+
+        if (i < size) {
+            size_t k = ansi_length(bytes + i, size - i);
+
+            if (k <= 0) {
+                bytes[i] = '?';
+                k = 1;
+            }
+            i += k;
+        }
+    }
+    return size;
+}
+
 bool find_eol(const uint8_t* bytes, size_t size, size_t tab_width,
               const uint8_t** index, size_t* line_width, bool* linefeed_found,
               bool ascii_mode)
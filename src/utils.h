@@ -46,8 +46,42 @@ bool is_punctuation(const char* punctuation, const char* sequence,
 
 bool check_punctuation(const char* bytes, size_t size, bool ascii_mode);
 
+bool check_text(const char* bytes, size_t size, bool ascii_mode);
+
+bool check_clean(const uint8_t* bytes, size_t size, bool ascii_mode,
+                 bool ansi_escapes);
+
 bool has_linefeed(const uint8_t* bytes, size_t size, bool ascii_mode);
 
+/*\
+ / DESCRIPTION
+ /   Find the first byte that may start a line terminator before it is
+ /   normalized (LF, CR, NEL, LS or PS), without decoding the bytes.
+ /   A sequence cut off at the buffer end counts as a line terminator.
+ /
+ / RETURN
+ /   size :: bytes before the line terminator (or the buffer size)
+\*/
+size_t skip_line(const uint8_t* bytes, size_t size, bool ascii_mode);
+
+/*\
+ / DESCRIPTION
+ /   Hash bytes eight at a time for lookup (not for security).
+\*/
+uint64_t hash_bytes(const uint8_t* bytes, size_t size, uint64_t seed);
+
+/*\
+ / DESCRIPTION
+ /   Hash bytes in steps as hash_bytes does at once: start with the seed,
+ /   step over each part of bytes, and end with the total size.  Every part
+ /   but the last must be a multiple of eight bytes.
+\*/
+uint64_t hash_start(uint64_t seed);
+
+uint64_t hash_step(uint64_t hash, const uint8_t* bytes, size_t size);
+
+uint64_t hash_end(uint64_t hash, size_t size);
+
 /*\
  / DESCRIPTION
  /   Get the length of a valid UTF-8 byte sequence by checking its first byte.
@@ -118,6 +152,72 @@ uint8_t ascii_sanitize(uint8_t byte);
 \*/
 size_t utf8_sanitize(uint8_t* bytes, size_t size);
 
+//\ State of ANSI Escape Sequence (see ansi_step)
+enum {
+    ANSI_NONE,        // before ESC
+    ANSI_ESC,         // after ESC
+    ANSI_INTER,       // intermediate bytes after ESC, e.g. ESC ( B
+    ANSI_CSI,         // control sequence, e.g. ESC [ 1 m
+    ANSI_STRING,      // control string, e.g. ESC ] 8 ; ; URI BEL
+    ANSI_STRING_ESC,  // ESC of the string terminator (ST)
+    ANSI_STRING_1,    // 1 continuation byte left of UTF-8 in a string
+    ANSI_STRING_2,    // 2 continuation bytes left
+    ANSI_STRING_3,    // 3 continuation bytes left
+    ANSI_STRING_E0,   // after E0 (A0..BF follows)
+    ANSI_STRING_ED,   // after ED (80..9F follows)
+    ANSI_STRING_F0,   // after F0 (90..BF follows)
+    ANSI_STRING_F4,   // after F4 (80..8F follows)
+    ANSI_END,         // after the final byte
+    ANSI_FAIL,        // not a sequence
+};
+
+// long enough for hyperlinks (OSC 8), and set by make ANSI_MAX=<bytes>
+#ifndef ANSI_MAX
+#define ANSI_MAX 4096  // maximum size of a sequence in bytes
+#endif
+
+/*\
+ / DESCRIPTION
+ /   Advance the state of an ANSI escape sequence by its next byte.
+ /   Control strings (OSC, DCS, SOS, PM and APC) hold printable ASCII and
+ /   well-formed UTF-8 only.
+ /
+ / RETURN
+ /   state :: the next state
+\*/
+uint8_t ansi_step(uint8_t state, uint8_t byte);
+
+/*\
+ / DESCRIPTION
+ /   Get the length of an ANSI escape sequence at the start of bytes.
+ /
+ / RETURN
+ /   0 :: not a complete sequence of at most ANSI_MAX bytes
+ /   + :: length of the complete sequence
+\*/
+size_t ansi_length(const uint8_t* bytes, size_t size);
+
+/*\
+ / DESCRIPTION
+ /   Check if bytes start with an ANSI escape sequence cut off at their end,
+ /   which may be completed by the bytes that follow.
+\*/
+bool ansi_cut(const uint8_t* bytes, size_t size);
+
+/*\
+ / DESCRIPTION
+ /   Sanitize the buffer in place like utf8_sanitize, but keep complete ANSI
+ /   escape sequences.
+ /
+ / PARAMETERS
+ /   bytes <-> unchecked byte sequence
+ /    size --> number of bytes
+ /
+ / RETURN
+ /   N :: new size of buffer
+\*/
+size_t ansi_sanitize(uint8_t* bytes, size_t size);
+
 /*\
  / DESCRIPTION
  /   Find the index of the first linefeed end, otherwise the buffer end.
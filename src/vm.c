@@ -3,6 +3,7 @@
 #include <string.h>
 #include "utils.h"
 #include "vm.h"
+#include "linebreak.h"  // generated by mklinebreak
 
 //\ I/O State of VM
 typedef enum vm_state {
@@ -10,8 +11,56 @@ typedef enum vm_state {
     VM_WORD,  // processing a fragment
     VM_WRAP,  // processing a new wrapped line
     VM_FULL,  // maximum line width exceeded
+    VM_SKIP,  // skipping the rest of a truncated line
 } vm_state_t;
 
+//\ Word of Paragraph for Optimal Fit
+typedef struct vm_word {
+    size_t end;  // position of word end from line start
+    size_t width;  // (width) columns of word
+    size_t gap;  // (width) columns of whitespace before word
+    uint64_t cost;  // least cost of lines up to word end
+    size_t prev;  // first word of the last line (SIZE_MAX: previous line)
+} vm_word_t;
+
+//\ Input Line Cached with Its Output
+typedef struct vm_cached {
+    uint64_t hash;  // hash of input line
+    uint8_t* bytes;  // input line followed by its output
+    size_t room;  // bytes allocated for a line too long for the storage
+    size_t size;  // size of input line in bytes
+    size_t output_size;  // size of output kept (none for count-only mode)
+    ufold_metrics_t metrics;  // metrics of output
+    uint8_t grapheme;  // state of grapheme cluster before input line
+    uint8_t grapheme_end;  // state of grapheme cluster after input line
+    uint8_t break_class_end;  // line breaking class after input line
+    size_t chain;  // next entry in the same bucket (SIZE_MAX: none)
+    size_t older;  // entry used less recently (SIZE_MAX: none)
+    size_t newer;  // entry used more recently (SIZE_MAX: none)
+} vm_cached_t;
+
+//\ Cache of Wrapped Lines (Least Recently Used)
+typedef struct vm_cache {
+    vm_cached_t* entries;
+    size_t count;
+    size_t capacity;
+    size_t* buckets;  // first entries of buckets by hash (SIZE_MAX: none)
+    size_t bucket_mask;
+    size_t oldest;  // (SIZE_MAX: none)
+    size_t newest;  // (SIZE_MAX: none)
+#define CACHE_ENTRY_SIZE 256
+    uint8_t* storage;  // bytes preallocated per entry for a line and output
+    uint8_t* record;  // output of the line being wrapped
+    size_t record_size;
+    size_t record_capacity;
+    bool recording;
+#define CACHE_LINE_MAX 65536  // longest line kept whole to be cached
+    uint64_t hash;  // hash of the line kept whole so far
+    size_t hashed;  // bytes of the line hashed (multiple of 8)
+    bool waiting;  // whether the line is kept whole until its end
+    ufold_cache_stats_t stats;
+} vm_cache_t;
+
 //\ Virtual State Machine
 struct ufold_vm_struct {
     //\ Configuration
@@ -20,6 +69,7 @@ struct ufold_vm_struct {
     uint8_t* buf;
     size_t buf_size;
     uint8_t* line;
+    uint8_t* cells;  // decoded properties of bytes in buf (NULL: decode line)
     size_t line_size;
     size_t max_size;  // capacity of line buffer (without extra area; variable)
     size_t cursor;  // position of last processing byte
@@ -27,23 +77,183 @@ struct ufold_vm_struct {
     size_t eow;  // position of last end of word from line start
     size_t eow_ss;  // byte size of whitespace between breakpoints
     size_t eow_ww;  // width of non-whitespace between breakpoints
+    size_t eow_width;  // (width) position of last end of word
+    uint8_t break_class;  // line breaking class of last character of word
+    uint8_t grapheme;  // state of grapheme cluster of last character
+    size_t cut;  // position to truncate line at from line start
+    size_t cut_width;  // (width) columns of line up to cut
+    size_t ellipsis_width;  // (width) columns of ellipsis
+    uint8_t widths[CW_AMBIGUOUS + 1];  // (width) columns of width classes
 #define SLOT_SIZE 256
     uint8_t* slots;
+    size_t slot_size;  // capacity of slots
+    uint8_t* slot_cells;  // decoded properties of bytes from slots
     size_t slot_used;
     size_t slot_cursor;  // position of validation
+    size_t slot_escape;  // bytes of escape sequence validated at cursor
+    uint8_t slot_ansi;  // state of escape sequence validated at cursor
+    uint8_t units[4];  // code units of input not yet transcoded
+    size_t unit_used;
     uint8_t* indent;
     size_t indent_size;
     size_t indent_width;
     size_t indent_bufsize;
+    size_t indent_borrowed;  // size of indent in input (the rest are spaces)
     //\ Switches
     vm_state_t state;
     bool slot_crlf;  // whether the previously processed codepoint is CR
+    bool unit_le;  // whether UTF-16 input is little-endian
+    bool unit_started;  // whether the first code unit is transcoded
     bool indent_hanging;  // hanging punctuation
     bool cursor_at_word;  // processing byte of word
+    bool line_borrowed;  // line is input wrapped in place
+    bool line_raw;  // line is input not yet sanitized
+    bool yield;  // line spans are ready for the iterator
+    bool stopped;
+    //\ Receiver of Line Spans (NULL: write output)
+    ufold_iter_t* iter;
+    //\ Metrics of Output
+    ufold_metrics_t metrics;
+    size_t output_width;  // (width) columns of the line being output
+    bool output_pending;  // whether the line being output is not counted
+    uint8_t* sgr;  // SGR sequences output since the last reset (NULL: none)
+    size_t sgr_size;
+    //\ Writer Given Its Own Context (NULL: writer of config)
+    ufold_vm_write_to_t write_to;
+    void* write_context;
+    //\ Destination of Output in Memory (NULL: writer)
+    uint8_t* output;
+    size_t output_size;
+    size_t output_capacity;
+    //\ VMs Wrapping the Same Input at Extra Widths
+    ufold_vm_t** followers;
+    size_t follower_count;
+    //\ Line Breaks Planned for Optimal Fit
+#define FILL_LINES 32
+    vm_word_t* words;
+    size_t word_capacity;
+    size_t* fill;  // positions of breaks from line start (ascending)
+    size_t fill_count;
+    size_t fill_next;
+    size_t fill_capacity;
+    size_t fill_scan;  // bytes from line start known to have no line feed
+    //\ Cache of Wrapped Lines (NULL: none)
+    vm_cache_t* cache;
+    //\ Compiled Settings
+    const ufold_profile_t* profile;  // (NULL: borrowed VM)
+    ufold_profile_t* own_profile;  // profile owned by VM (NULL: shared)
+};
+
+//\ State of Grapheme Cluster (with the break property of last character)
+#define GRAPHEME_PROPERTY 0x0F
+#define GRAPHEME_RI_ODD 0x10  // odd number of regional indicators in a row
+#define GRAPHEME_PICT 0x20  // pictograph followed by extenders
+#define GRAPHEME_SPACE 0x40  // cluster starts with whitespace
+
+//\ Serialized State of VM
+typedef struct vm_snap {
+    uint8_t* bytes;  // (NULL: only count size for saving)
+    size_t size;  // size of state saved or loaded
+    size_t capacity;  // size of bytes
+    bool failed;  // whether state is malformed for loading
+} vm_snap_t;
+
+#define SNAP_MAGIC "ufvm"
+#define SNAP_VERSION 8
+
+//\ Writer of Index from Output Lines to Input
+//   [MAGIC VERSION INTERVAL] [CHECKPOINT...] [TABLE] [TABLE_POS COUNT MAGIC]
+//   CHECKPOINT :: LINE OFFSET STATE_SIZE STATE
+//   TABLE      :: (FIRST_LINE CHECKPOINT_POS)...  (64-bit little endian)
+struct ufold_index_struct {
+    ufold_vm_write_t write;
+    ufold_vm_realloc_t realloc;
+    size_t interval;
+    size_t next;  // number of output lines for the next checkpoint
+    size_t size;  // size of index written
+    uint8_t* table;
+    size_t table_size;
+    size_t table_capacity;
+    uint8_t* record;  // checkpoint being written
+    size_t record_capacity;
     bool stopped;
 };
+
+#define INDEX_MAGIC "ufix"
+#define INDEX_VERSION 1
+#define INDEX_ENTRY_SIZE 16
+#define INDEX_FOOTER_SIZE 20
+
+//\ Table of Width Classes (see ufold_width_table_init)
+//   [MAGIC VERSION SHIFT 0 0 COUNT] [INDEX] [BLOCKS]
+#define WT_MAGIC "ufcw"
+#define WT_VERSION 1
+#define WT_HEADER_SIZE 12
+
+//\ Document Wrapped Incrementally
+struct ufold_doc_struct {
+    //\ Configuration
+    ufold_vm_config_t config;
+    ufold_punct_t* punct;  // compiled punctuation owned (NULL: shared)
+    //\ Text
+    uint8_t* text;
+    uint8_t* cells;  // decoded properties of bytes in text
+    size_t size;
+    size_t capacity;
+    size_t cell_capacity;
+    //\ Visual Lines (ordered by offset)
+    ufold_span_t* spans;
+    size_t span_count;
+    size_t span_capacity;
+    ufold_span_t* fresh;  // visual lines of the last edit
+    size_t fresh_capacity;
+    //\ Switches
+    bool stopped;  // whether an edit failed halfway
+};
+
+//\ Hanging Punctuation Compiled for Sharing among VMs
+struct ufold_punct_struct {
+    ufold_vm_realloc_t realloc;
+    char* chars;  // punctuation compiled (NULL: default)
+    uint64_t low[4];  // bitmap of punctuation below U+0100 (or bytes)
+    utf8proc_int32_t* codepoints;  // other punctuation (ascending)
+    size_t count;
+    bool ascii_mode;
+};
+
+//\ Feeder of UTF-8 Input
+typedef bool (*vm_feeder_t)(ufold_vm_t* vm, const uint8_t* bytes, size_t size);
+
+//\ VM Settings Compiled for Sharing among VMs
+struct ufold_profile_struct {
+    ufold_vm_config_t config;  // settings with own strings (no extra widths)
+    ufold_punct_t* punct;  // compiled punctuation owned (NULL: shared)
+    size_t ellipsis_width;  // (width) columns of ellipsis
+    size_t buf_size;  // size of line buffer (0: none)
+    size_t slot_size;  // capacity of slots of each VM
+    size_t cell_size;  // size of decoded properties of line (0: none)
+    bool cached;  // whether wrapped lines are cached
+    vm_feeder_t feeder;  // way to decode input chosen for settings
+    ufold_profile_t** followers;  // profiles of extra widths
+    size_t follower_count;
+};
+
+//\ Decoded Properties of a Byte in Line (for the first byte of a character)
+#define CELL_SIZE 0x03  // size of character in bytes minus one
+#define CELL_WIDTH 0x0C  // width of character (except tab) shifted by two
+#define CELL_TAB 0x10  // character is tab
+#define CELL_EOL 0x20  // character is line feed
+#define CELL_SPACE 0x40  // character is whitespace other than line feed
+#define CELL_PUNCT 0x80  // character is hanging punctuation
 //typedef struct ufold_vm_struct ufold_vm_t;
 
+//\ Whether Output is Measured in Bytes and Columns (lines are always counted)
+#ifdef UFOLD_METRICS
+#define VM_METERED(vm) true
+#else
+#define VM_METERED(vm) ((vm)->config.count_only)
+#endif
+
 static bool default_write(const void* ptr, size_t size);
 
 static void* default_realloc(void* ptr, size_t size);
@@ -54,18 +264,165 @@ static void vm_free(ufold_vm_t* vm, void* ptr);
 
 static size_t vm_slot(ufold_vm_t* vm, uint8_t byte);
 
+static bool vm_slot_flush(ufold_vm_t* vm);
+
 static void vm_slot_shift(ufold_vm_t* vm, size_t n);
 
 static void vm_line_shift(ufold_vm_t* vm, size_t n);
 
 static bool vm_line_update_capacity(ufold_vm_t* vm);
 
+static bool vm_line_reserve(ufold_vm_t* vm, size_t size);
+
+static bool vm_buf_resize(ufold_vm_t* vm, size_t buf_size);
+
+static bool vm_follow(ufold_vm_t* vm);
+
+static bool profile_follow(ufold_profile_t* profile,
+                           const ufold_vm_config_t* config);
+
+static bool vm_cells(const ufold_vm_t* vm,
+                     const uint8_t* bytes, size_t size, uint8_t* cells);
+
 static bool vm_feed(ufold_vm_t* vm, const uint8_t* bytes, size_t size);
 
+static bool vm_feed_line(ufold_vm_t* vm, const uint8_t* bytes,
+                         const uint8_t* cells, size_t size);
+
 static bool vm_feed_ascii(ufold_vm_t* vm, const uint8_t* bytes, size_t size);
 
+static bool vm_feed_clean(ufold_vm_t* vm, const uint8_t* bytes, size_t size);
+
+static bool vm_feed_trusted(ufold_vm_t* vm, const uint8_t* bytes, size_t size);
+
+static bool vm_feed_input(ufold_vm_t* vm, const uint8_t* bytes, size_t size);
+
+static bool vm_feed_decoded(ufold_vm_t* vm, const uint8_t* bytes, size_t size);
+
+static bool vm_feed_encoded(ufold_vm_t* vm, const uint8_t* bytes, size_t size);
+
+static size_t vm_transcode(ufold_vm_t* vm, const uint8_t* bytes, size_t size,
+                           uint8_t* output, size_t capacity, size_t* consumed);
+
+static bool vm_transcoding(const ufold_vm_t* vm);
+
+static bool vm_filling(const ufold_vm_config_t* config);
+
+static bool vm_compiling(const ufold_vm_config_t* config);
+
+static bool vm_keeping_sgr(const ufold_vm_config_t* config);
+
 static bool vm_flush(ufold_vm_t* vm);
 
+static bool vm_wrap(ufold_vm_t* vm, size_t end);
+
+static bool vm_wrap_cached(ufold_vm_t* vm);
+
+static bool vm_cache_wait(ufold_vm_t* vm);
+
+static bool vm_cache_new(ufold_vm_t* vm);
+
+static void vm_cache_free(ufold_vm_t* vm);
+
+static vm_cached_t* vm_cache_find(ufold_vm_t* vm, uint64_t hash,
+                                  const uint8_t* bytes, size_t size);
+
+static bool vm_cache_add(ufold_vm_t* vm, uint64_t hash,
+                         const uint8_t* bytes, size_t size,
+                         const ufold_metrics_t* metrics, uint8_t grapheme);
+
+static void vm_cache_unlink(vm_cache_t* cache, size_t i);
+
+static void vm_cache_touch(vm_cache_t* cache, size_t i);
+
+static bool vm_fill(ufold_vm_t* vm);
+
+static bool vm_fill_plan(ufold_vm_t* vm, size_t start, size_t end);
+
+static bool vm_fill_solve(ufold_vm_t* vm, size_t count, size_t prefix,
+                          size_t indent, size_t eow, size_t eow_width);
+
+static bool vm_fill_due(ufold_vm_t* vm, size_t sol);
+
+static size_t vm_fill_char(const ufold_vm_t* vm, size_t i, uint8_t* cell);
+
+static bool vm_cell(const ufold_vm_t* vm, utf8proc_int32_t codepoint,
+                    utf8proc_ssize_t n_bytes, uint8_t* cell);
+
+static utf8proc_ssize_t vm_decode_raw(const ufold_vm_t* vm,
+                                      const uint8_t* bytes, size_t size,
+                                      utf8proc_int32_t* codepoint);
+
+static size_t vm_escape(const ufold_vm_t* vm,
+                        const uint8_t* bytes, size_t size);
+
+static size_t vm_sanitize(const ufold_vm_t* vm, uint8_t* bytes, size_t size);
+
+static bool vm_is_punctuation(const ufold_vm_t* vm,
+                              utf8proc_int32_t codepoint);
+
+static void vm_widths(ufold_vm_t* vm);
+
+static int vm_charwidth(const ufold_vm_t* vm, utf8proc_int32_t codepoint);
+
+static int width_class(const ufold_width_table_t* table,
+                       utf8proc_int32_t codepoint);
+
+static bool vm_ellipsis_width(const ufold_vm_config_t* config, size_t* width);
+
+static int punct_compare(const void* a, const void* b);
+
+static int vm_break_class(const ufold_vm_t* vm, const uint8_t* bytes,
+                          size_t size, utf8proc_int32_t codepoint);
+
+static bool vm_grapheme(const ufold_vm_t* vm, const uint8_t* bytes,
+                        size_t size, utf8proc_int32_t codepoint,
+                        uint8_t* state);
+
+static bool vm_put_text(ufold_vm_t* vm,
+                        const uint8_t* bytes, size_t size, size_t width);
+
+static bool vm_put_line(ufold_vm_t* vm, const uint8_t* bytes, size_t size,
+                        size_t eol_size, size_t width);
+
+static bool vm_put_break(ufold_vm_t* vm);
+
+static bool vm_put_ellipsis(ufold_vm_t* vm);
+
+static bool vm_put_reset(ufold_vm_t* vm);
+
+static bool vm_put_sgr(ufold_vm_t* vm);
+
+static bool vm_put_end(ufold_vm_t* vm);
+
+static void vm_sgr_update(ufold_vm_t* vm, const uint8_t* bytes, size_t size);
+
+static bool vm_count_line(ufold_vm_t* vm);
+
+static bool vm_limited(const ufold_vm_t* vm);
+
+static bool vm_write(ufold_vm_t* vm, const void* bytes, size_t size);
+
+static bool vm_put(const ufold_vm_t* vm, const void* bytes, size_t size);
+
+static void vm_borrow(ufold_vm_t* vm, const ufold_vm_config_t* config,
+                      const void* input, size_t size);
+
+static bool vm_run(ufold_vm_t* vm);
+
+static void vm_span_text(ufold_vm_t* vm,
+                         const uint8_t* bytes, size_t size, size_t width);
+
+static void vm_span_open(ufold_vm_t* vm);
+
+static void vm_span_close(ufold_vm_t* vm, ufold_break_t brk);
+
+static void vm_iter_load(ufold_vm_t* vm, ufold_iter_t* iter);
+
+static void vm_iter_save(const ufold_vm_t* vm, ufold_iter_t* iter);
+
+static size_t vm_iter_offset(const ufold_vm_t* vm, const uint8_t* bytes);
+
 static bool vm_indent(ufold_vm_t* vm);
 
 static bool vm_indent_feed(ufold_vm_t* vm,
@@ -75,6 +432,39 @@ static void vm_indent_reset(ufold_vm_t* vm);
 
 static void vm_eow_reset(ufold_vm_t* vm);
 
+static void vm_save(const ufold_vm_t* vm, vm_snap_t* snap);
+
+static bool vm_load(ufold_vm_t* vm, vm_snap_t* snap);
+
+static void vm_save_config(const ufold_vm_t* vm, vm_snap_t* snap);
+
+static bool vm_check_config(const ufold_vm_config_t* config, vm_snap_t* snap);
+
+static size_t vm_config_flags(const ufold_vm_config_t* config);
+
+static void snap_put(vm_snap_t* snap, size_t value);
+
+static void snap_put_data(vm_snap_t* snap, const void* data, size_t size);
+
+static size_t snap_get(vm_snap_t* snap);
+
+static const uint8_t* snap_get_data(vm_snap_t* snap, size_t size);
+
+static void snap_put_u64(vm_snap_t* snap, uint64_t value);
+
+static uint64_t snap_get_u64(vm_snap_t* snap);
+
+static bool index_write(ufold_index_t* index, const void* data, size_t size);
+
+static bool buf_reserve(ufold_vm_realloc_t realloc, void** ptr,
+                        size_t* capacity, size_t count, size_t unit);
+
+static size_t doc_search(const ufold_doc_t* doc, size_t offset);
+
+static size_t doc_line_start(const ufold_doc_t* doc, size_t offset);
+
+static size_t doc_line_end(const ufold_doc_t* doc, size_t offset);
+
 /*\
  / DESCRIPTION
  /   Default Writer for Output
@@ -121,6 +511,25 @@ void ufold_vm_config_init(ufold_vm_config_t* config)
 }
 
 ufold_vm_t* ufold_vm_new(const ufold_vm_config_t* config)
+{
+    ufold_profile_t* profile = ufold_profile_new(config);
+
+    if (profile == NULL) {
+        logged_return(NULL);
+    }
+
+    ufold_vm_t* vm = ufold_vm_new_from_profile(profile, NULL);
+
+    if (vm == NULL) {
+        ufold_profile_free(profile);
+        logged_return(NULL);
+    }
+    vm->own_profile = profile;
+
+    return vm;
+}
+
+ufold_profile_t* ufold_profile_new(const ufold_vm_config_t* config)
 {
 #if SLOT_SIZE < 4
 #error "SLOT_SIZE must be no smaller than 4"
@@ -134,13 +543,28 @@ ufold_vm_t* ufold_vm_new(const ufold_vm_config_t* config)
     // [QUADRUPED QUADRUPED QUADRUPED ......... QUADRUPEDS & NUL ]
     size_t width = (config->max_width > 0) ? config->max_width : 0;
     size_t factor = config->ascii_mode ? 1 : 4;
+
+    if (vm_filling(config)) {
+        // lines looked ahead for optimal fit
+        factor *= FILL_LINES + 1;
+    }
     // check overflow
     if (width > 0 && (SIZE_MAX - 1) / width / factor < sizeof(uint8_t)) {
         logged_return(NULL);
     }
-    size_t size = sizeof(uint8_t) * factor * width + SLOT_SIZE + 1;
+    // escape sequences are validated whole in slots
+    size_t slot_size = config->ansi_escapes ? max(ANSI_MAX, SLOT_SIZE)
+                                            : SLOT_SIZE;
+    size_t size = sizeof(uint8_t) * factor * width + slot_size + 1;
     // check overflow
-    if (size <= SLOT_SIZE) {
+    if (size <= slot_size) {
+        logged_return(NULL);
+    }
+
+    if (config->input_encoding > UFOLD_ENCODING_CP1252) {
+        logged_return(NULL);
+    }
+    if (config->ambiguous_width > 2) {
         logged_return(NULL);
     }
 
@@ -153,53 +577,170 @@ ufold_vm_t* ufold_vm_new(const ufold_vm_config_t* config)
         conf.realloc = default_realloc;
     }
 
-    ufold_vm_t* vm = conf.realloc(NULL, sizeof(ufold_vm_t));
+    ufold_profile_t* profile = conf.realloc(NULL, sizeof(ufold_profile_t));
 
-    if (vm == NULL) {
-        // TODO: inform error type?
+    if (profile == NULL) {
         logged_return(NULL);
     }
-    memset(vm, 0, sizeof(ufold_vm_t));
+    memset(profile, 0, sizeof(ufold_profile_t));
 
-    vm->config = conf;
-    vm->config.punctuation = NULL;
+    profile->config = conf;
+    profile->config.punctuation = NULL;
+    profile->config.ellipsis = NULL;
+    profile->config.extra_widths = NULL;
+    profile->config.extra_writes = NULL;
+    profile->config.extra_count = 0;
 
-    if (conf.punctuation != NULL) {
+    if (vm_compiling(&conf)) {
+        if ((profile->punct = ufold_punct_new(&conf)) == NULL) {
+            ufold_profile_free(profile);
+            logged_return(NULL);
+        }
+        conf.punct = profile->punct;
+    } else if (conf.punct != NULL &&
+               conf.punct->ascii_mode != conf.ascii_mode) {
+        ufold_profile_free(profile);
+        logged_return(NULL);
+    }
+    // profiles of extra widths share the set rather than compiling their own
+    profile->config.punct = conf.punct;
+
+    if (conf.punct != NULL) {
+        profile->config.punctuation = conf.punct->chars;
+    } else if (conf.punctuation != NULL) {
         size_t len = strlen(conf.punctuation) + 1;
 
-        if ((vm->config.punctuation = conf.realloc(NULL, len)) == NULL) {
-            ufold_vm_free(vm);
+        if ((profile->config.punctuation = conf.realloc(NULL, len)) == NULL) {
+            ufold_profile_free(profile);
             logged_return(NULL);
         }
-        memcpy(vm->config.punctuation, conf.punctuation, len - 1);
-        vm->config.punctuation[len - 1] = '\0';
+        memcpy(profile->config.punctuation, conf.punctuation, len);
     }
 
-    if ((vm->slots = conf.realloc(NULL, SLOT_SIZE)) == NULL) {
-        ufold_vm_free(vm);
-        logged_return(NULL);
+    if (conf.ellipsis != NULL) {
+        size_t len = strlen(conf.ellipsis) + 1;
+
+        if (!check_text(conf.ellipsis, len - 1, conf.ascii_mode) ||
+                !vm_ellipsis_width(&conf, &profile->ellipsis_width)) {
+            ufold_profile_free(profile);
+            logged_return(NULL);
+        }
+        if ((profile->config.ellipsis = conf.realloc(NULL, len)) == NULL) {
+            ufold_profile_free(profile);
+            logged_return(NULL);
+        }
+        memcpy(profile->config.ellipsis, conf.ellipsis, len);
     }
 
 #ifndef UFOLD_DEBUG
     // inharmonious logic
-    if (conf.max_width > 0) {
+    if (conf.max_width > 0 || conf.count_only || conf.max_lines > 0) {
+#endif
+        profile->buf_size = size;
+#ifndef UFOLD_DEBUG
+    } else {
+        profile->buf_size = 0;
+    }
 #endif
-        if ((vm->buf = conf.realloc(NULL, size)) == NULL) {
+    profile->slot_size = slot_size;
+
+    // lines shared by several widths are decoded once for all of them
+    profile->cell_size = (conf.extra_count > 0) ? profile->buf_size : 0;
+
+    // output of a line depends on the others for optimal fit and SGR
+    profile->cached = conf.cache_lines > 0 && conf.max_width > 0 &&
+        !conf.ansi_escapes && !vm_filling(&conf);
+
+    // lines shared by several widths are decoded rather than borrowed
+    if (conf.trusted && conf.extra_count <= 0) {
+        profile->feeder = vm_feed_trusted;
+    } else if (conf.ascii_mode) {
+        profile->feeder = vm_feed_ascii;
+    } else {
+        profile->feeder = vm_feed_decoded;
+    }
+
+    if (conf.extra_count > 0 && !profile_follow(profile, &conf)) {
+        ufold_profile_free(profile);
+        logged_return(NULL);
+    }
+    return profile;
+}
+
+void ufold_profile_free(ufold_profile_t* profile)
+{
+    if (profile != NULL) {
+        ufold_vm_realloc_t realloc = profile->config.realloc;
+
+        for (size_t i = 0; i < profile->follower_count; ++i) {
+            ufold_profile_free(profile->followers[i]);
+        }
+        realloc(profile->followers, 0);
+        realloc(profile->config.ellipsis, 0);
+
+        if (profile->config.punct == NULL) {
+            realloc(profile->config.punctuation, 0);
+        }
+        ufold_punct_free(profile->punct);
+        realloc(profile, 0);
+    }
+}
+
+ufold_vm_t* ufold_vm_new_from_profile(const ufold_profile_t* profile,
+                                      ufold_vm_write_t write)
+{
+    const ufold_vm_config_t* conf = &profile->config;
+    // slots are never resized, so they follow the VM in the same block,
+    // along with cells decoded for extra widths and SGR for escapes
+    size_t cell_size = (profile->follower_count > 0) ? profile->slot_size : 0;
+    size_t sgr_size = vm_keeping_sgr(conf) ? ANSI_MAX : 0;
+    ufold_vm_t* vm = conf->realloc(NULL, sizeof(ufold_vm_t) +
+                                   profile->slot_size + cell_size + sgr_size);
+
+    if (vm == NULL) {
+        // TODO: inform error type?
+        logged_return(NULL);
+    }
+    memset(vm, 0, sizeof(ufold_vm_t));
+
+    vm->config = *conf;
+    vm->profile = profile;
+    vm->own_profile = NULL;
+    vm->ellipsis_width = profile->ellipsis_width;
+    vm_widths(vm);
+
+    if (write != NULL) {
+        vm->config.write = write;
+    }
+
+    vm->slots = (uint8_t*)(vm + 1);
+    vm->slot_size = profile->slot_size;
+    vm->slot_cells = (cell_size > 0) ? vm->slots + vm->slot_size : NULL;
+    vm->sgr = (sgr_size > 0) ? vm->slots + vm->slot_size + cell_size : NULL;
+
+    if (profile->buf_size > 0) {
+        if ((vm->buf = vm_realloc(vm, NULL, profile->buf_size)) == NULL) {
             ufold_vm_free(vm);
             logged_return(NULL);
         }
+        if (profile->cell_size > 0) {
+            vm->cells = vm_realloc(vm, NULL, profile->cell_size);
+
+            if (vm->cells == NULL) {
+                ufold_vm_free(vm);
+                logged_return(NULL);
+            }
+        }
         vm->line = vm->buf;
-        vm->buf_size = size;
+        vm->buf_size = profile->buf_size;
         vm->line_size = 0;
-        vm->max_size = vm->buf_size - SLOT_SIZE - 1;
-#ifndef UFOLD_DEBUG
+        vm->max_size = vm->buf_size - vm->slot_size - 1;
     } else {
         vm->line = NULL;
         vm->buf_size = 0;
         vm->line_size = 0;
         vm->max_size = 0;
     }
-#endif
 
     vm->cursor = 0;
     vm->cursor_offset = 0;
@@ -207,628 +748,2471 @@ ufold_vm_t* ufold_vm_new(const ufold_vm_config_t* config)
     vm->eow = 0;
     vm->eow_ss = 0;
     vm->eow_ww = 0;
+    vm->eow_width = 0;
+    vm->cut = 0;
+    vm->cut_width = 0;
     vm->slot_used = 0;
     vm->slot_cursor = 0;
+    vm->slot_escape = 0;
+    vm->slot_ansi = ANSI_NONE;
     vm->slot_crlf = false;
+    vm->unit_used = 0;
+    vm->unit_le = (conf->input_encoding == UFOLD_ENCODING_UTF16LE);
+    vm->unit_started = false;
     vm->indent = NULL;
     vm->indent_size = 0;
     vm->indent_width = 0;
     vm->indent_bufsize = 0;
+    vm->indent_borrowed = 0;
     vm->indent_hanging = false;
+    vm->line_borrowed = false;
+    vm->line_raw = false;
+    vm->yield = false;
     vm->state = VM_LINE;
     vm->stopped = false;
+    vm->iter = NULL;
+    vm->metrics.lines = 0;
+    vm->metrics.max_width = 0;
+    vm->metrics.bytes = 0;
+    vm->output_width = 0;
+    vm->output_pending = false;
+    vm->sgr_size = 0;
+    vm->write_to = NULL;
+    vm->write_context = NULL;
+    vm->output = NULL;
+    vm->output_size = 0;
+    vm->output_capacity = 0;
+    vm->followers = NULL;
+    vm->follower_count = 0;
+    vm->words = NULL;
+    vm->word_capacity = 0;
+    vm->fill = NULL;
+    vm->fill_count = 0;
+    vm->fill_next = 0;
+    vm->fill_capacity = 0;
+    vm->fill_scan = 0;
+    vm->cache = NULL;
+
+    if (profile->cached && !vm_cache_new(vm)) {
+        ufold_vm_free(vm);
+        logged_return(NULL);
+    }
+
+    if (profile->follower_count > 0 && !vm_follow(vm)) {
+        ufold_vm_free(vm);
+        logged_return(NULL);
+    }
+    return vm;
+}
+
+ufold_vm_t* ufold_vm_new_with_writers(const ufold_profile_t* profile,
+                                      const ufold_vm_writer_t* writers,
+                                      size_t count)
+{
+    if (count > profile->follower_count + 1) {
+        logged_return(NULL);
+    }
+    ufold_vm_t* vm = ufold_vm_new_from_profile(profile, NULL);
+
+    if (vm == NULL) {
+        logged_return(NULL);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        ufold_vm_t* v = (i > 0) ? vm->followers[i - 1] : vm;
 
+        v->write_to = writers[i].write;
+        v->write_context = writers[i].context;
+    }
     return vm;
 }
 
 void ufold_vm_free(ufold_vm_t* vm)
 {
     if (vm != NULL) {
-        vm_free(vm, vm->config.punctuation);
+        ufold_profile_t* profile = vm->own_profile;
+
         vm_free(vm, vm->buf);
-        vm_free(vm, vm->slots);
         vm_free(vm, vm->indent);
+        vm_free(vm, vm->cells);
+        vm_free(vm, vm->words);
+        vm_free(vm, vm->fill);
+        vm_cache_free(vm);
+
+        for (size_t i = 0; i < vm->follower_count; ++i) {
+            ufold_vm_free(vm->followers[i]);
+        }
+        vm_free(vm, vm->followers);
         vm_free(vm, vm);
+        ufold_profile_free(profile);
     }
 }
 
-bool ufold_vm_stop(ufold_vm_t* vm)
+ufold_punct_t* ufold_punct_new(const ufold_vm_config_t* config)
 {
-    if (!vm->stopped) {
-        vm->stopped = true;
+    ufold_vm_realloc_t realloc = (config->realloc != NULL)
+        ? config->realloc : default_realloc;
+    bool ascii_mode = config->ascii_mode;
+    const char* chars = config->punctuation;
+    size_t len = (chars != NULL) ? strlen(chars) : 0;
+    size_t count = 0;
 
-        if (vm->slot_used > 0) {
-            debug_assert(vm->slot_cursor <= vm->slot_used);
-            debug_assert(vm->slot_used - vm->slot_cursor <= 4);
+    // NOTE: no more codepoints than bytes, and none of them is NUL
+    if (chars != NULL && !ascii_mode) {
+        for (size_t i = 0; i < len; ++i) {
+            count += ((uint8_t)chars[i] >= 0xC4);  // lead byte above U+00FF
+        }
+    }
+    // check overflow
+    if (count > (SIZE_MAX - sizeof(ufold_punct_t) - 1 - len) /
+            sizeof(utf8proc_int32_t)) {
+        logged_return(NULL);
+    }
+    size_t size = sizeof(ufold_punct_t) +
+        sizeof(utf8proc_int32_t) * count + ((chars != NULL) ? len + 1 : 0);
+    ufold_punct_t* punct = realloc(NULL, size);
 
-            // sanitize invalid/incomplete byte sequence
-            size_t n = 0;
+    if (punct == NULL) {
+        logged_return(NULL);
+    }
+    memset(punct, 0, sizeof(ufold_punct_t));
 
-            if (vm->config.ascii_mode) {
-                for (size_t i = 0; i < vm->slot_used; ++i) {
-                    vm->slots[i] = ascii_sanitize(vm->slots[i]);
-                }
-                n = vm->slot_used;
-            } else {
-                n = utf8_sanitize(vm->slots, vm->slot_used);
+    punct->realloc = realloc;
+    punct->codepoints = (utf8proc_int32_t*)(punct + 1);
+    punct->ascii_mode = ascii_mode;
+
+    if (chars == NULL) {
+        for (utf8proc_int32_t c = 0; c <= 0xFF; ++c) {
+            if (is_hanging_punctuation(c, ascii_mode)) {
+                punct->low[c >> 6] |= (uint64_t)1 << (c & 0x3F);
             }
+        }
+        return punct;
+    }
+    punct->chars = (char*)(punct->codepoints + count);
+    memcpy(punct->chars, chars, len + 1);
 
-            if (!vm_feed(vm, vm->slots, n)) {
-                logged_return(false);
+    utf8proc_int32_t codepoint = -1;
+    utf8proc_ssize_t n_bytes = -1;
+
+    for (size_t i = 0; i < len; i += n_bytes) {
+        if (ascii_mode) {
+            codepoint = (uint8_t)chars[i];
+            n_bytes = 1;
+        } else {
+            n_bytes = utf8proc_iterate((const uint8_t*)chars + i, len - i,
+                                       &codepoint);
+            // unlike a substring, malformed bytes match no character
+            if (n_bytes <= 0 || n_bytes > 4) {
+                n_bytes = 1;
+                continue;
             }
-            vm->slot_cursor = vm->slot_used;
-            vm_slot_shift(vm, vm->slot_used);
         }
-        if (!vm_flush(vm)) {
-            logged_return(false);
+        if (codepoint <= 0xFF) {
+            punct->low[codepoint >> 6] |= (uint64_t)1 << (codepoint & 0x3F);
+        } else {
+            debug_assert(punct->count < count);
+
+            punct->codepoints[punct->count++] = codepoint;
         }
-        debug_assert(vm->line_size <= 0);
     }
-    return true;
+    qsort(punct->codepoints, punct->count, sizeof(utf8proc_int32_t),
+          punct_compare);
+
+    return punct;
 }
 
-bool ufold_vm_flush(ufold_vm_t* vm)
+void ufold_punct_free(ufold_punct_t* punct)
 {
-    if (!vm->stopped) {
-        if (!vm_flush(vm)) {
-            vm->stopped = true;
-            logged_return(false);
-        }
-        return true;
+    if (punct != NULL) {
+        punct->realloc(punct, 0);
     }
-    logged_return(false);
 }
 
-bool ufold_vm_feed(ufold_vm_t* vm, const void* input, size_t size)
+bool ufold_width_table_init(ufold_width_table_t* table,
+                            const void* data, size_t size)
 {
-    if (vm->stopped) {
+    const uint8_t* bytes = data;
+
+    if (size < WT_HEADER_SIZE || memcmp(bytes, WT_MAGIC, 4) != 0 ||
+            bytes[4] != WT_VERSION || bytes[5] < 1 || bytes[5] > 16 ||
+            bytes[6] != 0 || bytes[7] != 0) {
         logged_return(false);
     }
+    size_t shift = bytes[5];
+    size_t count = bytes[8] | (bytes[9] << 8) | ((size_t)bytes[10] << 16) |
+                   ((size_t)bytes[11] << 24);
+    size_t ranges = (size_t)0x110000 >> shift;
 
-    if (vm->config.ascii_mode) {
-        if (!vm_feed_ascii(vm, (const uint8_t*)input, size)) {
-            vm->stopped = true;
+    // block numbers are 16-bit
+    if (count < 1 || count > 0x10000 ||
+            size != WT_HEADER_SIZE + ranges * 2 + (count << (shift - 1))) {
+        logged_return(false);
+    }
+    const uint8_t* index = bytes + WT_HEADER_SIZE;
+    const uint8_t* blocks = index + ranges * 2;
+
+    for (size_t i = 0; i < ranges; ++i) {
+        if ((index[i * 2] | (index[i * 2 + 1] << 8)) >= count) {
             logged_return(false);
         }
-        return true;
     }
-
-    for (size_t i = 0; i < size; ++i) {
-        size_t n = vm_slot(vm, ((const uint8_t*)input)[i]);
-        if (n > 0) {
-            // TODO: new option for interpreting ANSI color codes
-            size_t k = utf8_sanitize(vm->slots, n);
-
-            if (!vm_feed(vm, vm->slots, k)) {
-                vm->stopped = true;
-                logged_return(false);
-            }
-            vm_slot_shift(vm, n);
+    for (size_t i = 0; i < (count << (shift - 1)); ++i) {
+        if ((blocks[i] & 0x0F) > CW_AMBIGUOUS ||
+                (blocks[i] >> 4) > CW_AMBIGUOUS) {
+            logged_return(false);
         }
     }
+
+    table->index = index;
+    table->blocks = blocks;
+    table->shift = shift;
+    table->hash = hash_bytes(bytes, size, 0);
+
     return true;
 }
 
 /*\
  / DESCRIPTION
- /   Push bytes into the available slots and pull back a valid byte sequence.
- /   A potentially well-formed UTF-8 byte sequence is not useful yet.
- /
- / RETURN
- /   N :: N bytes in slots are ready for use
- /   0 :: queuing, retry later
+ /   Order codepoints of compiled punctuation.
 \*/
-static size_t vm_slot(ufold_vm_t* vm, uint8_t byte)
+static int punct_compare(const void* a, const void* b)
 {
-    debug_assert(vm->slot_used < SLOT_SIZE);
-    debug_assert(vm->slot_cursor <= vm->slot_used);
-
-    uint8_t c = byte;
+    utf8proc_int32_t x = *(const utf8proc_int32_t*)a;
+    utf8proc_int32_t y = *(const utf8proc_int32_t*)b;
 
-    // NOTE: ASCII Normalization: CRLF, CR -> LF
-    if (c == '\r') {
-        vm->slot_crlf = true;
-        c = '\n';
-    } else {
-        bool crlf_combined = (c == '\n' && vm->slot_crlf);
+    return (x > y) - (x < y);
+}
 
-        vm->slot_crlf = false;
+bool ufold_vm_stop(ufold_vm_t* vm)
+{
+    if (!vm->stopped) {
+        vm->stopped = true;
 
-        if (crlf_combined) {
-            return 0;
-        }
-    }
-    vm->slots[vm->slot_used++] = c;
+        if (vm->unit_used > 0) {
+            // sanitize code units cut off at the end of input
+            uint8_t marks[] = "??";
+            size_t n = vm->unit_used / 2 + vm->unit_used % 2;
 
-    while (vm->slot_cursor < vm->slot_used) {
-        size_t k = utf8_valid_length(vm->slots[vm->slot_cursor]);
+            vm->unit_used = 0;
 
-        if (k <= 0) {
-            // skip an invalid starting byte
-            vm->slot_cursor += 1;
-            continue;
-        }
-        if (k > vm->slot_used - vm->slot_cursor) {
-            // found an incomplete sequence; need the rest bytes
-            break;
+            if (!vm_feed_input(vm, marks, n)) {
+                logged_return(false);
+            }
         }
+        if (vm->slot_used > 0) {
+            debug_assert(vm->slot_cursor <= vm->slot_used);
+            // all but an unterminated escape sequence is one character
+            debug_assert(vm->slot_used - vm->slot_cursor <= 4 ||
+                         vm->slot_ansi != ANSI_NONE);
 
-        utf8proc_int32_t codepoint = -1;
-        utf8proc_ssize_t n_bytes = -1;
-
-        n_bytes = utf8proc_iterate(vm->slots + vm->slot_cursor, k, &codepoint);
-        debug_assert(n_bytes != 0);
-        debug_assert(n_bytes <= 4);
-
-        if (n_bytes < 0) {
-            // skip an invalid starting byte of an invalid sequence
-            vm->slot_cursor += 1;
-        } else {
-            debug_assert(k == n_bytes);
-            // NOTE: UTF-8 Normalization: U+2028, U+2029, U+0085 -> LF
-            if (codepoint == 0x2028 || codepoint == 0x2029 ||
-                    codepoint == 0x0085) {
-                uint8_t* p = vm->slots + vm->slot_cursor;
-                size_t remains = vm->slot_used - vm->slot_cursor;
-
-                memmove(p, p + n_bytes, remains - n_bytes);
-                *p = '\n';
-                vm->slot_used -= n_bytes - 1;
-                vm->slot_cursor += 1;
+            // sanitize invalid/incomplete byte sequence
+            size_t n = 0;
 
-                if (vm->config.line_buffered) {
-                    return vm->slot_cursor;
+            if (vm->config.ascii_mode) {
+                for (size_t i = 0; i < vm->slot_used; ++i) {
+                    vm->slots[i] = ascii_sanitize(vm->slots[i]);
                 }
+                n = vm->slot_used;
             } else {
-                vm->slot_cursor += n_bytes;
+                n = vm_sanitize(vm, vm->slots, vm->slot_used);
+            }
 
-                if (vm->config.line_buffered
-                        && is_linefeed(codepoint, vm->config.ascii_mode)) {
-                    return vm->slot_cursor;
-                }
+            if (!vm_feed(vm, vm->slots, n)) {
+                logged_return(false);
             }
+            vm->slot_cursor = vm->slot_used;
+            vm_slot_shift(vm, vm->slot_used);
         }
-    }
+        if (!vm_flush(vm)) {
+            logged_return(false);
+        }
+        debug_assert(vm->line_size <= 0);
 
-    return vm->slot_used == SLOT_SIZE ? vm->slot_cursor : 0;
+        for (size_t i = 0; i < vm->follower_count; ++i) {
+            vm->followers[i]->stopped = true;
+
+            if (!vm_flush(vm->followers[i])) {
+                logged_return(false);
+            }
+        }
+    }
+    return true;
 }
 
-/*\
- / DESCRIPTION
- /   Shift the VM's buffer queuing slots by N places.
-\*/
-static void vm_slot_shift(ufold_vm_t* vm, size_t n)
+bool ufold_vm_flush(ufold_vm_t* vm)
 {
-    debug_assert(vm->slot_used >= n);
-    debug_assert(vm->slot_cursor >= n);
-
-    if (vm->slot_used <= n) {
-        vm->slot_used = 0;
-        vm->slot_cursor = 0;
-    } else {
-        memmove(vm->slots, vm->slots + n, vm->slot_used - n);
-        vm->slot_used -= n;
-        vm->slot_cursor -= n;
+    if (!vm->stopped) {
+        if (vm->config.line_buffered && !vm_slot_flush(vm)) {
+            vm->stopped = true;
+            logged_return(false);
+        }
+        if (!vm_flush(vm)) {
+            vm->stopped = true;
+            logged_return(false);
+        }
+        for (size_t i = 0; i < vm->follower_count; ++i) {
+            if (!vm_flush(vm->followers[i])) {
+                vm->stopped = true;
+                logged_return(false);
+            }
+        }
+        return true;
     }
+    logged_return(false);
 }
 
-/*\
- / DESCRIPTION
- /   Shift the VM's line buffer by N places.
-\*/
-static void vm_line_shift(ufold_vm_t* vm, size_t n)
+bool ufold_vm_feed(ufold_vm_t* vm, const void* input, size_t size)
 {
-    debug_assert(vm->line_size >= n);
-
-    if (vm->line_size <= n) {
-        vm->line = vm->buf;
-        vm->line_size = 0;
-        vm->max_size = vm->buf_size - SLOT_SIZE - 1;
-        vm->cursor = 0;
-        vm_eow_reset(vm);
-    } else {
-        if (vm->max_size > n) {
-            vm->max_size -= n;
-        } else {
-            vm->max_size = 0;
-        }
+    if (vm->stopped) {
+        logged_return(false);
+    }
+    if (ufold_vm_done(vm)) {
+        return true;
+    }
 
-        vm->line += n;
-        vm->line_size -= n;
+    bool done = vm_transcoding(vm)
+        ? vm_feed_encoded(vm, (const uint8_t*)input, size)
+        : vm_feed_input(vm, (const uint8_t*)input, size);
 
-        debug_assert(vm->cursor <= vm->line_size);
-        debug_assert(vm->eow <= vm->line_size);
-        debug_assert(vm->eow + vm->eow_ss <= vm->line_size);
+    if (!done) {
+        vm->stopped = true;
+        logged_return(false);
     }
+    return true;
 }
 
-static bool vm_line_update_capacity(ufold_vm_t* vm)
+bool ufold_vm_feedv(ufold_vm_t* vm, const ufold_vm_iovec_t* iov, size_t count)
 {
-    // may be looking for the word boundary
-    if (vm->line_size > vm->max_size) {
-        size_t offset = vm->line - vm->buf;
-
-        if (vm->line_size > vm->buf_size - SLOT_SIZE - 1) {
-            // LINE AREA + OVERFLOW AREA
-            size_t buf_size = vm->buf_size + SLOT_SIZE + 1;
-            // check overflow
-            if (buf_size <= SLOT_SIZE) {
-                logged_return(false);
-            }
-            uint8_t* buf = vm_realloc(vm, vm->buf, buf_size);
+    if (vm->stopped) {
+        logged_return(false);
+    }
+    if (ufold_vm_done(vm)) {
+        return true;
+    }
 
-            if (buf == NULL) {
+    for (size_t i = 0; i < count; ++i) {
+        // lines shared by several widths are decoded rather than borrowed
+        if (!iov[i].clean || vm->follower_count > 0 || vm_transcoding(vm)) {
+            if (!ufold_vm_feed(vm, iov[i].base, iov[i].size)) {
                 logged_return(false);
             }
-            vm->buf = buf;
-            vm->buf_size = buf_size;
+        } else if (!vm_feed_clean(vm, iov[i].base, iov[i].size)) {
+            vm->stopped = true;
+            logged_return(false);
         }
-        memmove(vm->buf, vm->buf + offset, vm->line_size + 1);
-        vm->line = vm->buf;
-        vm->max_size = vm->buf_size - SLOT_SIZE - 1;
     }
     return true;
 }
 
-/*\
- / DESCRIPTION
- /   Fill the line with new bytes and produce output.
-\*/
-static bool vm_feed(ufold_vm_t* vm, const uint8_t* bytes, size_t size)
+void ufold_iter_init(ufold_iter_t* iter, const ufold_vm_config_t* config,
+                     const void* input, size_t size)
 {
-#ifndef UFOLD_DEBUG
-    // inharmonious logic
-    if (vm->config.max_width == 0) {
-        // write sanitized input
-        if (size > 0 && !vm->config.write(bytes, size)) {
-            logged_return(false);
+    memset(iter, 0, sizeof(ufold_iter_t));
+
+    iter->config = *config;
+    iter->config.write = NULL;
+    iter->config.realloc = NULL;
+    iter->input = input;
+    iter->size = size;
+    iter->state = VM_LINE;
+    iter->span_open = false;
+    iter->span_count = 0;
+    iter->more = false;
+
+    // no memory to plan line breaks
+    iter->stopped = vm_filling(config);
+}
+
+bool ufold_iter_next(ufold_iter_t* iter, ufold_span_t* span)
+{
+    while (iter->span_count <= 0) {
+        if (iter->stopped) {
+            return false;
         }
-        return true;
-    }
-#endif
-    debug_assert(vm->line_size <= vm->max_size);
-    debug_assert(size <= SLOT_SIZE);
-    debug_assert(vm->line_size + size < vm->buf_size);
 
-    if (size > 0) {
-        memcpy(vm->line + vm->line_size, bytes, size);
-        vm->line_size += size;
+        ufold_vm_t vm;
+        vm_iter_load(&vm, iter);
 
-        if (vm->line_size > vm->max_size && !vm_flush(vm)) {
-            logged_return(false);
+        bool done = vm_flush(&vm);
+
+        if (done && !vm.yield) {
+            if (iter->more) {
+                // wait for more input
+                vm_iter_save(&vm, iter);
+                return false;
+            }
+            // reached the end of input
+            vm.stopped = true;
+            done = vm_flush(&vm);
         }
-        if (!vm_line_update_capacity(vm)) {
+        vm_iter_save(&vm, iter);
+
+        if (!done) {
+            iter->stopped = true;
+            iter->span_count = 0;
             logged_return(false);
         }
     }
 
+    *span = iter->spans[0];
+    iter->spans[0] = iter->spans[1];
+    iter->span_count -= 1;
     return true;
 }
 
-/*\
- / DESCRIPTION
- /   Fill the line with new bytes and produce output.
-\*/
-static bool vm_feed_ascii(ufold_vm_t* vm, const uint8_t* bytes, size_t size)
+void ufold_iter_feed(ufold_iter_t* iter, const void* input, size_t size,
+                     bool more)
 {
-    debug_assert(vm->line_size <= vm->max_size);
-    debug_assert(vm->slot_used == 0);
-
-    for (size_t i = 0; i < size; ++i) {
-        uint8_t c = bytes[i];
-
-        // NOTE: ASCII Normalization: CRLF, CR -> LF
-        if (c == '\r') {
-            vm->slot_crlf = true;
-            c = '\n';
-        } else {
-            bool crlf_combined = (c == '\n' && vm->slot_crlf);
+    const uint8_t* bytes = input;
 
-            vm->slot_crlf = false;
+    debug_assert(iter->cells == NULL);
 
-            if (crlf_combined) {
-                continue;
+    if (more && size > 0 && bytes[size - 1] == '\r') {
+        size -= 1;  // CR may be followed by LF
+    }
+    if (more && !iter->config.ascii_mode) {
+        for (size_t i = size; i > 0 && size - i < 4; --i) {
+            if ((bytes[i - 1] & 0xC0) != 0x80) {
+                if (utf8_valid_length(bytes[i - 1]) > size - i + 1) {
+                    size = i - 1;  // incomplete character
+                }
+                break;
             }
         }
-#ifndef UFOLD_DEBUG
-        // inharmonious logic
-        if (vm->config.max_width == 0) {
-            size_t k = i % SLOT_SIZE;
-            vm->slots[k] = ascii_sanitize(c);
-
-            // write sanitized input
-            if ((k + 1 == SLOT_SIZE || i + 1 == size)
-                    && !vm->config.write(vm->slots, k + 1)) {
-                logged_return(false);
+    }
+    if (more && iter->config.ansi_escapes && !iter->config.ascii_mode) {
+        for (size_t i = (size > ANSI_MAX) ? size - ANSI_MAX : 0;
+                i < size; ++i) {
+            if (bytes[i] == 0x1B && ansi_cut(bytes + i, size - i)) {
+                size = i;  // incomplete escape sequence
+                break;
             }
-            continue;
         }
-#endif
-        vm->line[vm->line_size++] = ascii_sanitize(c);
+    }
+    iter->origin = iter->line;
+    iter->input = input;
+    iter->size = size;
+    iter->more = more;
+}
 
-        // TODO: provide a fast path for ASCII mode
-        if (vm->line_size > vm->max_size && !vm_flush(vm)) {
-            logged_return(false);
-        }
-        if (!vm_line_update_capacity(vm)) {
+size_t ufold_iter_rest(const ufold_iter_t* iter)
+{
+    return iter->line;
+}
+
+bool ufold_measure(const ufold_vm_config_t* config,
+                   const void* input, size_t size, ufold_metrics_t* metrics)
+{
+    memset(metrics, 0, sizeof(ufold_metrics_t));
+
+    // no memory to plan line breaks
+    if (vm_filling(config)) {
+        logged_return(false);
+    }
+    ufold_vm_config_t conf = *config;
+    ufold_punct_t* punct = NULL;
+
+    if (vm_compiling(config)) {
+        if ((punct = ufold_punct_new(config)) == NULL) {
             logged_return(false);
         }
+        conf.punct = punct;
+    }
+
+    ufold_vm_t vm;
+    uint8_t sgr[ANSI_MAX];
+
+    vm_borrow(&vm, &conf, input, size);
+    vm.config.count_only = true;
+    vm.sgr = vm_keeping_sgr(&conf) ? sgr : NULL;
+
+    bool done = vm_run(&vm);
+    *metrics = vm.metrics;
+    ufold_punct_free(punct);
+
+    if (!done) {
+        logged_return(false);
     }
     return true;
 }
 
-/*\
- / DESCRIPTION
- /   Flush buffered content.
-\*/
-static bool vm_flush(ufold_vm_t* vm)
+bool ufold_wrap(const ufold_vm_config_t* config,
+                const void* input, size_t size,
+                void* output, size_t capacity, size_t* needed)
 {
-#ifndef UFOLD_DEBUG
-    // inharmonious logic
-    if (vm->config.max_width == 0) {
-        return true;
-    }
-#endif
-    const uint8_t* sol = vm->line;
-    const uint8_t* bytes = vm->line + vm->cursor;
-    const uint8_t* word_end = vm->cursor_at_word ? vm->line + vm->cursor : NULL;
-    size_t cursor = vm->cursor;
-    size_t offset = vm->cursor_offset;
-    size_t tab_width = vm->config.tab_width;
-    utf8proc_int32_t codepoint = -1;
-    utf8proc_ssize_t n_bytes = -1;
-
-    debug_assert(vm->line_size < vm->buf_size);
-    vm->line[vm->line_size] = '\0';
-
-    for (size_t i = cursor; i < vm->line_size; i += n_bytes, bytes += n_bytes) {
-        debug_assert(bytes == vm->line + i);
+    ufold_metrics_t metrics;
+    *needed = 0;
 
-        if (vm->config.ascii_mode) {
-            codepoint = *bytes;
-            n_bytes = (codepoint >= 0 && codepoint <= 0x7F ? 1 : -1);
-        } else {
-            n_bytes = utf8proc_iterate(bytes, vm->line_size - i, &codepoint);
-        }
+    // the set is compiled once for both passes
+    ufold_vm_config_t conf = *config;
+    ufold_punct_t* punct = NULL;
 
-        if (n_bytes == 0) {
-            if (vm->line_size - i != 0) {
-                logged_return(false);
-            }
-            break;
-        }
-        if (n_bytes < 0 || n_bytes > 4) {
+    if (vm_compiling(config)) {
+        if ((punct = ufold_punct_new(config)) == NULL) {
             logged_return(false);
         }
+        conf.punct = punct;
+    }
 
-        int width = 0;
+    // checked by ufold_measure for optimal fit
+    bool done = ufold_measure(&conf, input, size, &metrics);
 
-        if (codepoint == '\t') {
-            // TODO: any place for recalculation?
-            width = calc_tab_width(tab_width, offset);
+    if (done) {
+        *needed = metrics.bytes;
+    }
+    if (done && output != NULL) {
+        if (capacity < metrics.bytes) {
+            done = false;
         } else {
-            width = get_charwidth(codepoint, vm->config.ascii_mode);
-        }
+            ufold_vm_t vm;
+            uint8_t sgr[ANSI_MAX];
 
-        if (width > 0) {
-            // check overflow
-            if (offset + width < offset) {
-                logged_return(false);
-            }
-            offset += width;
-        } else if (width < 0) {
-            logged_return(false);
+            vm_borrow(&vm, &conf, input, size);
+            vm.config.count_only = false;
+            vm.sgr = vm_keeping_sgr(&conf) ? sgr : NULL;
+            vm.output = output;
+            vm.output_capacity = metrics.bytes;
+
+            done = vm_run(&vm);
+            debug_assert(!done || vm.output_size == metrics.bytes);
         }
+    }
+    ufold_punct_free(punct);
 
-        if (vm->config.max_width <= 0) {
-            debug_assert(vm->state != VM_WORD);
-            debug_assert(vm->state != VM_WRAP);
-            debug_assert(vm->indent_size == 0);
+    if (!done) {
+        logged_return(false);
+    }
+    return true;
+}
 
-            vm->state = VM_FULL;
-        }
+void ufold_vm_metrics(const ufold_vm_t* vm, ufold_metrics_t* metrics)
+{
+    *metrics = vm->metrics;
+}
+
+void ufold_vm_cache_stats(const ufold_vm_t* vm, ufold_cache_stats_t* stats)
+{
+    if (vm->cache != NULL) {
+        *stats = vm->cache->stats;
+    } else {
+        memset(stats, 0, sizeof(ufold_cache_stats_t));
+    }
+}
 
-        bool eol_found = is_linefeed(codepoint, vm->config.ascii_mode);
+bool ufold_vm_done(const ufold_vm_t* vm)
+{
+    if (!vm_limited(vm)) {
+        return false;
+    }
+    for (size_t i = 0; i < vm->follower_count; ++i) {
+        if (!vm_limited(vm->followers[i])) {
+            return false;
+        }
+    }
+    return true;
+}
 
-        bool ws_found = !eol_found && is_whitespace(codepoint,
-                                                    vm->config.ascii_mode);
+bool ufold_vm_snapshot(const ufold_vm_t* vm,
+                       void* buffer, size_t capacity, size_t* needed)
+{
+    vm_snap_t snap = {NULL, 0, 0, false};
 
-        debug_assert(!eol_found || width == 0);
+    // NOTE: two passes: measure and then write
+    for (int pass = 0; pass < 2; ++pass) {
+        snap_put_data(&snap, SNAP_MAGIC, 4);
+        snap_put(&snap, SNAP_VERSION);
+        vm_save_config(vm, &snap);
+        vm_save(vm, &snap);
 
-        if (vm->state != VM_FULL) {
-            if (!eol_found && !ws_found) {
-                if (vm->eow > 0) {
-                    vm->eow_ww += width;
-                }
-                word_end = bytes + n_bytes;
-            } else {
-                if (word_end != NULL) {
-                    // no break at zero-width text right after newline
-                    if (offset > 0) {
-                        vm->eow = word_end - vm->line;
-                        vm->eow_ss = 0;
-                        vm->eow_ww = 0;
-                    }
-                    word_end = NULL;
-                }
-                if (vm->eow > 0) {
-                    vm->eow_ss += n_bytes;
-                }
-            }
+        for (size_t i = 0; i < vm->follower_count; ++i) {
+            vm_save(vm->followers[i], &snap);
         }
 
-        if (vm->state == VM_WRAP)
-        {
-            if (vm->config.break_at_spaces) {
-                if (ws_found && sol == bytes) {
-                    // skip whitespace after breakpoint
-                    sol = bytes + n_bytes;
-                    offset = vm->indent_width;
-                    continue;
-                }
-                if (eol_found && sol <= bytes - n_bytes) {
-                    debug_assert(offset <= vm->config.max_width);
+        if (pass == 0) {
+            *needed = snap.size;
 
-                    if (!vm->config.write("\n", 1)) {
-                        logged_return(false);
-                    }
-                    if (vm->config.keep_indentation) {
-                        if (!vm_indent(vm)) {
-                            logged_return(false);
-                        }
-                        vm_indent_reset(vm);
-                    }
-                    if (!vm->config.write(sol, bytes - sol + n_bytes)) {
-                        logged_return(false);
-                    }
-                    sol = bytes + n_bytes;
-                    offset = 0;
-                    vm_eow_reset(vm);
-                    vm->state = VM_LINE;
-                    continue;
-                }
+            if (buffer == NULL) {
+                return true;
             }
-            if (!vm->config.write("\n", 1)) {
+            if (capacity < snap.size) {
                 logged_return(false);
             }
-            if (eol_found) {
-                // hard break after a character right before line end
-                if (vm->config.keep_indentation) {
-                    vm_indent_reset(vm);
-                }
-                sol = bytes + n_bytes;
-                offset = 0;
-                vm_eow_reset(vm);
-                vm->state = VM_LINE;
-                continue;
-            }
-            if (vm->config.keep_indentation) {
-                if (!vm_indent(vm)) {
-                    logged_return(false);
-                }
-            }
-            vm->state = VM_WORD;
+            snap.bytes = buffer;
+            snap.size = 0;
+            snap.capacity = capacity;
         }
-        else if (vm->state == VM_LINE)
-        {
-            if (vm->config.keep_indentation) {
-                if (!vm->indent_hanging && ws_found) {
-                    if (!vm_indent_feed(vm, bytes, n_bytes, width)) {
-                        logged_return(false);
-                    }
-                    continue;
-                } else if (vm->config.hang_punctuation) {
-                    bool valid = false;
-
-                    if (vm->config.punctuation == NULL) {
-                        valid = is_punctuation(NULL, NULL, codepoint,
-                                               vm->config.ascii_mode);
-                    } else {
-                        char buf[5];
-                        memcpy(buf, bytes, n_bytes);
-                        buf[n_bytes] = '\0';
-                        valid = is_punctuation(vm->config.punctuation, buf, 0,
-                                               vm->config.ascii_mode);
-                    }
-                    if (valid) {
-                        // assert cancelled for Markdown? e.g. "*   list item"
-                        //debug_assert(!ws_found);
+    }
+    debug_assert(snap.size == *needed);
+    return true;
+}
 
-                        for (size_t k = 0; k < width; ++k) {
-                            if (!vm_indent_feed(vm, " ", 1, 1)) {
-                                logged_return(false);
-                            }
-                        }
-                        vm->indent_hanging = true;
-                        word_end = NULL;
-                        continue;
-                    }
-                }
-                vm->state = VM_WORD;
+ufold_vm_t* ufold_vm_restore(const ufold_vm_config_t* config,
+                             const void* state, size_t size)
+{
+    vm_snap_t snap = {(uint8_t*)state, 0, size, false};
+    const uint8_t* magic = snap_get_data(&snap, 4);
 
-                if (vm->indent_width >= vm->config.max_width) {
-                    debug_assert(vm->state != VM_FULL);
+    if (magic == NULL || memcmp(magic, SNAP_MAGIC, 4) != 0 ||
+            snap_get(&snap) != SNAP_VERSION) {
+        logged_return(NULL);
+    }
+    if (!vm_check_config(config, &snap)) {
+        logged_return(NULL);
+    }
 
-                    vm->state = VM_FULL;
-                    vm_indent_reset(vm);
-                }
-            } else {
-                vm->state = VM_WORD;
-            }
+    ufold_vm_t* vm = ufold_vm_new(config);
+
+    if (vm == NULL) {
+        logged_return(NULL);
+    }
+    if (!vm_load(vm, &snap)) {
+        ufold_vm_free(vm);
+        logged_return(NULL);
+    }
+    for (size_t i = 0; i < vm->follower_count; ++i) {
+        if (!vm_load(vm->followers[i], &snap)) {
+            ufold_vm_free(vm);
+            logged_return(NULL);
         }
+    }
+    if (snap.size != size) {
+        ufold_vm_free(vm);
+        logged_return(NULL);
+    }
+    return vm;
+}
 
-        debug_assert(vm->state != VM_LINE);
-        debug_assert(vm->state != VM_WRAP);
-        debug_assert(sol <= bytes);
+ufold_index_t* ufold_index_new(ufold_vm_write_t write,
+                               ufold_vm_realloc_t realloc, size_t interval)
+{
+    if (realloc == NULL) {
+        realloc = default_realloc;
+    }
 
-        if (vm->state == VM_FULL)
-        {
-            debug_assert(vm->indent_size == 0);
+    ufold_index_t* index = realloc(NULL, sizeof(ufold_index_t));
 
-            if (eol_found) {
-                if (!vm->config.write(sol, bytes - sol + n_bytes)) {
-                    logged_return(false);
-                }
-                sol = bytes + n_bytes;
-                offset = 0;
-                vm_eow_reset(vm);
-                vm->state = VM_LINE;
-                continue;
-            }
-        }
-        // TODO: https://www.unicode.org/reports/tr29/#Word_Boundaries
-        else if (offset > vm->config.max_width)
-        {
-            // TODO: do not break before the long word; truncate it
-            //     |    oh a_long_word_that_fits_|not_the_next_line
-            //     |      ^                      |
-            //     |oh a_long_word_that_fits_not_|the_next_line
-            //     |  ^                          |
-            //     :                             :
-            //     |    oh a_long_word_that_fits_|
-            //     |    not_the_next_line        |
-            //     |oh a_long_word_that_fits_not_|
-            //     |the_next_line                |
-            if (vm->config.break_at_spaces && vm->eow > 0) {
-                debug_assert(vm->eow > sol - vm->line);
+    if (index == NULL) {
+        logged_return(NULL);
+    }
+    memset(index, 0, sizeof(ufold_index_t));
 
-                if (!vm->config.write(sol, vm->eow - (sol - vm->line))) {
-                    logged_return(false);
-                }
-                sol = vm->line + vm->eow + vm->eow_ss;
-                offset = vm->indent_width + vm->eow_ww;
-                debug_assert(sol <= bytes + n_bytes);
+    index->write = write;
+    index->realloc = realloc;
+    index->interval = max(interval, 1);
+    index->next = 0;
+    index->size = 0;
+    index->table = NULL;
+    index->table_size = 0;
+    index->table_capacity = 0;
+    index->record = NULL;
+    index->record_capacity = 0;
+    index->stopped = false;
 
-                // because of zero-width whitespace like --tab=0
-                if (offset > vm->config.max_width) {
-                    debug_assert(vm->eow_ww > 0);
-                    debug_assert(width > 0);
-                    debug_assert(!ws_found && !eol_found);
+    uint8_t header[32];
+    vm_snap_t snap = {header, 0, sizeof(header), false};
 
-                    n_bytes = 0;
-                    offset -= width;
-                    vm_eow_reset(vm);
-                    vm->state = VM_WRAP;
-                    continue;
-                }
+    snap_put_data(&snap, INDEX_MAGIC, 4);
+    snap_put(&snap, INDEX_VERSION);
+    snap_put(&snap, index->interval);
 
-                if (!eol_found) {
-                    vm_eow_reset(vm);  // next, skip whitespace
-                    vm->state = VM_WRAP;
-                } else {
-                    debug_assert(vm->indent_width + vm->eow_ww
-                                 <= vm->config.max_width);
+    if (!index_write(index, header, snap.size)) {
+        ufold_index_free(index);
+        logged_return(NULL);
+    }
+    return index;
+}
 
-                    if (!vm->config.write("\n", 1)) {
-                        logged_return(false);
-                    }
-                    if (vm->config.keep_indentation) {
-                        if (!vm_indent(vm)) {
-                            logged_return(false);
+void ufold_index_free(ufold_index_t* index)
+{
+    if (index != NULL) {
+        ufold_vm_realloc_t realloc = index->realloc;
+
+        if (index->table != NULL) {
+            realloc(index->table, 0);
+        }
+        if (index->record != NULL) {
+            realloc(index->record, 0);
+        }
+        realloc(index, 0);
+    }
+}
+
+bool ufold_index_update(ufold_index_t* index, const ufold_vm_t* vm,
+                        size_t offset)
+{
+    if (index->stopped) {
+        logged_return(false);
+    }
+    if (vm->metrics.lines < index->next) {
+        return true;
+    }
+
+    // NOTE: checkpoint :: line offset state_size state
+    size_t state_size = 0;
+
+    if (!ufold_vm_snapshot(vm, NULL, 0, &state_size)) {
+        index->stopped = true;
+        logged_return(false);
+    }
+    vm_snap_t snap = {NULL, 0, 0, false};
+
+    snap_put(&snap, vm->metrics.lines);
+    snap_put(&snap, offset);
+    snap_put(&snap, state_size);
+
+    size_t size = snap.size;
+
+    // check overflow
+    if (!add(&size, state_size) ||
+            !buf_reserve(index->realloc, (void**)&index->record,
+                         &index->record_capacity, size, 1) ||
+            !buf_reserve(index->realloc, (void**)&index->table,
+                         &index->table_capacity,
+                         index->table_size + INDEX_ENTRY_SIZE, 1)) {
+        index->stopped = true;
+        logged_return(false);
+    }
+    snap.bytes = index->record;
+    snap.capacity = size;
+    snap.size = 0;
+
+    snap_put(&snap, vm->metrics.lines);
+    snap_put(&snap, offset);
+    snap_put(&snap, state_size);
+
+    if (!ufold_vm_snapshot(vm, index->record + snap.size, state_size,
+                           &state_size)) {
+        index->stopped = true;
+        logged_return(false);
+    }
+
+    // the first line output entirely after the checkpoint
+    vm_snap_t entry = {index->table, index->table_size,
+                       index->table_capacity, false};
+
+    snap_put_u64(&entry, vm->metrics.lines + (vm->output_pending ? 1 : 0));
+    snap_put_u64(&entry, index->size);
+
+    if (!index_write(index, index->record, size)) {
+        index->stopped = true;
+        logged_return(false);
+    }
+    index->table_size = entry.size;
+    index->next = vm->metrics.lines + index->interval;
+
+    // check overflow
+    if (index->next < index->interval) {
+        index->next = SIZE_MAX;
+    }
+    return true;
+}
+
+bool ufold_index_finish(ufold_index_t* index)
+{
+    if (index->stopped) {
+        logged_return(false);
+    }
+    index->stopped = true;
+
+    uint8_t footer[INDEX_FOOTER_SIZE];
+    vm_snap_t snap = {footer, 0, sizeof(footer), false};
+
+    snap_put_u64(&snap, index->size);
+    snap_put_u64(&snap, index->table_size / INDEX_ENTRY_SIZE);
+    snap_put_data(&snap, INDEX_MAGIC, 4);
+
+    if (!index_write(index, index->table, index->table_size) ||
+            !index_write(index, footer, snap.size)) {
+        logged_return(false);
+    }
+    return true;
+}
+
+bool ufold_index_seek(const void* index, size_t size, size_t line,
+                      ufold_checkpoint_t* checkpoint)
+{
+    vm_snap_t snap = {(uint8_t*)index, 0, size, false};
+    const uint8_t* magic = snap_get_data(&snap, 4);
+
+    if (magic == NULL || memcmp(magic, INDEX_MAGIC, 4) != 0 ||
+            snap_get(&snap) != INDEX_VERSION ||
+            size < snap.size + INDEX_FOOTER_SIZE) {
+        logged_return(false);
+    }
+
+    // NOTE: footer :: table_pos count magic
+    snap.size = size - INDEX_FOOTER_SIZE;
+
+    uint64_t table = snap_get_u64(&snap);
+    uint64_t count = snap_get_u64(&snap);
+
+    magic = snap_get_data(&snap, 4);
+
+    if (magic == NULL || memcmp(magic, INDEX_MAGIC, 4) != 0 ||
+            table > size - INDEX_FOOTER_SIZE || count <= 0 ||
+            count > (size - INDEX_FOOTER_SIZE - table) / INDEX_ENTRY_SIZE) {
+        logged_return(false);
+    }
+
+    // find the last checkpoint where the line is output entirely
+    size_t lo = 0;
+    size_t hi = count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        snap.size = table + mid * INDEX_ENTRY_SIZE;
+
+        if (snap_get_u64(&snap) <= line) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo <= 0) {
+        logged_return(false);
+    }
+    snap.size = table + (lo - 1) * INDEX_ENTRY_SIZE + 8;
+
+    uint64_t position = snap_get_u64(&snap);
+
+    if (position >= table) {
+        logged_return(false);
+    }
+    snap.size = position;
+    snap.capacity = table;
+    checkpoint->line = snap_get(&snap);
+    checkpoint->offset = snap_get(&snap);
+    checkpoint->state_size = snap_get(&snap);
+    checkpoint->state = snap_get_data(&snap, checkpoint->state_size);
+
+    if (snap.failed || checkpoint->line > line) {
+        logged_return(false);
+    }
+    return true;
+}
+
+ufold_doc_t* ufold_doc_new(const ufold_vm_config_t* config)
+{
+    ufold_vm_config_t conf = *config;
+
+    // lines are wrapped by the iterator
+    if (vm_filling(&conf)) {
+        logged_return(NULL);
+    }
+    if (conf.realloc == NULL) {
+        conf.realloc = default_realloc;
+    }
+
+    ufold_doc_t* doc = conf.realloc(NULL, sizeof(ufold_doc_t));
+
+    if (doc == NULL) {
+        logged_return(NULL);
+    }
+    memset(doc, 0, sizeof(ufold_doc_t));
+
+    doc->config = conf;
+    doc->config.write = NULL;
+    doc->config.punctuation = NULL;
+    doc->config.ellipsis = NULL;
+    doc->config.max_lines = 0;  // visual lines are kept for the whole text
+    doc->config.extra_widths = NULL;
+    doc->config.extra_writes = NULL;
+    doc->config.extra_count = 0;
+
+    if (conf.punctuation != NULL) {
+        size_t len = strlen(conf.punctuation) + 1;
+
+        if ((doc->config.punctuation = conf.realloc(NULL, len)) == NULL) {
+            ufold_doc_free(doc);
+            logged_return(NULL);
+        }
+        memcpy(doc->config.punctuation, conf.punctuation, len);
+    }
+    // shared by the VMs borrowing the text on every edit
+    if (vm_compiling(&doc->config)) {
+        if ((doc->punct = ufold_punct_new(&doc->config)) == NULL) {
+            ufold_doc_free(doc);
+            logged_return(NULL);
+        }
+        doc->config.punct = doc->punct;
+    }
+
+    if (conf.ellipsis != NULL) {
+        size_t len = strlen(conf.ellipsis) + 1;
+
+        if ((doc->config.ellipsis = conf.realloc(NULL, len)) == NULL) {
+            ufold_doc_free(doc);
+            logged_return(NULL);
+        }
+        memcpy(doc->config.ellipsis, conf.ellipsis, len);
+    }
+
+    doc->text = NULL;
+    doc->cells = NULL;
+    doc->size = 0;
+    doc->capacity = 0;
+    doc->cell_capacity = 0;
+    doc->spans = NULL;
+    doc->span_count = 0;
+    doc->span_capacity = 0;
+    doc->fresh = NULL;
+    doc->fresh_capacity = 0;
+    doc->stopped = false;
+
+    return doc;
+}
+
+void ufold_doc_free(ufold_doc_t* doc)
+{
+    if (doc != NULL) {
+        ufold_vm_realloc_t realloc = doc->config.realloc;
+
+        if (doc->config.punctuation != NULL) {
+            realloc(doc->config.punctuation, 0);
+        }
+        ufold_punct_free(doc->punct);
+        if (doc->config.ellipsis != NULL) {
+            realloc(doc->config.ellipsis, 0);
+        }
+        if (doc->text != NULL) {
+            realloc(doc->text, 0);
+        }
+        if (doc->cells != NULL) {
+            realloc(doc->cells, 0);
+        }
+        if (doc->spans != NULL) {
+            realloc(doc->spans, 0);
+        }
+        if (doc->fresh != NULL) {
+            realloc(doc->fresh, 0);
+        }
+        realloc(doc, 0);
+    }
+}
+
+bool ufold_doc_edit(ufold_doc_t* doc, size_t offset, size_t deleted,
+                    const void* inserted, size_t size,
+                    ufold_doc_change_t* change)
+{
+    if (doc->stopped) {
+        logged_return(false);
+    }
+    if (offset > doc->size || deleted > doc->size - offset) {
+        logged_return(false);
+    }
+    size_t old_size = doc->size;
+    size_t new_size = old_size - deleted;
+
+    // check overflow
+    if (!add(&new_size, size)) {
+        logged_return(false);
+    }
+    ufold_vm_realloc_t realloc = doc->config.realloc;
+
+    // never leave text without a buffer
+    if (!buf_reserve(realloc, (void**)&doc->text, &doc->capacity,
+                     max(new_size, 1), 1) ||
+            !buf_reserve(realloc, (void**)&doc->cells, &doc->cell_capacity,
+                         max(new_size, 1), 1)) {
+        logged_return(false);
+    }
+
+    // replace text
+    size_t tail = offset + deleted;
+
+    memmove(doc->text + offset + size, doc->text + tail, old_size - tail);
+    memmove(doc->cells + offset + size, doc->cells + tail, old_size - tail);
+    if (size > 0) {
+        memcpy(doc->text + offset, inserted, size);
+    }
+    doc->size = new_size;
+
+    // wrapping resets at every line feed, so only touched lines are affected
+    size_t start = doc_line_start(doc, offset);
+    size_t end = doc_line_end(doc, offset + size);
+
+    // decode touched lines once, since characters may have been split
+    ufold_vm_t vm;
+    vm_borrow(&vm, &doc->config, doc->text + start, end - start);
+
+    if (!vm_cells(&vm, vm.line, vm.line_size, doc->cells + start)) {
+        doc->stopped = true;
+        logged_return(false);
+    }
+
+    size_t old_end = end - size + deleted;
+    size_t first = doc_search(doc, start);
+    size_t last = (old_end < old_size) ? doc_search(doc, old_end)
+                                       : doc->span_count;
+
+    // re-wrap touched lines
+    size_t added = 0;
+    ufold_iter_t iter;
+    ufold_span_t span;
+
+    ufold_iter_init(&iter, &doc->config, doc->text + start, end - start);
+    iter.cells = doc->cells + start;
+
+    while (start < end && ufold_iter_next(&iter, &span)) {
+        if (!buf_reserve(realloc, (void**)&doc->fresh, &doc->fresh_capacity,
+                         added + 1, sizeof(ufold_span_t))) {
+            doc->stopped = true;
+            logged_return(false);
+        }
+        span.start += start;
+        span.end += start;
+        doc->fresh[added++] = span;
+    }
+
+    size_t count = doc->span_count - (last - first) + added;
+
+    if (!buf_reserve(realloc, (void**)&doc->spans, &doc->span_capacity,
+                     max(count, 1), sizeof(ufold_span_t))) {
+        doc->stopped = true;
+        logged_return(false);
+    }
+
+    // move the following lines by the edit
+    for (size_t i = last; i < doc->span_count; ++i) {
+        doc->spans[i].start = doc->spans[i].start - old_end + end;
+        doc->spans[i].end = doc->spans[i].end - old_end + end;
+    }
+    memmove(doc->spans + first + added, doc->spans + last,
+            sizeof(ufold_span_t) * (doc->span_count - last));
+    if (added > 0) {
+        memcpy(doc->spans + first, doc->fresh, sizeof(ufold_span_t) * added);
+    }
+    doc->span_count = count;
+
+    if (change != NULL) {
+        change->first = first;
+        change->removed = last - first;
+        change->added = added;
+    }
+    return true;
+}
+
+bool ufold_doc_resize(ufold_doc_t* doc, size_t max_width)
+{
+    if (doc->stopped) {
+        logged_return(false);
+    }
+    doc->config.max_width = max_width;
+
+    ufold_vm_realloc_t realloc = doc->config.realloc;
+    size_t count = 0;
+    size_t next = 0;  // first visual line of the logical line
+
+    // visual lines are rebuilt in the spare list
+    for (size_t start = 0; start < doc->size;) {
+        size_t end = doc_line_end(doc, start);
+        size_t last = next;
+
+        while (last < doc->span_count && doc->spans[last].start < end) {
+            last += 1;
+        }
+
+        // a whole line that was not wrapped and still fits is kept as is
+        const ufold_span_t* span = doc->spans + next;
+        size_t text_end = end;
+
+        while (text_end > start && (doc->text[text_end - 1] == '\n' ||
+                                    doc->text[text_end - 1] == '\r')) {
+            text_end -= 1;
+        }
+        if (last - next == 1 &&
+                (span->brk == UFOLD_BREAK_HARD ||
+                 span->brk == UFOLD_BREAK_NONE) &&
+                span->start == start && span->end == text_end &&
+                (max_width == 0 || span->width <= max_width)) {
+            if (!buf_reserve(realloc, (void**)&doc->fresh,
+                             &doc->fresh_capacity, count + 1,
+                             sizeof(ufold_span_t))) {
+                doc->stopped = true;
+                logged_return(false);
+            }
+            doc->fresh[count++] = *span;
+        } else {
+            ufold_iter_t iter;
+            ufold_span_t wrapped;
+
+            ufold_iter_init(&iter, &doc->config, doc->text + start,
+                            end - start);
+            iter.cells = doc->cells + start;
+
+            while (ufold_iter_next(&iter, &wrapped)) {
+                if (!buf_reserve(realloc, (void**)&doc->fresh,
+                                 &doc->fresh_capacity, count + 1,
+                                 sizeof(ufold_span_t))) {
+                    doc->stopped = true;
+                    logged_return(false);
+                }
+                wrapped.start += start;
+                wrapped.end += start;
+                doc->fresh[count++] = wrapped;
+            }
+        }
+        next = last;
+        start = end;
+    }
+
+    // swap the lists
+    ufold_span_t* spans = doc->spans;
+    size_t capacity = doc->span_capacity;
+
+    doc->spans = doc->fresh;
+    doc->span_capacity = doc->fresh_capacity;
+    doc->span_count = count;
+    doc->fresh = spans;
+    doc->fresh_capacity = capacity;
+    return true;
+}
+
+const void* ufold_doc_text(const ufold_doc_t* doc, size_t* size)
+{
+    *size = doc->size;
+    return doc->text;
+}
+
+size_t ufold_doc_count(const ufold_doc_t* doc)
+{
+    return doc->span_count;
+}
+
+bool ufold_doc_line(const ufold_doc_t* doc, size_t index, ufold_span_t* span)
+{
+    if (index >= doc->span_count) {
+        return false;
+    }
+    *span = doc->spans[index];
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Push bytes into the available slots and pull back a valid byte sequence.
+ /   A potentially well-formed UTF-8 byte sequence is not useful yet.
+ /
+ / RETURN
+ /   N :: N bytes in slots are ready for use
+ /   0 :: queuing, retry later
+\*/
+static size_t vm_slot(ufold_vm_t* vm, uint8_t byte)
+{
+    debug_assert(vm->slot_used < vm->slot_size);
+    debug_assert(vm->slot_cursor <= vm->slot_used);
+
+    uint8_t c = byte;
+
+    // NOTE: ASCII Normalization: CRLF, CR -> LF
+    if (c == '\r') {
+        vm->slot_crlf = true;
+        c = '\n';
+    } else {
+        bool crlf_combined = (c == '\n' && vm->slot_crlf);
+
+        vm->slot_crlf = false;
+
+        if (crlf_combined) {
+            return 0;
+        }
+    }
+    vm->slots[vm->slot_used++] = c;
+
+    while (vm->slot_cursor < vm->slot_used) {
+        if (vm->slots[vm->slot_cursor] == 0x1B && vm->config.ansi_escapes) {
+            uint8_t* p = vm->slots + vm->slot_cursor;
+            size_t remains = vm->slot_used - vm->slot_cursor;
+
+            // continue validation from the last byte of escape sequence
+            while (vm->slot_escape < remains && vm->slot_ansi != ANSI_END &&
+                    vm->slot_ansi != ANSI_FAIL) {
+                vm->slot_ansi = ansi_step(vm->slot_ansi,
+                                          p[vm->slot_escape++]);
+
+                if (vm->slot_escape >= ANSI_MAX) {
+                    vm->slot_ansi = (vm->slot_ansi == ANSI_END)
+                        ? ANSI_END : ANSI_FAIL;
+                }
+            }
+            if (vm->slot_ansi != ANSI_END && vm->slot_ansi != ANSI_FAIL) {
+                // found an incomplete sequence; need the rest bytes
+                break;
+            }
+            // skip ESC of an invalid sequence, which will be sanitized
+            vm->slot_cursor += (vm->slot_ansi == ANSI_END)
+                ? vm->slot_escape : 1;
+            vm->slot_escape = 0;
+            vm->slot_ansi = ANSI_NONE;
+            continue;
+        }
+
+        size_t k = utf8_valid_length(vm->slots[vm->slot_cursor]);
+
+        if (k <= 0) {
+            // skip an invalid starting byte
+            vm->slot_cursor += 1;
+            continue;
+        }
+        if (k > vm->slot_used - vm->slot_cursor) {
+            // found an incomplete sequence; need the rest bytes
+            break;
+        }
+
+        utf8proc_int32_t codepoint = -1;
+        utf8proc_ssize_t n_bytes = -1;
+
+        n_bytes = utf8proc_iterate(vm->slots + vm->slot_cursor, k, &codepoint);
+        debug_assert(n_bytes != 0);
+        debug_assert(n_bytes <= 4);
+
+        if (n_bytes < 0) {
+            // skip an invalid starting byte of an invalid sequence
+            vm->slot_cursor += 1;
+        } else {
+            debug_assert(k == n_bytes);
+            // NOTE: UTF-8 Normalization: U+2028, U+2029, U+0085 -> LF
+            if (codepoint == 0x2028 || codepoint == 0x2029 ||
+                    codepoint == 0x0085) {
+                uint8_t* p = vm->slots + vm->slot_cursor;
+                size_t remains = vm->slot_used - vm->slot_cursor;
+
+                memmove(p, p + n_bytes, remains - n_bytes);
+                *p = '\n';
+                vm->slot_used -= n_bytes - 1;
+                vm->slot_cursor += 1;
+            } else {
+                vm->slot_cursor += n_bytes;
+            }
+        }
+    }
+
+    return vm->slot_used == vm->slot_size ? vm->slot_cursor : 0;
+}
+
+/*\
+ / DESCRIPTION
+ /   Move the validated bytes in slots into the line.
+ /   Lines are coalesced in the slots until the next flush or until the slots
+ /   are full, instead of being fed one by one.
+\*/
+static bool vm_slot_flush(ufold_vm_t* vm)
+{
+    size_t n = vm->slot_cursor;
+
+    if (n > 0) {
+        size_t k = vm_sanitize(vm, vm->slots, n);
+
+        if (!vm_feed(vm, vm->slots, k)) {
+            logged_return(false);
+        }
+        vm_slot_shift(vm, n);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Shift the VM's buffer queuing slots by N places.
+\*/
+static void vm_slot_shift(ufold_vm_t* vm, size_t n)
+{
+    debug_assert(vm->slot_used >= n);
+    debug_assert(vm->slot_cursor >= n);
+
+    if (vm->slot_used <= n) {
+        vm->slot_used = 0;
+        vm->slot_cursor = 0;
+        vm->slot_escape = 0;
+        vm->slot_ansi = ANSI_NONE;
+    } else {
+        memmove(vm->slots, vm->slots + n, vm->slot_used - n);
+        vm->slot_used -= n;
+        vm->slot_cursor -= n;
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Shift the VM's line buffer by N places.
+\*/
+static void vm_line_shift(ufold_vm_t* vm, size_t n)
+{
+    debug_assert(vm->line_size >= n);
+
+    vm->fill_scan = (vm->fill_scan > n) ? vm->fill_scan - n : 0;
+
+    if (vm->line_size <= n) {
+        vm->line = vm->buf;
+        vm->line_size = 0;
+        vm->max_size = vm->buf_size - vm->slot_size - 1;
+        vm->cursor = 0;
+        vm_eow_reset(vm);
+    } else {
+        if (vm->max_size > n) {
+            vm->max_size -= n;
+        } else {
+            vm->max_size = 0;
+        }
+
+        vm->line += n;
+        vm->line_size -= n;
+
+        debug_assert(vm->cursor <= vm->line_size);
+        debug_assert(vm->eow <= vm->line_size);
+        debug_assert(vm->eow + vm->eow_ss <= vm->line_size);
+    }
+}
+
+static bool vm_line_update_capacity(ufold_vm_t* vm)
+{
+    // may be looking for the word boundary
+    if (vm->line_size > vm->max_size) {
+        size_t offset = vm->line - vm->buf;
+
+        if (vm->line_size > vm->buf_size - vm->slot_size - 1) {
+            // LINE AREA + OVERFLOW AREA
+            size_t buf_size = vm->buf_size + vm->slot_size + 1;
+            // check overflow
+            if (buf_size <= vm->slot_size) {
+                logged_return(false);
+            }
+            if (!vm_buf_resize(vm, buf_size)) {
+                logged_return(false);
+            }
+        }
+        memmove(vm->buf, vm->buf + offset, vm->line_size + 1);
+
+        if (vm->cells != NULL) {
+            memmove(vm->cells, vm->cells + offset, vm->line_size);
+        }
+        vm->line = vm->buf;
+        vm->max_size = vm->buf_size - vm->slot_size - 1;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Make room for a line of the given size without the overflow area.
+\*/
+static bool vm_line_reserve(ufold_vm_t* vm, size_t size)
+{
+    if (size > vm->buf_size - vm->slot_size - 1) {
+        size_t buf_size = size;
+
+        // check overflow
+        if (!add(&buf_size, vm->slot_size + 1)) {
+            logged_return(false);
+        }
+        size_t offset = vm->line - vm->buf;
+
+        if (!vm_buf_resize(vm, buf_size)) {
+            logged_return(false);
+        }
+        vm->line = vm->buf + offset;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Reallocate the line buffer along with its decoded properties.
+\*/
+static bool vm_buf_resize(ufold_vm_t* vm, size_t buf_size)
+{
+    if (vm->cells != NULL) {
+        uint8_t* cells = vm_realloc(vm, vm->cells, buf_size);
+
+        if (cells == NULL) {
+            logged_return(false);
+        }
+        vm->cells = cells;
+    }
+    uint8_t* buf = vm_realloc(vm, vm->buf, buf_size);
+
+    if (buf == NULL) {
+        logged_return(false);
+    }
+    vm->buf = buf;
+    vm->buf_size = buf_size;
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Create a VM for each extra width, and let all VMs with a line buffer keep
+ /   the decoded properties of its bytes.
+\*/
+static bool vm_follow(ufold_vm_t* vm)
+{
+    const ufold_profile_t* profile = vm->profile;
+    size_t size = sizeof(ufold_vm_t*) * profile->follower_count;
+
+    if ((vm->followers = vm_realloc(vm, NULL, size)) == NULL) {
+        logged_return(false);
+    }
+
+    for (size_t i = 0; i < profile->follower_count; ++i) {
+        ufold_vm_t* v = ufold_vm_new_from_profile(profile->followers[i], NULL);
+
+        if (v == NULL) {
+            logged_return(false);
+        }
+        vm->followers[vm->follower_count++] = v;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Compile a profile for each extra width, sharing compiled punctuation.
+\*/
+static bool profile_follow(ufold_profile_t* profile,
+                           const ufold_vm_config_t* config)
+{
+    // check overflow
+    if (config->extra_count > SIZE_MAX / sizeof(ufold_profile_t*)) {
+        logged_return(false);
+    }
+    size_t size = sizeof(ufold_profile_t*) * config->extra_count;
+
+    if ((profile->followers = config->realloc(NULL, size)) == NULL) {
+        logged_return(false);
+    }
+
+    for (size_t i = 0; i < config->extra_count; ++i) {
+        ufold_vm_config_t conf = *config;
+
+        conf.max_width = config->extra_widths[i];
+        conf.write = (config->extra_writes != NULL)
+            ? config->extra_writes[i] : NULL;
+        conf.punct = profile->config.punct;
+        conf.extra_widths = NULL;
+        conf.extra_writes = NULL;
+        conf.extra_count = 0;
+
+        ufold_profile_t* p = ufold_profile_new(&conf);
+
+        if (p == NULL) {
+            logged_return(false);
+        }
+        p->cell_size = p->buf_size;
+        profile->followers[profile->follower_count++] = p;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Decode bytes of whole characters into their properties.
+ /   Bytes must be sanitized unless the VM processes raw input.
+\*/
+static bool vm_cells(const ufold_vm_t* vm,
+                     const uint8_t* bytes, size_t size, uint8_t* cells)
+{
+    bool ascii_mode = vm->config.ascii_mode;
+    utf8proc_int32_t codepoint = -1;
+    utf8proc_ssize_t n_bytes = -1;
+
+    for (size_t i = 0; i < size; i += n_bytes) {
+        if ((n_bytes = vm_escape(vm, bytes + i, size - i)) > 0) {
+            // zero-width escape sequence
+            memset(cells + i, 0, n_bytes);
+            continue;
+        }
+        if (vm->line_raw) {
+            n_bytes = vm_decode_raw(vm, bytes + i, size - i, &codepoint);
+        } else if (ascii_mode) {
+            codepoint = bytes[i];
+            n_bytes = (codepoint <= 0x7F ? 1 : -1);
+        } else {
+            n_bytes = utf8proc_iterate(bytes + i, size - i, &codepoint);
+        }
+        if (!vm_cell(vm, codepoint, n_bytes, cells + i)) {
+            logged_return(false);
+        }
+        memset(cells + i + 1, 0, n_bytes - 1);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Decode the properties of a character.
+\*/
+static bool vm_cell(const ufold_vm_t* vm, utf8proc_int32_t codepoint,
+                    utf8proc_ssize_t n_bytes, uint8_t* cell)
+{
+    bool ascii_mode = vm->config.ascii_mode;
+
+    if (n_bytes <= 0 || n_bytes > 4) {
+        logged_return(false);
+    }
+    *cell = n_bytes - 1;
+
+    if (vm->config.hang_punctuation && vm_is_punctuation(vm, codepoint)) {
+        *cell |= CELL_PUNCT;
+    }
+
+    if (codepoint == '\t') {
+        *cell |= CELL_TAB;
+    } else {
+        int width = vm_charwidth(vm, codepoint);
+
+        if (width < 0 || width > 3) {
+            logged_return(false);
+        }
+        *cell |= width << 2;
+    }
+    if (is_linefeed(codepoint, ascii_mode)) {
+        *cell |= CELL_EOL;
+    } else if (is_whitespace(codepoint, ascii_mode)) {
+        *cell |= CELL_SPACE;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Fill the line with new bytes and produce output.
+ /   Bytes are decoded once and shared by the VMs of all widths.
+\*/
+static bool vm_feed(ufold_vm_t* vm, const uint8_t* bytes, size_t size)
+{
+    if (vm->follower_count <= 0) {
+        return vm_feed_line(vm, bytes, NULL, size);
+    }
+    debug_assert(size <= vm->slot_size);
+
+    uint8_t* cells = vm->slot_cells;
+
+    if (!vm_cells(vm, bytes, size, cells)) {
+        logged_return(false);
+    }
+    if (!vm_feed_line(vm, bytes, cells, size)) {
+        logged_return(false);
+    }
+    for (size_t i = 0; i < vm->follower_count; ++i) {
+        if (!vm_feed_line(vm->followers[i], bytes, cells, size)) {
+            logged_return(false);
+        }
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Fill the line of a single VM with new bytes and produce output.
+\*/
+static bool vm_feed_line(ufold_vm_t* vm, const uint8_t* bytes,
+                         const uint8_t* cells, size_t size)
+{
+#ifndef UFOLD_DEBUG
+    // inharmonious logic
+    if (vm->config.max_width == 0 && !vm->config.count_only &&
+            vm->config.max_lines == 0) {
+        // write sanitized input
+        if (size > 0 && !vm_put(vm, bytes, size)) {
+            logged_return(false);
+        }
+        return true;
+    }
+#endif
+    debug_assert(vm->line_size <= vm->max_size);
+    debug_assert(size <= vm->slot_size);
+    debug_assert(vm->line_size + size < vm->buf_size);
+
+    if (size > 0) {
+        memcpy(vm->line + vm->line_size, bytes, size);
+
+        if (vm->cells != NULL) {
+            debug_assert(cells != NULL);
+            memcpy(vm->cells + (vm->line - vm->buf) + vm->line_size,
+                   cells, size);
+        }
+        vm->line_size += size;
+
+        if (vm->line_size > vm->max_size && !vm_flush(vm)) {
+            logged_return(false);
+        }
+        if (!vm_line_update_capacity(vm)) {
+            logged_return(false);
+        }
+    }
+
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Fill the line with new bytes and produce output.
+\*/
+static bool vm_feed_ascii(ufold_vm_t* vm, const uint8_t* bytes, size_t size)
+{
+    debug_assert(vm->line_size <= vm->max_size);
+    debug_assert(vm->slot_used == 0);
+
+    // sanitized input is fed in chunks of slots
+    size_t k = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+        if (vm->state == VM_SKIP && k <= 0 &&
+                vm->line_size <= 0 && vm->follower_count <= 0) {
+            // skip the rest of a truncated line without decoding it
+            i += skip_line(bytes + i, size - i, true);
+
+            if (i >= size) {
+                break;
+            }
+        }
+        uint8_t c = bytes[i];
+
+        // NOTE: ASCII Normalization: CRLF, CR -> LF
+        if (c == '\r') {
+            vm->slot_crlf = true;
+            c = '\n';
+        } else {
+            bool crlf_combined = (c == '\n' && vm->slot_crlf);
+
+            vm->slot_crlf = false;
+
+            if (crlf_combined) {
+                continue;
+            }
+        }
+        vm->slots[k++] = ascii_sanitize(c);
+
+        if (k == SLOT_SIZE) {
+            if (!vm_feed(vm, vm->slots, k)) {
+                logged_return(false);
+            }
+            k = 0;
+        }
+    }
+    if (k > 0 && !vm_feed(vm, vm->slots, k)) {
+        logged_return(false);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Produce output from clean input without copying it into the line.
+ /   Only the unfinished line that precedes or follows the input is copied.
+\*/
+static bool vm_feed_clean(ufold_vm_t* vm, const uint8_t* bytes, size_t size)
+{
+    // NOTE: ASCII Normalization: CRLF -> LF
+    if (size > 0 && vm->slot_crlf) {
+        vm->slot_crlf = false;
+
+        if (bytes[0] == '\n') {
+            bytes += 1;
+            size -= 1;
+        }
+    }
+    if (size <= 0) {
+        return true;
+    }
+
+    if (vm->slot_used > 0) {
+        // the rest after validated bytes cannot be completed by clean input
+        vm->slot_cursor = vm->slot_used;
+
+        if (!vm_slot_flush(vm)) {
+            logged_return(false);
+        }
+    }
+
+    if (vm->line_size > 0) {
+        const uint8_t* eol = memchr(bytes, '\n', size);
+        size_t n = (eol != NULL) ? (size_t)(eol - bytes) + 1 : size;
+
+        for (size_t i = 0; i < n; i += SLOT_SIZE) {
+            if (!vm_feed(vm, bytes + i, min(n - i, SLOT_SIZE))) {
+                logged_return(false);
+            }
+        }
+        if (eol == NULL) {
+            return true;
+        }
+        if (!vm_flush(vm)) {
+            logged_return(false);
+        }
+        debug_assert(vm->line_size <= 0);
+
+        bytes += n;
+        size -= n;
+
+        if (size <= 0) {
+            return true;
+        }
+    }
+
+#ifndef UFOLD_DEBUG
+    // inharmonious logic
+    if (vm->config.max_width == 0 && !vm->config.count_only &&
+            vm->config.max_lines == 0) {
+        if (!vm_put(vm, bytes, size)) {
+            logged_return(false);
+        }
+        return true;
+    }
+#endif
+    debug_assert(vm->line_size <= 0);
+    debug_assert(vm->line == vm->buf);
+
+    vm->line = (uint8_t*)bytes;
+    vm->line_size = size;
+    vm->line_borrowed = true;
+
+    bool done = vm_flush(vm);
+
+    const uint8_t* rest = vm->line;
+    size_t rest_size = vm->line_size;
+
+    vm->line_borrowed = false;
+    vm->line = vm->buf;
+    vm->line_size = 0;
+    vm->max_size = vm->buf_size - vm->slot_size - 1;
+
+    if (!done) {
+        logged_return(false);
+    }
+    if (rest_size > 0) {
+        if (!vm_line_reserve(vm, rest_size)) {
+            logged_return(false);
+        }
+        memcpy(vm->line, rest, rest_size);
+        vm->line_size = rest_size;
+        vm->max_size = vm->buf_size - vm->slot_size - 1;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Produce output from trusted input as if it were clean.
+ /   A character cut off at either end of input is completed in the slots.
+\*/
+static bool vm_feed_trusted(ufold_vm_t* vm, const uint8_t* bytes, size_t size)
+{
+    size_t i = 0;
+
+    while (i < size && vm->slot_cursor < vm->slot_used) {
+        (void)vm_slot(vm, bytes[i++]);
+    }
+    if (!vm_slot_flush(vm)) {
+        logged_return(false);
+    }
+
+    size_t k = 0;
+
+    if (!vm->config.ascii_mode) {
+        // find the lead byte of the last character
+        while (k < min(size - i, 3) && (bytes[size - k - 1] & 0xC0) == 0x80) {
+            ++k;
+        }
+        if (k < size - i && utf8_valid_length(bytes[size - k - 1]) > k + 1) {
+            k += 1;
+        } else {
+            k = 0;
+        }
+    }
+    debug_assert(check_clean(bytes + i, size - i - k, vm->config.ascii_mode,
+                             vm->config.ansi_escapes &&
+                             !vm->config.ascii_mode));
+
+    if (!vm_feed_clean(vm, bytes + i, size - i - k)) {
+        logged_return(false);
+    }
+    for (size_t j = size - k; j < size; ++j) {
+        (void)vm_slot(vm, bytes[j]);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Produce output from UTF-8 input (or ASCII for ascii_mode).
+\*/
+static bool vm_feed_input(ufold_vm_t* vm, const uint8_t* bytes, size_t size)
+{
+    if (!vm->profile->feeder(vm, bytes, size)) {
+        logged_return(false);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Validate and sanitize UTF-8 input character by character.
+\*/
+static bool vm_feed_decoded(ufold_vm_t* vm, const uint8_t* bytes, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        if (vm->state == VM_SKIP && vm->slot_used <= 0 &&
+                vm->line_size <= 0 && vm->follower_count <= 0 &&
+                !vm->config.ansi_escapes) {
+            // skip the rest of a truncated line without decoding it
+            i += skip_line(bytes + i, size - i, false);
+
+            if (i >= size) {
+                break;
+            }
+        }
+        size_t n = vm_slot(vm, bytes[i]);
+        if (n > 0) {
+            size_t k = vm_sanitize(vm, vm->slots, n);
+
+            if (!vm_feed(vm, vm->slots, k)) {
+                logged_return(false);
+            }
+            vm_slot_shift(vm, n);
+        }
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Produce output from input of another encoding by transcoding it into
+ /   UTF-8 in chunks.
+\*/
+static bool vm_feed_encoded(ufold_vm_t* vm, const uint8_t* bytes, size_t size)
+{
+    uint8_t output[SLOT_SIZE * 4];
+
+    for (size_t i = 0; i < size && !ufold_vm_done(vm); ) {
+        size_t k = 0;
+        size_t n = vm_transcode(vm, bytes + i, size - i,
+                                output, sizeof(output), &k);
+
+        if (!vm_feed_input(vm, output, n)) {
+            logged_return(false);
+        }
+        i += k;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Transcode input into UTF-8 as far as the output can hold.
+ /   UTF-16 code units cut off at the end of input are kept for the next
+ /   input, and a byte order mark at the start of input is dropped.
+ /   Unpaired surrogates and bytes undefined in Windows-1252 become '?'.
+ /
+ / RETURN
+ /   size :: bytes of output
+\*/
+static size_t vm_transcode(ufold_vm_t* vm, const uint8_t* bytes, size_t size,
+                           uint8_t* output, size_t capacity, size_t* consumed)
+{
+    // Windows-1252 characters from 0x80 to 0x9F (0: undefined)
+    static const uint16_t cp1252[32] = {
+        0x20AC, 0, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+        0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017D, 0,
+        0, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+        0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0, 0x017E, 0x0178,
+    };
+    ufold_encoding_t encoding = vm->config.input_encoding;
+    size_t i = 0;
+    size_t n = 0;
+
+    // NOTE: a character takes no more than 4 bytes of output
+    while (i < size && n + 4 <= capacity) {
+        utf8proc_int32_t codepoint = -1;
+
+        if (encoding == UFOLD_ENCODING_LATIN1 ||
+                encoding == UFOLD_ENCODING_CP1252) {
+            // runs of ASCII are copied as they are
+            size_t k = min(size - i, capacity - n);
+            size_t m = 0;
+
+            while (m < k && bytes[i + m] <= 0x7F) {
+                ++m;
+            }
+            memcpy(output + n, bytes + i, m);
+            i += m;
+            n += m;
+
+            if (i >= size || n + 4 > capacity) {
+                break;
+            }
+            codepoint = bytes[i++];
+
+            if (encoding == UFOLD_ENCODING_CP1252 && codepoint <= 0x9F) {
+                codepoint = cp1252[codepoint - 0x80];
+                codepoint = (codepoint > 0) ? codepoint : '?';
+            }
+            n += utf8proc_encode_char(codepoint, output + n);
+            continue;
+        }
+
+        vm->units[vm->unit_used++] = bytes[i++];
+
+        if (vm->unit_used != 2 && vm->unit_used != 4) {
+            continue;
+        }
+        const uint8_t* u = vm->units + vm->unit_used - 2;
+        utf8proc_int32_t unit = vm->unit_le
+            ? (u[0] | (u[1] << 8)) : ((u[0] << 8) | u[1]);
+
+        if (!vm->unit_started) {
+            vm->unit_started = true;
+
+            if (unit == 0xFFFE && encoding == UFOLD_ENCODING_UTF16) {
+                vm->unit_le = true;
+                unit = 0xFEFF;
+            }
+            if (unit == 0xFEFF) {
+                vm->unit_used = 0;
+                continue;
+            }
+        }
+
+        if (vm->unit_used == 2) {
+            if (unit >= 0xD800 && unit <= 0xDBFF) {
+                continue;  // wait for the low surrogate
+            }
+            codepoint = (unit >= 0xDC00 && unit <= 0xDFFF) ? '?' : unit;
+        } else if (unit >= 0xDC00 && unit <= 0xDFFF) {
+            const uint8_t* h = vm->units;
+            utf8proc_int32_t high = vm->unit_le
+                ? (h[0] | (h[1] << 8)) : ((h[0] << 8) | h[1]);
+
+            codepoint = 0x10000 + ((high - 0xD800) << 10) + (unit - 0xDC00);
+        } else {
+            // the high surrogate is unpaired
+            output[n++] = '?';
+
+            if (unit >= 0xD800 && unit <= 0xDBFF) {
+                memmove(vm->units, vm->units + 2, 2);
+                vm->unit_used = 2;
+                continue;
+            }
+            codepoint = unit;
+        }
+        vm->unit_used = 0;
+        n += utf8proc_encode_char(codepoint, output + n);
+    }
+    *consumed = i;
+    return n;
+}
+
+/*\
+ / DESCRIPTION
+ /   Check if fed input is transcoded into UTF-8.
+\*/
+static bool vm_transcoding(const ufold_vm_t* vm)
+{
+    return vm->config.input_encoding != UFOLD_ENCODING_UTF8 &&
+        !vm->config.ascii_mode;
+}
+
+/*\
+ / DESCRIPTION
+ /   Check if line breaks are planned ahead for optimal fit.
+\*/
+static bool vm_filling(const ufold_vm_config_t* config)
+{
+    return config->optimal_fit && config->break_at_spaces &&
+        !config->unicode_breaks && !config->truncate;
+}
+
+/*\
+ / DESCRIPTION
+ /   Check if punctuation is to be compiled for settings given no set,
+ /   which is never the case without any to hang.
+\*/
+static bool vm_compiling(const ufold_vm_config_t* config)
+{
+    return config->hang_punctuation && config->punct == NULL &&
+        (config->punctuation == NULL || *config->punctuation != '\0');
+}
+
+/*\
+ / DESCRIPTION
+ /   Check if SGR sequences are kept to be restored after line breaks.
+\*/
+static bool vm_keeping_sgr(const ufold_vm_config_t* config)
+{
+    return config->ansi_escapes && !config->ascii_mode;
+}
+
+/*\
+ / DESCRIPTION
+ /   Flush buffered content.
+\*/
+static bool vm_flush(ufold_vm_t* vm)
+{
+    if (vm_filling(&vm->config) && vm->config.max_width > 0) {
+        return vm_fill(vm);
+    }
+    if (vm->cache != NULL) {
+        if (!vm_wrap_cached(vm)) {
+            logged_return(false);
+        }
+        if (vm->cache->waiting) {
+            return true;
+        }
+    }
+    return vm_wrap(vm, vm->line_size);
+}
+
+/*\
+ / DESCRIPTION
+ /   Wrap buffered content up to the given position from line start.
+\*/
+static bool vm_wrap(ufold_vm_t* vm, size_t end)
+{
+#ifndef UFOLD_DEBUG
+    // inharmonious logic
+    if (vm->config.max_width == 0 && !vm->line_raw &&
+            !vm->config.count_only && vm->config.max_lines == 0) {
+        return true;
+    }
+#endif
+    const uint8_t* sol = vm->line;
+    const uint8_t* bytes = vm->line + vm->cursor;
+    const uint8_t* word_end = vm->cursor_at_word ? vm->line + vm->cursor : NULL;
+    const uint8_t* cells = (vm->cells != NULL)
+        ? vm->cells + (vm->line - vm->buf) : NULL;
+    size_t cursor = vm->cursor;
+    size_t offset = vm->cursor_offset;
+    size_t tab_width = vm->config.tab_width;
+    const uint8_t* cluster_at = NULL;  // character checked for its cluster
+    bool clustered = false;  // whether the character continues a cluster
+    utf8proc_int32_t codepoint = -1;
+    utf8proc_ssize_t n_bytes = -1;
+
+    if (!vm->line_borrowed) {
+        debug_assert(vm->line_size < vm->buf_size);
+        vm->line[vm->line_size] = '\0';
+    }
+
+    debug_assert(end <= vm->line_size);
+
+    for (size_t i = cursor; i < end && !vm->yield && !vm_limited(vm);
+            i += n_bytes, bytes += n_bytes) {
+        debug_assert(bytes == vm->line + i);
+
+        if (vm->state == VM_SKIP && !vm->line_raw &&
+                !vm->config.ansi_escapes) {
+            // the rest of a truncated line is skipped without decoding
+            // unless escape sequences in it may change graphic rendition
+            const uint8_t* eol = memchr(bytes, '\n', end - i);
+
+            bytes = (eol != NULL) ? eol : vm->line + end;
+            sol = bytes;
+            i = bytes - vm->line;
+
+            if (eol == NULL) {
+                break;
+            }
+            offset = 0;
+            vm->state = VM_WORD;
+        }
+
+        // zero-width escape sequence as a whole
+        size_t escaped = vm_escape(vm, bytes, vm->line_size - i);
+
+        if (escaped > 0) {
+            codepoint = -1;
+            n_bytes = escaped;
+        } else if (cells != NULL) {
+            // decoded on demand
+            codepoint = -1;
+            n_bytes = (cells[i] & CELL_SIZE) + 1;
+        } else if (vm->line_raw) {
+            n_bytes = vm_decode_raw(vm, bytes, vm->line_size - i, &codepoint);
+        } else if (vm->config.ascii_mode) {
+            codepoint = *bytes;
+            n_bytes = (codepoint >= 0 && codepoint <= 0x7F ? 1 : -1);
+        } else {
+            n_bytes = utf8proc_iterate(bytes, vm->line_size - i, &codepoint);
+        }
+
+        if (n_bytes == 0) {
+            if (vm->line_size - i != 0) {
+                logged_return(false);
+            }
+            break;
+        }
+        if (n_bytes < 0 || (n_bytes > 4 && escaped <= 0)) {
+            logged_return(false);
+        }
+
+        int width = 0;
+
+        if (escaped > 0) {
+            width = 0;
+        } else if (cells != NULL ? (cells[i] & CELL_TAB)
+                                 : codepoint == '\t') {
+            // TODO: any place for recalculation?
+            width = calc_tab_width(tab_width, offset);
+        } else if (cells != NULL) {
+            width = (cells[i] & CELL_WIDTH) >> 2;
+        } else {
+            width = vm_charwidth(vm, codepoint);
+        }
+
+        if (escaped > 0) {
+            clustered = false;
+        } else if (vm->config.graphemes && !vm->config.ascii_mode) {
+            // checked once even if the character is processed again
+            if (bytes != cluster_at) {
+                cluster_at = bytes;
+
+                // printable ASCII joins nothing but a prepended character
+                if (*bytes >= 0x20 && *bytes < 0x7F &&
+                        (vm->grapheme & GRAPHEME_PROPERTY) != GB_PREPEND) {
+                    clustered = false;
+                    vm->grapheme = GB_OTHER;
+                } else {
+                    clustered = vm_grapheme(vm, bytes, vm->line_size - i,
+                                            codepoint, &vm->grapheme);
+                }
+            }
+            if (clustered) {
+                width = 0;  // a cluster is as wide as its first character
+            }
+        }
+
+        if (width > 0) {
+            // check overflow
+            if (offset + width < offset) {
+                logged_return(false);
+            }
+            offset += width;
+        } else if (width < 0) {
+            logged_return(false);
+        }
+
+        if (vm->config.max_width <= 0) {
+            debug_assert(vm->state != VM_WORD);
+            debug_assert(vm->state != VM_WRAP);
+            debug_assert(vm->indent_size == 0);
+
+            vm->state = VM_FULL;
+        }
+
+        bool eol_found = false;
+        bool ws_found = false;
+
+        if (escaped > 0) {
+            eol_found = false;
+            ws_found = false;
+        } else if (cells != NULL) {
+            eol_found = cells[i] & CELL_EOL;
+            ws_found = cells[i] & CELL_SPACE;
+        } else {
+            eol_found = is_linefeed(codepoint, vm->config.ascii_mode);
+            ws_found = !eol_found && is_whitespace(codepoint,
+                                                   vm->config.ascii_mode);
+        }
+
+        debug_assert(!eol_found || width == 0);
+        debug_assert(!eol_found || !clustered);
+
+        if (clustered) {
+            ws_found = vm->grapheme & GRAPHEME_SPACE;
+        }
+
+        if (vm->state == VM_SKIP) {
+            // raw input is decoded to find the line end it is normalized to
+            if (!eol_found) {
+                if (escaped > 0) {
+                    vm_sgr_update(vm, bytes, n_bytes);
+                }
+                sol = bytes + n_bytes;
+                continue;
+            }
+            if (!vm_limited(vm) && !vm_put_sgr(vm)) {
+                logged_return(false);
+            }
+            offset = 0;
+            vm->state = VM_WORD;
+        }
+        if (vm->config.truncate && !clustered && (sol == bytes ||
+                offset - width + vm->ellipsis_width <= vm->config.max_width)) {
+            // the longest text to keep along with the ellipsis
+            vm->cut = bytes - sol;
+            vm->cut_width = offset - width;
+        }
+
+        int break_class = -1;
+
+        if (vm->config.unicode_breaks && vm->config.break_at_spaces &&
+                vm->state != VM_FULL && !eol_found && !clustered &&
+                escaped <= 0) {
+            break_class = vm_break_class(vm, bytes, n_bytes, codepoint);
+
+            if (break_class == LB_GL) {
+                ws_found = false;  // no break at no-break space
+            }
+        }
+        if (ws_found && vm->config.graphemes) {
+            vm->grapheme |= GRAPHEME_SPACE;
+        }
+
+        if (vm->state != VM_FULL) {
+            if (!eol_found && !ws_found) {
+                if (break_class >= 0) {
+                    bool joined = (word_end == bytes);
+
+                    if (joined && bytes > sol &&
+                            offset - width > vm->indent_width &&
+                            (lb_pairs[vm->break_class] >> break_class & 1)) {
+                        // break opportunity inside a word
+                        vm->eow = bytes - vm->line;
+                        vm->eow_ss = 0;
+                        vm->eow_ww = 0;
+                        vm->eow_width = offset - width;
+                        joined = false;
+                    }
+                    if (break_class != LB_CM) {
+                        vm->break_class = break_class;
+                    } else if (!joined) {
+                        vm->break_class = LB_AL;  // mark without base
+                    }
+                }
+                if (escaped > 0 && word_end != bytes) {
+                    vm->break_class = LB_GL;  // no break right after it
+                }
+                if (vm->eow > 0) {
+                    vm->eow_ww += width;
+                }
+                word_end = bytes + n_bytes;
+            } else {
+                if (word_end != NULL) {
+                    // no break at zero-width text right after newline
+                    if (offset > 0) {
+                        vm->eow = word_end - vm->line;
+                        vm->eow_ss = 0;
+                        vm->eow_ww = 0;
+                        vm->eow_width = offset - width;
+                    }
+                    word_end = NULL;
+                }
+                if (vm->eow > 0) {
+                    vm->eow_ss += n_bytes;
+                }
+            }
+        }
+
+        if (vm->state == VM_WRAP)
+        {
+            if (clustered && !ws_found && sol == bytes) {
+                // the rest of a cluster too wide stays on its line
+                if (!vm_put_text(vm, bytes, n_bytes, vm->output_width)) {
+                    logged_return(false);
+                }
+                sol = bytes + n_bytes;
+                word_end = NULL;
+                continue;
+            }
+            if (vm->config.break_at_spaces) {
+                if (ws_found && sol == bytes) {
+                    // skip whitespace after breakpoint
+                    sol = bytes + n_bytes;
+                    offset = vm->indent_width;
+                    continue;
+                }
+                if (eol_found && sol < bytes) {
+                    debug_assert(offset <= vm->config.max_width);
+
+                    if (!vm_put_break(vm)) {
+                        logged_return(false);
+                    }
+                    if (vm->config.keep_indentation) {
+                        if (!vm_indent(vm)) {
+                            logged_return(false);
+                        }
+                        vm_indent_reset(vm);
+                    }
+                    if (!vm_put_line(vm, sol, bytes - sol, n_bytes, offset)) {
+                        logged_return(false);
+                    }
+                    sol = bytes + n_bytes;
+                    offset = 0;
+                    vm_eow_reset(vm);
+                    vm->state = VM_LINE;
+                    continue;
+                }
+            }
+            if (eol_found) {
+                debug_assert(sol == bytes);
+
+                // hard break after a character right before line end
+                if (!vm_put_line(vm, sol, bytes - sol, n_bytes, offset)) {
+                    logged_return(false);
+                }
+                if (vm->config.keep_indentation) {
+                    vm_indent_reset(vm);
+                }
+                sol = bytes + n_bytes;
+                offset = 0;
+                vm_eow_reset(vm);
+                vm->state = VM_LINE;
+                continue;
+            }
+            if (!vm_put_break(vm)) {
+                logged_return(false);
+            }
+            if (vm->config.keep_indentation) {
+                if (!vm_indent(vm)) {
+                    logged_return(false);
+                }
+            }
+            vm->state = VM_WORD;
+        }
+        else if (vm->state == VM_LINE)
+        {
+            if (vm->config.keep_indentation && !vm->config.truncate) {
+                if (!vm->indent_hanging && ws_found) {
+                    if (!vm_indent_feed(vm, bytes, n_bytes, width)) {
+                        logged_return(false);
+                    }
+                    continue;
+                } else if (vm->config.hang_punctuation) {
+                    bool valid = (escaped > 0) ? false
+                        : (cells != NULL) ? (cells[i] & CELL_PUNCT)
+                        : vm_is_punctuation(vm, codepoint);
+
+                    if (valid) {
+                        // assert cancelled for Markdown? e.g. "*   list item"
+                        //debug_assert(!ws_found);
+
+                        vm->indent_hanging = true;
+
+                        for (size_t k = 0; k < width; ++k) {
+                            if (!vm_indent_feed(vm, " ", 1, 1)) {
+                                logged_return(false);
+                            }
+                        }
+                        word_end = NULL;
+                        continue;
+                    }
+                }
+                vm->state = VM_WORD;
+
+                if (vm->indent_width >= vm->config.max_width) {
+                    debug_assert(vm->state != VM_FULL);
+
+                    vm->state = VM_FULL;
+                    vm_indent_reset(vm);
+                }
+            } else {
+                vm->state = VM_WORD;
+            }
+        }
+
+        debug_assert(vm->state != VM_LINE);
+        debug_assert(vm->state != VM_WRAP);
+        debug_assert(sol <= bytes);
+
+        if (vm->state == VM_FULL)
+        {
+            debug_assert(vm->indent_size == 0);
+
+            if (eol_found) {
+                if (!vm_put_line(vm, sol, bytes - sol, n_bytes, offset)) {
+                    logged_return(false);
+                }
+                sol = bytes + n_bytes;
+                word_end = NULL;
+                offset = 0;
+                vm_eow_reset(vm);
+                vm->state = VM_LINE;
+                continue;
+            }
+        }
+        else if (vm->config.truncate && offset > vm->config.max_width)
+        {
+            if (!vm_put_text(vm, sol, vm->cut, vm->cut_width) ||
+                    !vm_put_ellipsis(vm)) {
+                logged_return(false);
+            }
+            if (vm->iter != NULL && vm->cut <= 0 && !vm_limited(vm) &&
+                    (!vm->iter->span_open ||
+                     vm->iter->span.start == vm->iter->span.end)) {
+                // nothing fits before the ellipsis but the line is still cut
+                vm_span_open(vm);
+                vm->iter->span.start = vm_iter_offset(vm, sol);
+                vm->iter->span.end = vm->iter->span.start;
+                vm->iter->span_cut = true;
+            }
+            // rendition is still kept for the text after the skipped one
+            vm_sgr_update(vm, sol + vm->cut, bytes + n_bytes - sol - vm->cut);
+            sol = bytes + n_bytes;
+            word_end = NULL;
+            offset = 0;
+            vm->cut = 0;
+            vm->cut_width = 0;
+            vm->state = VM_SKIP;
+            continue;
+        }
+        // never break inside a grapheme cluster
+        else if (!clustered &&
+                 (offset > vm->config.max_width ||
+                  (vm->fill_next < vm->fill_count && !ws_found &&
+                   !eol_found && vm_fill_due(vm, sol - vm->line))))
+        {
+            // TODO: do not break before the long word; truncate it
+            //     |    oh a_long_word_that_fits_|not_the_next_line
+            //     |      ^                      |
+            //     |oh a_long_word_that_fits_not_|the_next_line
+            //     |  ^                          |
+            //     :                             :
+            //     |    oh a_long_word_that_fits_|
+            //     |    not_the_next_line        |
+            //     |oh a_long_word_that_fits_not_|
+            //     |the_next_line                |
+            if (vm->config.break_at_spaces && vm->eow > 0) {
+                debug_assert(vm->eow > sol - vm->line);
+
+                if (!vm_put_text(vm, sol, vm->eow - (sol - vm->line),
+                                 vm->eow_width)) {
+                    logged_return(false);
+                }
+                sol = vm->line + vm->eow + vm->eow_ss;
+                offset = vm->indent_width + vm->eow_ww;
+                debug_assert(sol <= bytes + n_bytes);
+
+                // because of zero-width whitespace like --tab=0
+                if (offset > vm->config.max_width) {
+                    debug_assert(vm->eow_ww > 0);
+                    debug_assert(width > 0);
+                    debug_assert(!ws_found && !eol_found);
+
+                    n_bytes = 0;
+                    offset -= width;
+                    vm_eow_reset(vm);
+                    vm->state = VM_WRAP;
+                    continue;
+                }
+
+                if (!eol_found) {
+                    vm_eow_reset(vm);  // next, skip whitespace
+                    vm->state = VM_WRAP;
+                } else {
+                    debug_assert(vm->indent_width + vm->eow_ww
+                                 <= vm->config.max_width);
+
+                    if (!vm_put_break(vm)) {
+                        logged_return(false);
+                    }
+                    if (vm->config.keep_indentation) {
+                        if (!vm_indent(vm)) {
+                            logged_return(false);
                         }
                         vm_indent_reset(vm);
                     }
-                    if (!vm->config.write(sol, bytes - sol + n_bytes)) {
+                    if (!vm_put_line(vm, sol, bytes - sol, n_bytes, offset)) {
                         logged_return(false);
                     }
                     sol = bytes + n_bytes;
@@ -838,82 +3222,1635 @@ static bool vm_flush(ufold_vm_t* vm)
                 }
                 continue;
             } else {
-                size_t advance = 0;
-                bool t = ws_found && vm->config.break_at_spaces && sol != bytes;
+                size_t advance = 0;
+                bool t = ws_found && vm->config.break_at_spaces && sol != bytes;
+
+                if (!eol_found && !t) {
+                    // avoid infinite loop
+                    if (sol == bytes ||
+                            // character too wide
+                            offset - width == vm->indent_width) {
+                        advance = n_bytes;
+                        word_end = NULL;
+                    }
+                    if (!ws_found) {
+                        // TODO: continue to collect all zero-width characters
+                    }
+                }
+
+                // TODO: anyway damn ligature
+                if (!vm_put_text(vm, sol, bytes - sol + advance,
+                                 advance > 0 ? offset : offset - width)) {
+                    logged_return(false);
+                }
+                if (vm->iter != NULL && vm->config.break_at_spaces &&
+                        !eol_found && !t) {
+                    // no word end to break at on the line
+                    vm_span_open(vm);
+                    vm->iter->span.brk = UFOLD_BREAK_FORCED;
+                }
+                // no need to recalculate tab width here if n_bytes=0
+                n_bytes = advance;
+                sol = bytes + advance;
+                offset = vm->indent_width;
+                vm_eow_reset(vm);  // next, skip whitespace
+                vm->state = VM_WRAP;
+                continue;
+            }
+        }
+        else if (eol_found)
+        {
+            debug_assert(offset <= vm->config.max_width);
+
+            if (!vm_put_line(vm, sol, bytes - sol, n_bytes, offset)) {
+                logged_return(false);
+            }
+            if (vm->config.keep_indentation) {
+                vm_indent_reset(vm);
+            }
+            sol = bytes + n_bytes;
+            offset = 0;
+            vm_eow_reset(vm);
+            vm->state = VM_LINE;
+            continue;
+        }
+        else debug_assert(offset <= vm->config.max_width);
+    }
+
+    if (vm_limited(vm)) {
+        // the rest is never output
+        vm->cursor = 0;
+        vm->cursor_offset = 0;
+        vm_line_shift(vm, vm->line_size);
+    } else if (vm->state == VM_FULL || vm->stopped) {
+        if (vm->state == VM_WRAP && bytes > sol) {
+            if (!vm_put_break(vm)) {
+                logged_return(false);
+            }
+            if (vm->config.keep_indentation && !vm_indent(vm)) {
+                logged_return(false);
+            }
+        }
+        if (!vm_put_text(vm, sol, bytes - sol, offset)) {
+            logged_return(false);
+        }
+        if (vm->stopped && !vm_put_end(vm)) {
+            logged_return(false);
+        }
+        vm->cursor = 0;
+        vm->cursor_offset = offset;
+        vm_line_shift(vm, bytes - vm->line);
+        vm_eow_reset(vm);
+    } else {
+        if (vm->eow > sol - vm->line) {
+            vm->eow -= sol - vm->line;
+        } else {
+            vm_eow_reset(vm);
+        }
+        vm->cursor = bytes - sol;
+        vm->cursor_offset = offset;
+        vm->cursor_at_word = word_end != NULL;
+        vm_line_shift(vm, sol - vm->line);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Wrap complete lines at the start of buffered content, each of which is
+ /   output from the cache if found there, or cached after being wrapped.
+ /   A line is kept whole until its end is found, even across flushes,
+ /   unless it is too long to cache.
+\*/
+static bool vm_wrap_cached(ufold_vm_t* vm)
+{
+    vm_cache_t* cache = vm->cache;
+
+    cache->waiting = false;
+
+    while (!vm_limited(vm)) {
+        // the rest of a line partly wrapped is never cached
+        bool partial = vm->state != VM_LINE || vm->cursor > 0 ||
+            vm->cursor_offset > 0 || vm->output_pending ||
+            vm->indent_size > 0 || vm->indent_width > 0 ||
+            vm->indent_hanging;
+
+        if (partial || cache->hashed > vm->line_size) {
+            cache->hashed = 0;
+        }
+        if (cache->hashed == 0) {
+            cache->hash = hash_start(vm->grapheme);
+        }
+        const uint8_t* eol = memchr(vm->line + cache->hashed, '\n',
+                                    vm->line_size - cache->hashed);
+
+        if (eol == NULL) {
+            if (!partial && !vm->stopped && !vm->line_borrowed &&
+                    vm->line_size < CACHE_LINE_MAX) {
+                return vm_cache_wait(vm);
+            }
+            cache->hashed = 0;
+            break;
+        }
+        size_t size = eol - vm->line + 1;
+
+        if (partial) {
+            if (!vm_wrap(vm, size)) {
+                logged_return(false);
+            }
+            continue;
+        }
+        uint64_t hash = hash_end(hash_step(cache->hash,
+                                           vm->line + cache->hashed,
+                                           size - cache->hashed), size);
+        cache->hashed = 0;
+
+        vm_cached_t* entry = vm_cache_find(vm, hash, vm->line, size);
+
+        if (entry != NULL && (vm->config.max_lines == 0 ||
+                              vm->config.max_lines - vm->metrics.lines
+                              >= entry->metrics.lines)) {
+            if (!vm->config.count_only &&
+                    !vm_write(vm, entry->bytes + size, entry->output_size)) {
+                logged_return(false);
+            }
+            if (!add(&vm->metrics.lines, entry->metrics.lines)) {
+                logged_return(false);
+            }
+            if (VM_METERED(vm)) {
+                if (!add(&vm->metrics.bytes, entry->metrics.bytes)) {
+                    logged_return(false);
+                }
+                vm->metrics.max_width = max(vm->metrics.max_width,
+                                            entry->metrics.max_width);
+            }
+            vm->grapheme = entry->grapheme_end;
+            vm->break_class = entry->break_class_end;
+            vm_line_shift(vm, size);
+            cache->stats.hits += 1;
+            continue;
+        }
+
+        // the line stays in the buffer after being wrapped
+        const uint8_t* line = vm->line;
+        ufold_metrics_t metrics = vm->metrics;
+        uint8_t grapheme = vm->grapheme;
+
+        vm->metrics.max_width = 0;  // of the line alone
+        cache->recording = !vm->config.count_only;
+        cache->record_size = 0;
+
+        bool done = vm_wrap(vm, size);
+
+        cache->recording = false;
+        cache->stats.misses += 1;
+
+        if (!done) {
+            logged_return(false);
+        }
+        size_t max_width = vm->metrics.max_width;
+
+        vm->metrics.max_width = max(metrics.max_width, max_width);
+        metrics.lines = vm->metrics.lines - metrics.lines;
+        metrics.bytes = vm->metrics.bytes - metrics.bytes;
+        metrics.max_width = max_width;
+
+        if (vm_limited(vm) || vm->state != VM_LINE) {
+            break;  // the output of the line is incomplete
+        }
+        if (!vm_cache_add(vm, hash, line, size, &metrics, grapheme)) {
+            logged_return(false);
+        }
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Keep the line at the start of buffered content whole until its end is
+ /   found, and hash the bytes of it seen so far.
+\*/
+static bool vm_cache_wait(ufold_vm_t* vm)
+{
+    vm_cache_t* cache = vm->cache;
+    size_t n = vm->line_size & ~(size_t)7;
+
+    cache->hash = hash_step(cache->hash, vm->line + cache->hashed,
+                            n - cache->hashed);
+    cache->hashed = n;
+    cache->waiting = true;
+
+    if (vm->line_size <= vm->max_size) {
+        return true;
+    }
+    if (vm->line != vm->buf) {
+        memmove(vm->buf, vm->line, vm->line_size + 1);
+
+        if (vm->cells != NULL) {
+            memmove(vm->cells, vm->cells + (vm->line - vm->buf),
+                    vm->line_size);
+        }
+        vm->line = vm->buf;
+    }
+    // the buffer grows by doubling rather than by slots
+    if (!vm_line_reserve(vm, min(vm->line_size * 2, CACHE_LINE_MAX))) {
+        logged_return(false);
+    }
+    vm->max_size = vm->buf_size - vm->slot_size - 1;
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Create the cache of wrapped lines.
+\*/
+static bool vm_cache_new(ufold_vm_t* vm)
+{
+    size_t capacity = vm->config.cache_lines;
+    size_t buckets = 1;
+
+    // at least twice as many buckets as entries
+    while (buckets / 2 < capacity) {
+        if (!mul(&buckets, 2)) {
+            logged_return(false);
+        }
+    }
+    if (capacity > SIZE_MAX / sizeof(vm_cached_t) ||
+            capacity > SIZE_MAX / CACHE_ENTRY_SIZE ||
+            buckets > SIZE_MAX / sizeof(size_t)) {
+        logged_return(false);
+    }
+    vm_cache_t* cache = vm_realloc(vm, NULL, sizeof(vm_cache_t));
+
+    if (cache == NULL) {
+        logged_return(false);
+    }
+    memset(cache, 0, sizeof(vm_cache_t));
+    vm->cache = cache;
+
+    cache->entries = vm_realloc(vm, NULL, sizeof(vm_cached_t) * capacity);
+    cache->buckets = vm_realloc(vm, NULL, sizeof(size_t) * buckets);
+    cache->storage = vm_realloc(vm, NULL, CACHE_ENTRY_SIZE * capacity);
+
+    if (cache->entries == NULL || cache->buckets == NULL ||
+            cache->storage == NULL) {
+        logged_return(false);
+    }
+    for (size_t i = 0; i < buckets; ++i) {
+        cache->buckets[i] = SIZE_MAX;
+    }
+    cache->capacity = capacity;
+    cache->bucket_mask = buckets - 1;
+    cache->oldest = SIZE_MAX;
+    cache->newest = SIZE_MAX;
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Free the cache of wrapped lines.
+\*/
+static void vm_cache_free(ufold_vm_t* vm)
+{
+    vm_cache_t* cache = vm->cache;
+
+    if (cache != NULL) {
+        for (size_t i = 0; i < cache->count; ++i) {
+            if (cache->entries[i].room > 0) {
+                vm_free(vm, cache->entries[i].bytes);
+            }
+        }
+        vm_free(vm, cache->entries);
+        vm_free(vm, cache->buckets);
+        vm_free(vm, cache->storage);
+        vm_free(vm, cache->record);
+        vm_free(vm, cache);
+        vm->cache = NULL;
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Find an input line in the cache and mark it as the most recently used.
+ /   The state of grapheme cluster before the line must also match.
+ /
+ / RETURN
+ /   BEAF :: cached line
+ /   NULL :: not found
+\*/
+static vm_cached_t* vm_cache_find(ufold_vm_t* vm, uint64_t hash,
+                                  const uint8_t* bytes, size_t size)
+{
+    vm_cache_t* cache = vm->cache;
+    size_t i = cache->buckets[hash & cache->bucket_mask];
+
+    for (; i != SIZE_MAX; i = cache->entries[i].chain) {
+        vm_cached_t* entry = cache->entries + i;
+
+        if (entry->hash == hash && entry->size == size &&
+                entry->grapheme == vm->grapheme &&
+                memcmp(entry->bytes, bytes, size) == 0) {
+            vm_cache_touch(cache, i);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*\
+ / DESCRIPTION
+ /   Add an input line along with the output recorded while wrapping it,
+ /   in place of the least recently used line if the cache is full.
+\*/
+static bool vm_cache_add(ufold_vm_t* vm, uint64_t hash,
+                         const uint8_t* bytes, size_t size,
+                         const ufold_metrics_t* metrics, uint8_t grapheme)
+{
+    vm_cache_t* cache = vm->cache;
+    size_t output_size = cache->record_size;
+    size_t i = cache->count;
+
+    size_t total = size;
+
+    // check overflow
+    if (!add(&total, output_size)) {
+        logged_return(false);
+    }
+    if (i >= cache->capacity) {
+        i = cache->oldest;
+        vm_cache_unlink(cache, i);
+    } else {
+        cache->entries[i].room = 0;
+        cache->count += 1;
+    }
+    vm_cached_t* entry = cache->entries + i;
+    size_t* bucket = cache->buckets + (hash & cache->bucket_mask);
+
+    // the room allocated for a long line is kept for the next one
+    if (total > CACHE_ENTRY_SIZE && total > entry->room) {
+        uint8_t* p = vm_realloc(vm, (entry->room > 0) ? entry->bytes : NULL,
+                                total);
+
+        if (p == NULL) {
+            logged_return(false);
+        }
+        entry->bytes = p;
+        entry->room = total;
+    } else if (entry->room <= 0) {
+        entry->bytes = cache->storage + CACHE_ENTRY_SIZE * i;
+    }
+    memcpy(entry->bytes, bytes, size);
+
+    if (output_size > 0) {
+        memcpy(entry->bytes + size, cache->record, output_size);
+    }
+    entry->hash = hash;
+    entry->size = size;
+    entry->output_size = output_size;
+    entry->metrics = *metrics;
+    entry->grapheme = grapheme;
+    entry->grapheme_end = vm->grapheme;
+    entry->break_class_end = vm->break_class;
+    entry->chain = *bucket;
+    entry->older = SIZE_MAX;
+    entry->newer = SIZE_MAX;
+    *bucket = i;
+
+    vm_cache_touch(cache, i);
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Remove an entry from its bucket and from the order of use.
+\*/
+static void vm_cache_unlink(vm_cache_t* cache, size_t i)
+{
+    vm_cached_t* entry = cache->entries + i;
+    size_t* p = cache->buckets + (entry->hash & cache->bucket_mask);
+
+    while (*p != i) {
+        p = &cache->entries[*p].chain;
+    }
+    *p = entry->chain;
+
+    if (entry->older != SIZE_MAX) {
+        cache->entries[entry->older].newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+    if (entry->newer != SIZE_MAX) {
+        cache->entries[entry->newer].older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Mark an entry as the most recently used one.
+\*/
+static void vm_cache_touch(vm_cache_t* cache, size_t i)
+{
+    vm_cached_t* entry = cache->entries + i;
+
+    if (cache->newest == i) {
+        return;
+    }
+    // detach from the order of use unless just added
+    if (entry->older != SIZE_MAX) {
+        cache->entries[entry->older].newer = entry->newer;
+    } else if (cache->oldest == i) {
+        cache->oldest = entry->newer;
+    }
+    if (entry->newer != SIZE_MAX) {
+        cache->entries[entry->newer].older = entry->older;
+    }
+    entry->older = cache->newest;
+    entry->newer = SIZE_MAX;
+
+    if (cache->newest != SIZE_MAX) {
+        cache->entries[cache->newest].newer = i;
+    }
+    cache->newest = i;
+
+    if (cache->oldest == SIZE_MAX) {
+        cache->oldest = i;
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Flush buffered content with line breaks planned for optimal fit.
+ /   Complete paragraphs are planned as a whole, and a paragraph longer than
+ /   the lookahead is planned window by window.
+\*/
+static bool vm_fill(ufold_vm_t* vm)
+{
+    size_t factor = vm->config.ascii_mode ? 1 : 4;
+    size_t window = FILL_LINES * factor * vm->config.max_width;
+
+    while (true) {
+        size_t start = vm->cursor;
+        size_t limit = (vm->line_size - start > window)
+            ? start + window : vm->line_size;
+        size_t end = start;  // after the last line feed in window
+        size_t i = max(start, vm->fill_scan);
+
+        while (i < limit) {
+            uint8_t cell = 0;
+            size_t n_bytes = vm_fill_char(vm, i, &cell);
+
+            if (n_bytes <= 0) {
+                logged_return(false);
+            }
+            i += n_bytes;
+
+            if (cell & CELL_EOL) {
+                end = i;
+            }
+        }
+        if (end <= start) {
+            if (vm->line_size - start < window && !vm->stopped) {
+                // wait for the paragraph to end or to fill the window
+                vm->fill_scan = i;
+                return true;
+            }
+            end = i;
+        }
+        vm->fill_scan = 0;
+
+        if (!vm_fill_plan(vm, start, end)) {
+            logged_return(false);
+        }
+
+        // only the last window ends the output
+        bool stopped = vm->stopped;
+        bool last = stopped && end >= vm->line_size;
+
+        vm->stopped = last;
+
+        bool done = vm_wrap(vm, end);
+
+        vm->stopped = stopped;
+        vm->fill_count = 0;
+        vm->fill_next = 0;
+
+        if (!done) {
+            logged_return(false);
+        }
+        if (last || vm->line_size <= 0) {
+            return true;
+        }
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Plan line breaks for the paragraphs between the positions from line
+ /   start, where the first paragraph continues from the state of VM.
+ /   Tabs are measured at their maximum width, so the planned lines never
+ /   exceed the width even if the wrapped lines differ a little.
+\*/
+static bool vm_fill_plan(ufold_vm_t* vm, size_t start, size_t end)
+{
+    size_t tab_width = vm->config.tab_width;
+    size_t max_width = vm->config.max_width;
+    bool at_line = (vm->state == VM_LINE);
+    bool at_word = vm->cursor_at_word;
+    bool full = (vm->state == VM_FULL);
+    bool hanging = vm->indent_hanging;
+    size_t indent = vm->indent_width;
+    size_t prefix = vm->cursor_offset;  // (width) before the first word
+    size_t eow = (vm->eow > 0 && !at_word) ? vm->eow : 0;
+    size_t eow_width = vm->eow_width;
+    size_t count = 0;
+    size_t gap = 0;
+    uint8_t grapheme = vm->grapheme;
+
+    vm->fill_count = 0;
+    vm->fill_next = 0;
+
+    for (size_t i = start; i < end; ) {
+        uint8_t cell = 0;
+        size_t n_bytes = vm_fill_char(vm, i, &cell);
+        size_t width = (cell & CELL_TAB) ? tab_width
+                                         : (size_t)(cell & CELL_WIDTH) >> 2;
+        bool space = cell & CELL_SPACE;
+
+        if (n_bytes <= 0) {
+            logged_return(false);
+        }
+        if (vm->config.graphemes && !vm->config.ascii_mode &&
+                !(vm->line[i] == 0x1B && cell == 0)) {
+            if (vm->line[i] >= 0x20 && vm->line[i] < 0x7F &&
+                    (grapheme & GRAPHEME_PROPERTY) != GB_PREPEND) {
+                grapheme = GB_OTHER;
+            } else if (vm_grapheme(vm, vm->line + i, vm->line_size - i,
+                                   -1, &grapheme)) {
+                // the same as the first character of the cluster
+                width = 0;
+                space = grapheme & GRAPHEME_SPACE;
+            }
+            if (space) {
+                grapheme |= GRAPHEME_SPACE;
+            }
+        }
+        i += n_bytes;
+
+        if (cell & CELL_EOL) {
+            if (!full && !vm_fill_solve(vm, count, prefix, indent,
+                                        eow, eow_width)) {
+                logged_return(false);
+            }
+            at_line = true;
+            at_word = false;
+            full = false;
+            hanging = false;
+            indent = 0;
+            prefix = 0;
+            eow = 0;
+            count = 0;
+            gap = 0;
+            continue;
+        }
+        if (full) {
+            continue;
+        }
+        if (at_line) {
+            if (vm->config.keep_indentation) {
+                if ((!hanging && space) || (cell & CELL_PUNCT)) {
+                    hanging = hanging || !space;
+                    indent += width;
+                    prefix += width;
+                    continue;
+                }
+                full = (indent >= max_width);
+            }
+            at_line = false;
+
+            if (full) {
+                continue;
+            }
+        }
+        if (space) {
+            at_word = false;
+            gap += width;
+            continue;
+        }
+        if (at_word) {
+            if (count > 0) {
+                vm->words[count - 1].end = i;
+                vm->words[count - 1].width += width;
+            } else {
+                prefix += width;
+            }
+            continue;
+        }
+        if (!buf_reserve(vm->config.realloc, (void**)&vm->words,
+                         &vm->word_capacity, count + 1, sizeof(vm_word_t))) {
+            logged_return(false);
+        }
+        vm->words[count].end = i;
+        vm->words[count].width = width;
+        vm->words[count].gap = gap;
+        count += 1;
+        gap = 0;
+        at_word = true;
+    }
+    // the rest of paragraph will continue the last line
+    if (!full && !vm_fill_solve(vm, count, prefix, indent, eow, eow_width)) {
+        logged_return(false);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Choose line breaks between words that minimize the sum of squares of
+ /   columns left on each line but the last, and append them to the plan.
+ /   A line holds a bounded number of words, so the time is linear.
+ /
+ / PARAMETERS
+ /       count --> number of words
+ /      prefix --> (width) text of the first line before the first word
+ /      indent --> (width) indent of wrapped lines
+ /         eow --> position of a break before the first word (0: none)
+ /   eow_width --> (width) line before the break
+\*/
+static bool vm_fill_solve(ufold_vm_t* vm, size_t count, size_t prefix,
+                          size_t indent, size_t eow, size_t eow_width)
+{
+    size_t max_width = vm->config.max_width;
+    vm_word_t* words = vm->words;
+
+    if (count <= 0) {
+        return true;
+    }
+
+    // NOTE: cost of a line (the last one is free unless too long)
+#define FILL_COST(w, last) ((w) > max_width ? (uint64_t)0xFFFFF * 0xFFFFF \
+        : (last) ? 0 : (uint64_t)min(max_width - (w), 0xFFFFF) \
+                       * (uint64_t)min(max_width - (w), 0xFFFFF))
+
+    for (size_t j = 1; j <= count; ++j) {
+        size_t width = 0;  // (width) words i..j-1
+        bool last = (j >= count);
+
+        words[j - 1].cost = UINT64_MAX;
+
+        for (size_t i = j; i-- > 0; ) {
+            width += words[i].width + ((i < j - 1) ? words[i + 1].gap : 0);
+
+            // a word too long is left alone
+            if (indent + width > max_width && i < j - 1) {
+                break;
+            }
+
+            uint64_t cost = FILL_COST(indent + width, last);
+            size_t prev = i;
+
+            if (i > 0) {
+                cost += words[i - 1].cost;
+            } else {
+                uint64_t c = FILL_COST(prefix + words[0].gap + width, last);
+
+                if (eow > 0) {
+                    // or break right before the first word
+                    cost += FILL_COST(eow_width, false);
+                    prev = SIZE_MAX;
+                }
+                if (eow <= 0 || c <= cost) {
+                    cost = c;
+                    prev = 0;
+                }
+            }
+            if (cost < words[j - 1].cost) {
+                words[j - 1].cost = cost;
+                words[j - 1].prev = prev;
+            }
+        }
+    }
+#undef FILL_COST
+
+    // breaks are found backwards
+    size_t first = vm->fill_count;
+
+    for (size_t j = count; j > 0; ) {
+        size_t i = words[j - 1].prev;
+
+        if (j < count || i == SIZE_MAX) {
+            size_t n = vm->fill_count;
+
+            if (!buf_reserve(vm->config.realloc, (void**)&vm->fill,
+                             &vm->fill_capacity, n + 2, sizeof(size_t))) {
+                logged_return(false);
+            }
+            if (j < count) {
+                vm->fill[vm->fill_count++] = words[j - 1].end;
+            }
+            if (i == SIZE_MAX) {
+                vm->fill[vm->fill_count++] = eow;
+            }
+        }
+        j = (i == SIZE_MAX) ? 0 : i;
+    }
+    for (size_t i = first, k = vm->fill_count; i + 1 < k; ++i, --k) {
+        size_t t = vm->fill[i];
+
+        vm->fill[i] = vm->fill[k - 1];
+        vm->fill[k - 1] = t;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Check if the last end of word is a planned break, where the line starts
+ /   at the given position from line start.
+\*/
+static bool vm_fill_due(ufold_vm_t* vm, size_t sol)
+{
+    // breaks passed by without wrapping there are dropped
+    while (vm->fill_next < vm->fill_count &&
+            (vm->fill[vm->fill_next] <= sol ||
+             vm->fill[vm->fill_next] < vm->eow)) {
+        vm->fill_next += 1;
+    }
+    if (vm->fill_next < vm->fill_count && vm->eow > sol &&
+            vm->fill[vm->fill_next] == vm->eow) {
+        vm->fill_next += 1;
+        return true;
+    }
+    return false;
+}
+
+/*\
+ / DESCRIPTION
+ /   Decode the properties of the character at the position from line start.
+ /
+ / RETURN
+ /   N :: N bytes of the character
+ /   0 :: failure
+\*/
+static size_t vm_fill_char(const ufold_vm_t* vm, size_t i, uint8_t* cell)
+{
+    const uint8_t* bytes = vm->line + i;
+    size_t size = vm->line_size - i;
+    utf8proc_int32_t codepoint = -1;
+    utf8proc_ssize_t n_bytes = -1;
+    size_t escaped = vm_escape(vm, bytes, size);
+
+    if (escaped > 0) {
+        *cell = 0;  // zero-width text
+        return escaped;
+    }
+    if (vm->cells != NULL) {
+        *cell = vm->cells[(vm->line - vm->buf) + i];
+        return (*cell & CELL_SIZE) + 1;
+    }
+    if (vm->line_raw) {
+        n_bytes = vm_decode_raw(vm, bytes, size, &codepoint);
+    } else if (vm->config.ascii_mode) {
+        codepoint = *bytes;
+        n_bytes = (codepoint <= 0x7F ? 1 : -1);
+    } else {
+        n_bytes = utf8proc_iterate(bytes, size, &codepoint);
+    }
+    if (!vm_cell(vm, codepoint, n_bytes, cell)) {
+        return 0;
+    }
+    return n_bytes;
+}
+
+/*\
+ / DESCRIPTION
+ /   Decode a codepoint from unsanitized input as if it had been sanitized.
+ /   Line endings CR, CRLF, NEL, LS and PS are read as LF, and every byte of
+ /   an invalid sequence or a control character is read as '?'.
+ /
+ / RETURN
+ /   N :: N bytes of input are consumed
+\*/
+static utf8proc_ssize_t vm_decode_raw(const ufold_vm_t* vm,
+                                      const uint8_t* bytes, size_t size,
+                                      utf8proc_int32_t* codepoint)
+{
+    debug_assert(size > 0);
+
+    // NOTE: ASCII Normalization: CRLF, CR -> LF
+    if (bytes[0] == '\r') {
+        *codepoint = '\n';
+        return (size > 1 && bytes[1] == '\n') ? 2 : 1;
+    }
+    if (vm->config.ascii_mode) {
+        *codepoint = ascii_sanitize(bytes[0]);
+        return 1;
+    }
+
+    utf8proc_ssize_t n_bytes = utf8proc_iterate(bytes, size, codepoint);
+
+    if (n_bytes <= 0 || n_bytes > 4) {
+        *codepoint = '?';
+        return 1;
+    }
+    // NOTE: UTF-8 Normalization: U+2028, U+2029, U+0085 -> LF
+    if (*codepoint == 0x2028 || *codepoint == 0x2029 || *codepoint == 0x0085) {
+        *codepoint = '\n';
+        return n_bytes;
+    }
+    if (is_controlchar(*codepoint, false) ||
+            get_charwidth(*codepoint, false) < 0) {
+        *codepoint = '?';
+        return 1;
+    }
+    return n_bytes;
+}
+
+/*\
+ / DESCRIPTION
+ /   Get the length of an ANSI escape sequence passed through as zero-width
+ /   text, which is never split by line breaks.
+ /
+ / RETURN
+ /   0 :: no escape sequence at the start of bytes
+ /   N :: N bytes of escape sequence
+\*/
+static size_t vm_escape(const ufold_vm_t* vm,
+                        const uint8_t* bytes, size_t size)
+{
+    if (size <= 0 || bytes[0] != 0x1B || !vm->config.ansi_escapes ||
+            vm->config.ascii_mode) {
+        return 0;
+    }
+    return ansi_length(bytes, size);
+}
+
+/*\
+ / DESCRIPTION
+ /   Sanitize validated input in place, keeping escape sequences if enabled.
+\*/
+static size_t vm_sanitize(const ufold_vm_t* vm, uint8_t* bytes, size_t size)
+{
+    if (vm->config.ansi_escapes) {
+        return ansi_sanitize(bytes, size);
+    }
+    return utf8_sanitize(bytes, size);
+}
+
+/*\
+ / DESCRIPTION
+ /   Check if the codepoint is hanging punctuation.
+\*/
+static bool vm_is_punctuation(const ufold_vm_t* vm, utf8proc_int32_t codepoint)
+{
+    const ufold_punct_t* punct = vm->config.punct;
+
+    if (punct != NULL) {
+        if (codepoint >= 0 && codepoint <= 0xFF) {
+            return (punct->low[codepoint >> 6] >> (codepoint & 0x3F)) & 1;
+        }
+        if (punct->chars == NULL) {
+            return is_hanging_punctuation(codepoint, punct->ascii_mode);
+        }
+        size_t lo = 0;
+        size_t hi = punct->count;
+
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+
+            if (punct->codepoints[mid] < codepoint) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo < punct->count && punct->codepoints[lo] == codepoint;
+    }
+    // iterators given no set scan the punctuation
+    if (vm->config.punctuation == NULL) {
+        return is_punctuation(NULL, NULL, codepoint, vm->config.ascii_mode);
+    }
+    if (*vm->config.punctuation == '\0') {
+        return false;
+    }
+    // NOTE: raw input may differ from its codepoint
+    char buf[5];
+    size_t k = utf8proc_encode_char(codepoint, (utf8proc_uint8_t*)buf);
+    buf[k] = '\0';
+    return is_punctuation(vm->config.punctuation, buf, 0,
+                          vm->config.ascii_mode);
+}
+
+/*\
+ / DESCRIPTION
+ /   Choose the columns of each width class once for all characters.
+\*/
+static void vm_widths(ufold_vm_t* vm)
+{
+    vm->widths[0] = 0;
+    vm->widths[1] = 1;
+    vm->widths[2] = 2;
+    vm->widths[CW_AMBIGUOUS] = (vm->config.ambiguous_width > 1) ? 2 : 1;
+}
+
+/*\
+ / DESCRIPTION
+ /   Get the width of an isolated codepoint by its width class.
+\*/
+static int vm_charwidth(const ufold_vm_t* vm, utf8proc_int32_t codepoint)
+{
+    if (vm->config.ascii_mode || codepoint < 0 || codepoint >= 0x110000) {
+        return get_charwidth(codepoint, vm->config.ascii_mode);
+    }
+    return vm->widths[width_class(vm->config.width_table, codepoint)];
+}
+
+/*\
+ / DESCRIPTION
+ /   Get the width class of a codepoint, which is its width unless it is
+ /   East Asian Ambiguous, from the table if any.
+\*/
+static int width_class(const ufold_width_table_t* table,
+                       utf8proc_int32_t codepoint)
+{
+    debug_assert(codepoint >= 0 && codepoint < 0x110000);
+
+    if (table != NULL) {
+        size_t i = (size_t)(codepoint >> table->shift) * 2;
+        size_t block = table->index[i] | (table->index[i + 1] << 8);
+        size_t k = (block << table->shift) |
+                   (codepoint & (((size_t)1 << table->shift) - 1));
+
+        return (table->blocks[k >> 1] >> ((k & 1) * 4)) & 0x0F;
+    }
+    // two classes per byte
+    uint8_t pair = cw_blocks[
+        (cw_index[codepoint >> CW_SHIFT] << (CW_SHIFT - 1)) |
+        ((codepoint & ((1 << CW_SHIFT) - 1)) >> 1)];
+
+    return (pair >> ((codepoint & 1) * 4)) & 0x0F;
+}
+
+/*\
+ / DESCRIPTION
+ /   Calculate the width of well-formed ellipsis by width classes.
+\*/
+static bool vm_ellipsis_width(const ufold_vm_config_t* config, size_t* width)
+{
+    const uint8_t* bytes = (const uint8_t*)config->ellipsis;
+    size_t size = strlen(config->ellipsis);
+
+    *width = 0;
+
+    if (config->ascii_mode) {
+        if (!calc_width(bytes, size, config->tab_width, width, true)) {
+            logged_return(false);
+        }
+        return true;
+    }
+
+    const size_t columns[CW_AMBIGUOUS + 1] = {
+        0, 1, 2, (config->ambiguous_width > 1) ? 2 : 1,
+    };
+    utf8proc_int32_t codepoint = -1;
+    utf8proc_ssize_t n_bytes = -1;
+
+    // no tab nor line feed in ellipsis
+    for (size_t i = 0; i < size; i += n_bytes) {
+        n_bytes = utf8proc_iterate(bytes + i, size - i, &codepoint);
+
+        if (n_bytes <= 0 || n_bytes > 4) {
+            logged_return(false);
+        }
+        *width += columns[width_class(config->width_table, codepoint)];
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Look up the line breaking class (UAX #14) of a character.
+ /   The codepoint is decoded from bytes if it is negative.
+\*/
+static int vm_break_class(const ufold_vm_t* vm, const uint8_t* bytes,
+                          size_t size, utf8proc_int32_t codepoint)
+{
+    if (codepoint < 0) {
+        if (vm->line_raw) {
+            (void)vm_decode_raw(vm, bytes, size, &codepoint);
+        } else if (bytes[0] <= 0x7F || vm->config.ascii_mode) {
+            codepoint = bytes[0];
+        } else {
+            (void)utf8proc_iterate(bytes, size, &codepoint);
+        }
+    }
+    if (codepoint >= 0 && codepoint <= 0x7F) {
+        return lb_ascii[codepoint];
+    }
+    if (codepoint < 0 || codepoint >= 0x110000) {
+        return LB_AL;
+    }
+    return lb_blocks[(lb_index[codepoint >> LB_SHIFT] << LB_SHIFT) |
+                     (codepoint & ((1 << LB_SHIFT) - 1))];
+}
+
+/*\
+ / DESCRIPTION
+ /   Check if a character continues the grapheme cluster (UAX #29) of the
+ /   previous character, and update the state of the cluster.
+ /   The codepoint is decoded from bytes if it is negative.
+\*/
+static bool vm_grapheme(const ufold_vm_t* vm, const uint8_t* bytes,
+                        size_t size, utf8proc_int32_t codepoint,
+                        uint8_t* state)
+{
+    if (codepoint < 0) {
+        if (vm->line_raw) {
+            (void)vm_decode_raw(vm, bytes, size, &codepoint);
+        } else if (bytes[0] <= 0x7F) {
+            codepoint = bytes[0];
+        } else {
+            (void)utf8proc_iterate(bytes, size, &codepoint);
+        }
+    }
+
+    int next = GB_CONTROL;
+
+    if (codepoint >= 0x20 && codepoint < 0x7F) {
+        next = GB_OTHER;
+    } else if (codepoint >= 0x80 && codepoint < 0x110000) {
+        // two properties per byte
+        uint8_t pair = gb_blocks[
+            (gb_index[codepoint >> GB_SHIFT] << (GB_SHIFT - 1)) |
+            ((codepoint & ((1 << GB_SHIFT) - 1)) >> 1)];
+        next = (pair >> ((codepoint & 1) * 4)) & 0x0F;
+    }
+
+    int prev = *state & GRAPHEME_PROPERTY;
+    bool joined = false;
+
+    if (prev == GB_CONTROL || next == GB_CONTROL) {
+        joined = false;
+    } else if (next == GB_EXTEND || next == GB_ZWJ ||
+               next == GB_SPACINGMARK || prev == GB_PREPEND) {
+        joined = true;
+    } else if (prev == GB_L) {
+        joined = (next == GB_L || next == GB_V ||
+                  next == GB_LV || next == GB_LVT);
+    } else if (prev == GB_LV || prev == GB_V) {
+        joined = (next == GB_V || next == GB_T);
+    } else if (prev == GB_LVT || prev == GB_T) {
+        joined = (next == GB_T);
+    } else if (prev == GB_ZWJ && next == GB_PICT) {
+        joined = *state & GRAPHEME_PICT;
+    } else if (prev == GB_RI && next == GB_RI) {
+        joined = *state & GRAPHEME_RI_ODD;
+    }
+
+    uint8_t flags = 0;
+
+    if (next == GB_RI && !joined) {
+        flags |= GRAPHEME_RI_ODD;
+    }
+    if (next == GB_PICT || ((next == GB_EXTEND || next == GB_ZWJ) &&
+                            prev != GB_ZWJ && (*state & GRAPHEME_PICT))) {
+        flags |= GRAPHEME_PICT;
+    }
+    if (joined) {
+        flags |= *state & GRAPHEME_SPACE;
+    }
+    *state = (uint8_t)(next | flags);
+    return joined;
+}
+
+/*\
+ / DESCRIPTION
+ /   Output text of the line ending at the given column.
+\*/
+static bool vm_put_text(ufold_vm_t* vm,
+                        const uint8_t* bytes, size_t size, size_t width)
+{
+    if (vm_limited(vm)) {
+        return true;
+    }
+    if (size > 0) {
+        if (VM_METERED(vm) && !add(&vm->metrics.bytes, size)) {
+            logged_return(false);
+        }
+        vm->output_width = width;
+        vm->output_pending = true;
+    }
+    if (vm->iter != NULL) {
+        vm_span_text(vm, bytes, size, width);
+        return true;
+    }
+    vm_sgr_update(vm, bytes, size);
+    return vm->config.count_only || vm_write(vm, bytes, size);
+}
 
-                if (!eol_found && !t) {
-                    // avoid infinite loop
-                    if (sol == bytes ||
-                            // character too wide
-                            offset - width == vm->indent_width) {
-                        advance = n_bytes;
-                        word_end = NULL;
-                    }
-                    if (!ws_found) {
-                        // TODO: continue to collect all zero-width characters
-                    }
-                }
+/*\
+ / DESCRIPTION
+ /   Output the last text of the line followed by its line feed.
+\*/
+static bool vm_put_line(ufold_vm_t* vm, const uint8_t* bytes, size_t size,
+                        size_t eol_size, size_t width)
+{
+    if (vm_limited(vm)) {
+        return true;
+    }
+    if (size > 0) {
+        vm->output_width = width;
+    }
+    // line feed is always normalized to LF
+    if (VM_METERED(vm) && (!add(&vm->metrics.bytes, size) ||
+                           !add(&vm->metrics.bytes, 1))) {
+        logged_return(false);
+    }
+    if (!vm_count_line(vm)) {
+        logged_return(false);
+    }
+    if (vm->iter != NULL) {
+        vm_span_text(vm, bytes, size, width);
+        vm_span_open(vm);
 
-                // TODO: break at grapheme clusters? anyway damn ligature
-                if (!vm->config.write(sol, bytes - sol + advance)) {
-                    logged_return(false);
+        if (vm->iter->span.start == vm->iter->span.end &&
+                !vm->iter->span_cut) {
+            vm->iter->span.start = vm_iter_offset(vm, bytes);
+            vm->iter->span.end = vm->iter->span.start;
+        }
+        vm_span_close(vm, UFOLD_BREAK_HARD);
+        vm->iter->next = vm_iter_offset(vm, bytes + size + eol_size);
+        return true;
+    }
+    vm_sgr_update(vm, bytes, size);
+
+    if (vm->config.count_only) {
+        return true;
+    }
+    if (vm->line_raw) {
+        // line feed is always normalized to LF
+        return vm_write(vm, bytes, size) && vm_write(vm, "\n", 1);
+    }
+    return vm_write(vm, bytes, size + eol_size);
+}
+
+/*\
+ / DESCRIPTION
+ /   Output a line break for wrapping.
+\*/
+static bool vm_put_break(ufold_vm_t* vm)
+{
+    if (vm_limited(vm)) {
+        return true;
+    }
+    if ((VM_METERED(vm) && !add(&vm->metrics.bytes, 1)) ||
+            !vm_count_line(vm)) {
+        logged_return(false);
+    }
+    if (vm->iter != NULL) {
+        vm_span_close(vm, (vm->iter->span.brk == UFOLD_BREAK_FORCED)
+                      ? UFOLD_BREAK_FORCED : UFOLD_BREAK_SOFT);
+        return true;
+    }
+    // graphic rendition never fills the rest of line
+    if (!vm_put_reset(vm)) {
+        logged_return(false);
+    }
+    if (!vm->config.count_only && !vm_write(vm, "\n", 1)) {
+        logged_return(false);
+    }
+    // restore graphic rendition for readers of single lines
+    if (!vm_limited(vm) && !vm_put_sgr(vm)) {
+        logged_return(false);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Output the ellipsis after the text kept of a truncated line.
+\*/
+static bool vm_put_ellipsis(ufold_vm_t* vm)
+{
+    const char* ellipsis = vm->config.ellipsis;
+    size_t size = (ellipsis != NULL) ? strlen(ellipsis) : 0;
+
+    if (vm_limited(vm)) {
+        return true;
+    }
+    // graphic rendition is restored when the skipped text ends
+    if (!vm_put_reset(vm)) {
+        logged_return(false);
+    }
+    if (size > 0) {
+        if (VM_METERED(vm) && !add(&vm->metrics.bytes, size)) {
+            logged_return(false);
+        }
+        vm->output_width = vm->cut_width + vm->ellipsis_width;
+        vm->output_pending = true;
+    }
+    // no room for it in line spans of input
+    if (vm->iter != NULL || vm->config.count_only) {
+        return true;
+    }
+    return vm_write(vm, ellipsis, size);
+}
+
+/*\
+ / DESCRIPTION
+ /   Output a reset of graphic rendition if any is kept.
+\*/
+static bool vm_put_reset(ufold_vm_t* vm)
+{
+    if (vm->sgr_size <= 0 || vm->iter != NULL) {
+        return true;
+    }
+    if (VM_METERED(vm) && !add(&vm->metrics.bytes, 3)) {
+        logged_return(false);
+    }
+    if (!vm->config.count_only && !vm_write(vm, "\x1B[m", 3)) {
+        logged_return(false);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Output the SGR sequences kept since the last reset to restore graphic
+ /   rendition.
+\*/
+static bool vm_put_sgr(ufold_vm_t* vm)
+{
+    if (vm->sgr_size <= 0 || vm->iter != NULL) {
+        return true;
+    }
+    if (VM_METERED(vm) && !add(&vm->metrics.bytes, vm->sgr_size)) {
+        logged_return(false);
+    }
+    if (!vm->config.count_only && !vm_write(vm, vm->sgr, vm->sgr_size)) {
+        logged_return(false);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Finish the output after the last line that has no line feed.
+\*/
+static bool vm_put_end(ufold_vm_t* vm)
+{
+    if (vm_limited(vm)) {
+        return true;
+    }
+    if (vm->output_pending && !vm_count_line(vm)) {
+        logged_return(false);
+    }
+    // a last line cut down to no ellipsis is no line either
+    if (vm->iter != NULL && vm->iter->span_open &&
+            (vm->output_pending || !vm->iter->span_cut)) {
+        vm_span_close(vm, UFOLD_BREAK_NONE);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Keep track of SGR (Select Graphic Rendition) sequences in output text,
+ /   so that the rendition can be restored after a line break.
+ /   Sequences since the last reset are kept as they are, and the oldest
+ /   ones are dropped if they do not fit.
+\*/
+static void vm_sgr_update(ufold_vm_t* vm, const uint8_t* bytes, size_t size)
+{
+    // not kept for line spans either
+    if (vm->sgr == NULL) {
+        return;
+    }
+    const uint8_t* end = bytes + size;
+    const uint8_t* p = bytes;
+
+    while ((p = memchr(p, 0x1B, end - p)) != NULL) {
+        size_t k = ansi_length(p, end - p);
+
+        if (k < 3 || p[1] != '[' || p[k - 1] != 'm' ||
+                strspn((const char*)p + 2, "0123456789;:") != k - 3) {
+            p += (k > 0) ? k : 1;
+            continue;  // not SGR
+        }
+
+        // find the last reset among parameters, e.g. ESC [ 1 ; 0 m
+        bool reset = false;  // whether any reset is found
+        bool set = false;  // whether anything is set after the last reset
+        size_t skip = 0;  // parameters of an extended color left
+
+        for (size_t i = 2; i < k; ++i) {
+            size_t value = 0;
+            bool plain = true;  // no sub-parameter, e.g. 38:5:1
+
+            for (; p[i] != ';' && p[i] != 'm'; ++i) {
+                if (p[i] >= '0' && p[i] <= '9') {
+                    value = (value < 1000) ? value * 10 + (p[i] - '0') : value;
+                } else {
+                    plain = false;
                 }
-                // no need to recalculate tab width here if n_bytes=0
-                n_bytes = advance;
-                sol = bytes + advance;
-                offset = vm->indent_width;
-                vm_eow_reset(vm);  // next, skip whitespace
-                vm->state = VM_WRAP;
-                continue;
             }
-        }
-        else if (eol_found)
-        {
-            debug_assert(offset <= vm->config.max_width);
+            if (skip > 0) {
+                skip -= 1;
+            } else if (plain && value == 0) {
+                reset = true;
+                set = false;
+            } else {
+                set = true;
 
-            if (!vm->config.write(sol, bytes - sol + n_bytes)) {
-                logged_return(false);
+                if (plain && (value == 38 || value == 48 || value == 58)) {
+                    // 5;N or 2;R;G;B
+                    skip = (p[i] == ';' && p[i + 1] == '2') ? 4 : 2;
+                }
             }
-            if (vm->config.keep_indentation) {
-                vm_indent_reset(vm);
+            if (p[i] == 'm') {
+                break;
             }
-            sol = bytes + n_bytes;
-            offset = 0;
-            vm_eow_reset(vm);
-            vm->state = VM_LINE;
-            continue;
         }
-        else debug_assert(offset <= vm->config.max_width);
-    }
+        if (reset) {
+            vm->sgr_size = 0;
+        }
+        if (set) {
+            // drop the oldest sequences
+            while (vm->sgr_size + k > ANSI_MAX) {
+                size_t n = ansi_length(vm->sgr, vm->sgr_size);
 
-    if (vm->state == VM_FULL || vm->stopped) {
-        if (vm->state == VM_WRAP && bytes > sol) {
-            if (!vm->config.write("\n", 1)) {
-                logged_return(false);
-            }
-            if (vm->config.keep_indentation && !vm_indent(vm)) {
-                logged_return(false);
+                debug_assert(n > 0);
+
+                memmove(vm->sgr, vm->sgr + n, vm->sgr_size - n);
+                vm->sgr_size -= n;
             }
+            memcpy(vm->sgr + vm->sgr_size, p, k);
+            vm->sgr_size += k;
         }
-        if (!vm->config.write(sol, bytes - sol)) {
+        p += k;
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Count the line being output.
+\*/
+static bool vm_count_line(ufold_vm_t* vm)
+{
+    if (!add(&vm->metrics.lines, 1)) {
+        logged_return(false);
+    }
+    if (VM_METERED(vm)) {
+        vm->metrics.max_width = max(vm->metrics.max_width, vm->output_width);
+    }
+    vm->output_width = 0;
+    vm->output_pending = false;
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Check whether the VM has output the maximum lines, after which it
+ /   outputs nothing.
+\*/
+static bool vm_limited(const ufold_vm_t* vm)
+{
+    return vm->config.max_lines > 0 &&
+        vm->metrics.lines >= vm->config.max_lines;
+}
+
+/*\
+ / DESCRIPTION
+ /   Write output to the writer or to the buffer in memory.
+ /   Unsanitized input is sanitized on its way to the buffer.
+\*/
+static bool vm_write(ufold_vm_t* vm, const void* bytes, size_t size)
+{
+    vm_cache_t* cache = vm->cache;
+
+    if (cache != NULL && cache->recording) {
+        if (!buf_reserve(vm->config.realloc, (void**)&cache->record,
+                         &cache->record_capacity, cache->record_size + size,
+                         sizeof(uint8_t))) {
             logged_return(false);
         }
-        vm->cursor = 0;
-        vm->cursor_offset = offset;
-        vm_line_shift(vm, bytes - vm->line);
-        vm_eow_reset(vm);
-    } else {
-        if (vm->eow > sol - vm->line) {
-            vm->eow -= sol - vm->line;
+        memcpy(cache->record + cache->record_size, bytes, size);
+        cache->record_size += size;
+    }
+    if (vm->output == NULL) {
+        return vm_put(vm, bytes, size);
+    }
+    debug_assert(vm->line_raw);
+
+    if (size > vm->output_capacity - vm->output_size) {
+        logged_return(false);
+    }
+    if (size > 0) {
+        uint8_t* p = vm->output + vm->output_size;
+
+        memcpy(p, bytes, size);
+
+        if (vm->config.ascii_mode) {
+            for (size_t i = 0; i < size; ++i) {
+                p[i] = ascii_sanitize(p[i]);
+            }
         } else {
-            vm_eow_reset(vm);
+            vm_sanitize(vm, p, size);
         }
-        vm->cursor = bytes - sol;
-        vm->cursor_offset = offset;
-        vm->cursor_at_word = word_end != NULL;
-        vm_line_shift(vm, sol - vm->line);
+        vm->output_size += size;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Pass output to the writer given its context, or to that of settings.
+\*/
+static bool vm_put(const ufold_vm_t* vm, const void* bytes, size_t size)
+{
+    if (vm->write_to != NULL) {
+        return vm->write_to(vm->write_context, bytes, size);
+    }
+    return vm->config.write(bytes, size);
+}
+
+/*\
+ / DESCRIPTION
+ /   Prepare a VM to process the whole input in place without allocation.
+\*/
+static void vm_borrow(ufold_vm_t* vm, const ufold_vm_config_t* config,
+                      const void* input, size_t size)
+{
+    memset(vm, 0, sizeof(ufold_vm_t));
+
+    vm->config = *config;
+    vm->config.write = NULL;
+    vm->config.realloc = NULL;
+    debug_assert(!vm_filling(config));
+    vm->line = (uint8_t*)input;
+    vm->line_size = size;
+    vm->line_borrowed = true;
+    vm->line_raw = true;
+    vm->state = VM_LINE;
+
+    vm_widths(vm);
+
+    if (config->ellipsis != NULL) {
+        // checked by the caller to be well-formed
+        (void)vm_ellipsis_width(config, &vm->ellipsis_width);
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Process the whole input borrowed by a VM and stop the VM.
+\*/
+static bool vm_run(ufold_vm_t* vm)
+{
+    if (!vm_flush(vm)) {
+        logged_return(false);
+    }
+    vm->stopped = true;
+
+    if (!vm_flush(vm)) {
+        logged_return(false);
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Extend the line span with text ending at the given column.
+\*/
+static void vm_span_text(ufold_vm_t* vm,
+                         const uint8_t* bytes, size_t size, size_t width)
+{
+    if (size > 0) {
+        ufold_span_t* span = &vm->iter->span;
+        size_t start = vm_iter_offset(vm, bytes);
+
+        vm_span_open(vm);
+
+        // text of a line is contiguous in input
+        if (span->start == span->end) {
+            span->start = start;
+        } else {
+            debug_assert(span->end == start);
+        }
+        span->end = start + size;
+        span->width = width;
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Start a new line span unless one is in progress.
+\*/
+static void vm_span_open(ufold_vm_t* vm)
+{
+    ufold_iter_t* iter = vm->iter;
+
+    if (!iter->span_open) {
+        iter->span.start = iter->next;
+        iter->span.end = iter->next;
+        iter->span.width = 0;
+        iter->span.indent = 0;
+        iter->span.indent_width = 0;
+        iter->span.brk = UFOLD_BREAK_NONE;
+        iter->span_open = true;
+        iter->span_cut = false;
     }
-    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Finish the line span and queue it for the iterator.
+\*/
+static void vm_span_close(ufold_vm_t* vm, ufold_break_t brk)
+{
+    ufold_iter_t* iter = vm->iter;
+
+    vm_span_open(vm);
+    debug_assert(iter->span_count < 2);
+
+    iter->span.brk = brk;
+    iter->spans[iter->span_count++] = iter->span;
+    iter->span_open = false;
+    iter->next = iter->span.end;
+    vm->yield = true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Prepare a VM to resume the iteration over the rest of input in place.
+\*/
+static void vm_iter_load(ufold_vm_t* vm, ufold_iter_t* iter)
+{
+    vm_borrow(vm, &iter->config, iter->input + (iter->line - iter->origin),
+              iter->size - (iter->line - iter->origin));
+
+    vm->cursor = iter->cursor;
+    vm->cursor_offset = iter->cursor_offset;
+    vm->eow = iter->eow;
+    vm->eow_ss = iter->eow_ss;
+    vm->eow_ww = iter->eow_ww;
+    vm->eow_width = iter->eow_width;
+    vm->cut = iter->cut;
+    vm->cut_width = iter->cut_width;
+    vm->output_width = iter->output_width;
+    vm->indent_size = iter->indent_size;
+    vm->indent_width = iter->indent_width;
+    vm->state = (vm_state_t)iter->state;
+    vm->break_class = iter->break_class;
+    vm->grapheme = iter->grapheme;
+    vm->indent_hanging = iter->indent_hanging;
+    vm->cursor_at_word = iter->cursor_at_word;
+    vm->stopped = iter->stopped;
+    vm->metrics.lines = iter->lines;
+    vm->iter = iter;
+
+    if (iter->cells != NULL) {
+        // cells are aligned with the whole input
+        vm->buf = (uint8_t*)iter->input;
+        vm->cells = (uint8_t*)iter->cells;
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Keep the state of a VM after the iteration over input.
+\*/
+static void vm_iter_save(const ufold_vm_t* vm, ufold_iter_t* iter)
+{
+    iter->line = iter->origin + iter->size - vm->line_size;
+    iter->cursor = vm->cursor;
+    iter->cursor_offset = vm->cursor_offset;
+    iter->eow = vm->eow;
+    iter->eow_ss = vm->eow_ss;
+    iter->eow_ww = vm->eow_ww;
+    iter->eow_width = vm->eow_width;
+    iter->cut = vm->cut;
+    iter->cut_width = vm->cut_width;
+    iter->output_width = vm->output_width;
+    iter->indent_size = vm->indent_size;
+    iter->indent_width = vm->indent_width;
+    iter->state = vm->state;
+    iter->break_class = vm->break_class;
+    iter->grapheme = vm->grapheme;
+    iter->indent_hanging = vm->indent_hanging;
+    iter->cursor_at_word = vm->cursor_at_word;
+    iter->stopped = vm->stopped;
+    iter->lines = vm->metrics.lines;
+}
+
+/*\
+ / DESCRIPTION
+ /   Get the offset of bytes in the whole input of the iteration.
+\*/
+static size_t vm_iter_offset(const ufold_vm_t* vm, const uint8_t* bytes)
+{
+    return vm->iter->origin + (bytes - vm->iter->input);
 }
 
 /*\
@@ -924,11 +4861,47 @@ static bool vm_indent(ufold_vm_t* vm)
 {
     debug_assert(vm->config.keep_indentation);
 
+    if (vm_limited(vm)) {
+        return true;
+    }
+    if (vm->indent_size > 0) {
+        if (VM_METERED(vm) && !add(&vm->metrics.bytes, vm->indent_size)) {
+            logged_return(false);
+        }
+        vm->output_width = vm->indent_width;
+        vm->output_pending = true;
+    }
+    if (vm->config.count_only) {
+        return true;
+    }
+    if (vm->iter != NULL) {
+        vm_span_open(vm);
+        vm->iter->span.indent = vm->indent_size;
+        vm->iter->span.indent_width = vm->indent_width;
+
+        if (vm->iter->span.start == vm->iter->span.end) {
+            vm->iter->span.width = vm->indent_width;
+        }
+        return true;
+    }
     if (vm->indent_size > 0) {
         debug_assert(vm->indent_width >= 0);  // zero-width tab?
+
+        if (vm->line_raw) {
+            // indent in input followed by spaces for hanging punctuation
+            if (!vm_write(vm, vm->indent, vm->indent_borrowed)) {
+                logged_return(false);
+            }
+            for (size_t i = vm->indent_borrowed; i < vm->indent_size; ++i) {
+                if (!vm_write(vm, " ", 1)) {
+                    logged_return(false);
+                }
+            }
+            return true;
+        }
         debug_assert(vm->indent != NULL);
 
-        if (!vm->config.write(vm->indent, vm->indent_size)) {
+        if (!vm_write(vm, vm->indent, vm->indent_size)) {
             logged_return(false);
         }
     }
@@ -948,6 +4921,22 @@ static bool vm_indent_feed(ufold_vm_t* vm,
     if (vm->indent_width + width < width) {
         logged_return(false);
     }
+    if (vm->line_raw || vm->config.count_only) {
+        // refer to indent in input rather than copy it
+        if (vm->indent_size + size < size) {
+            logged_return(false);
+        }
+        // whitespace from input precedes spaces for hanging punctuation
+        if (vm->line_raw && !vm->indent_hanging) {
+            if (vm->indent_borrowed == 0) {
+                vm->indent = (uint8_t*)bytes;
+            }
+            vm->indent_borrowed += size;
+        }
+        vm->indent_size += size;
+        vm->indent_width += width;
+        return true;
+    }
     if (vm->indent_bufsize - vm->indent_size <= size) {
         size_t bufsize = vm->indent_size + size + 1;
 
@@ -984,6 +4973,7 @@ static void vm_indent_reset(ufold_vm_t* vm)
     debug_assert(vm->config.keep_indentation);
 
     // keep vm->indent and vm->indent_bufsize intact
+    vm->indent_borrowed = 0;
     vm->indent_size = 0;
     vm->indent_width = 0;
     vm->indent_hanging = false;
@@ -994,4 +4984,492 @@ static void vm_eow_reset(ufold_vm_t* vm)
     vm->eow = 0;
     vm->eow_ss = 0;
     vm->eow_ww = 0;
+    vm->eow_width = 0;
+}
+
+/*\
+ / DESCRIPTION
+ /   Save the streaming state of a single VM.
+\*/
+static void vm_save(const ufold_vm_t* vm, vm_snap_t* snap)
+{
+    debug_assert(!vm->line_borrowed);
+    debug_assert(!vm->line_raw);
+
+    snap_put(snap, vm->line_size);
+    snap_put_data(snap, vm->line, vm->line_size);
+    snap_put(snap, vm->cursor);
+    snap_put(snap, vm->cursor_offset);
+    snap_put(snap, vm->eow);
+    snap_put(snap, vm->eow_ss);
+    snap_put(snap, vm->eow_ww);
+    snap_put(snap, vm->eow_width);
+    snap_put(snap, vm->break_class);
+    snap_put(snap, vm->grapheme);
+    snap_put(snap, vm->cut);
+    snap_put(snap, vm->cut_width);
+    snap_put(snap, vm->slot_used);
+    snap_put(snap, vm->slot_cursor);
+    snap_put_data(snap, vm->slots, vm->slot_used);
+    snap_put(snap, vm->slot_escape);
+    snap_put(snap, vm->slot_ansi);
+    snap_put(snap, vm->unit_used);
+    snap_put_data(snap, vm->units, vm->unit_used);
+    snap_put(snap, vm->indent_size);
+    snap_put(snap, vm->indent_width);
+
+    if (!vm->config.count_only) {
+        snap_put_data(snap, vm->indent, vm->indent_size);
+    }
+    snap_put(snap, vm->state);
+    snap_put(snap, (vm->slot_crlf ? 0x01 : 0) |
+                   (vm->indent_hanging ? 0x02 : 0) |
+                   (vm->cursor_at_word ? 0x04 : 0) |
+                   (vm->output_pending ? 0x08 : 0) |
+                   (vm->stopped ? 0x10 : 0) |
+                   (vm->unit_le ? 0x20 : 0) |
+                   (vm->unit_started ? 0x40 : 0));
+    snap_put(snap, vm->metrics.lines);
+    snap_put(snap, vm->metrics.max_width);
+    snap_put(snap, vm->metrics.bytes);
+    snap_put(snap, vm->output_width);
+    snap_put(snap, vm->sgr_size);
+    snap_put_data(snap, vm->sgr, vm->sgr_size);
+}
+
+/*\
+ / DESCRIPTION
+ /   Load the streaming state of a single VM just created.
+\*/
+static bool vm_load(ufold_vm_t* vm, vm_snap_t* snap)
+{
+    size_t line_size = snap_get(snap);
+    const uint8_t* line = snap_get_data(snap, line_size);
+
+    vm->cursor = snap_get(snap);
+    vm->cursor_offset = snap_get(snap);
+    vm->eow = snap_get(snap);
+    vm->eow_ss = snap_get(snap);
+    vm->eow_ww = snap_get(snap);
+    vm->eow_width = snap_get(snap);
+
+    size_t break_class = snap_get(snap);
+    size_t grapheme = snap_get(snap);
+
+    vm->cut = snap_get(snap);
+    vm->cut_width = snap_get(snap);
+
+    size_t slot_used = snap_get(snap);
+    size_t slot_cursor = snap_get(snap);
+    const uint8_t* slots = snap_get_data(snap, slot_used);
+    size_t slot_escape = snap_get(snap);
+    size_t slot_ansi = snap_get(snap);
+    size_t unit_used = snap_get(snap);
+    const uint8_t* units = snap_get_data(snap, unit_used);
+
+    size_t indent_size = snap_get(snap);
+    size_t indent_width = snap_get(snap);
+    const uint8_t* indent = vm->config.count_only
+        ? NULL : snap_get_data(snap, indent_size);
+
+    size_t state = snap_get(snap);
+    size_t switches = snap_get(snap);
+
+    vm->metrics.lines = snap_get(snap);
+    vm->metrics.max_width = snap_get(snap);
+    vm->metrics.bytes = snap_get(snap);
+    vm->output_width = snap_get(snap);
+
+    size_t sgr_size = snap_get(snap);
+    const uint8_t* sgr = snap_get_data(snap, sgr_size);
+
+    if (snap->failed || state > VM_SKIP || switches > 0x7F ||
+            break_class >= LB_CLASSES || grapheme > 0x7F ||
+            (grapheme & GRAPHEME_PROPERTY) >= GB_PROPERTIES ||
+            vm->cursor > line_size ||
+            vm->eow > line_size || vm->eow_ss > line_size - vm->eow ||
+            vm->cut > line_size ||
+            slot_used >= vm->slot_size || slot_cursor > slot_used ||
+            slot_escape > slot_used - slot_cursor || slot_ansi > ANSI_FAIL ||
+            sgr_size > (vm->sgr != NULL ? ANSI_MAX : 0) || unit_used >= 4 ||
+            (vm->config.ascii_mode && slot_used > 0) ||
+            (vm->buf == NULL && line_size > 0) ||
+            (!vm->config.keep_indentation && indent_size > 0)) {
+        logged_return(false);
+    }
+
+    if (line_size > 0) {
+        if (!vm_line_reserve(vm, line_size)) {
+            logged_return(false);
+        }
+        memcpy(vm->line, line, line_size);
+        vm->line_size = line_size;
+        vm->max_size = vm->buf_size - vm->slot_size - 1;
+
+        if (vm->cells != NULL &&
+                !vm_cells(vm, vm->line, line_size, vm->cells)) {
+            logged_return(false);
+        }
+    }
+    if (slot_used > 0) {
+        memcpy(vm->slots, slots, slot_used);
+    }
+    vm->slot_used = slot_used;
+    vm->slot_cursor = slot_cursor;
+    vm->slot_escape = slot_escape;
+    vm->slot_ansi = slot_ansi;
+
+    if (unit_used > 0) {
+        memcpy(vm->units, units, unit_used);
+    }
+    vm->unit_used = unit_used;
+
+    if (sgr_size > 0) {
+        memcpy(vm->sgr, sgr, sgr_size);
+    }
+    vm->sgr_size = sgr_size;
+
+    if (indent_size > 0 || indent_width > 0) {
+        if (!vm_indent_feed(vm, indent, indent_size, indent_width)) {
+            logged_return(false);
+        }
+    }
+    vm->state = (vm_state_t)state;
+    vm->break_class = break_class;
+    vm->grapheme = grapheme;
+    vm->slot_crlf = switches & 0x01;
+    vm->indent_hanging = switches & 0x02;
+    vm->cursor_at_word = switches & 0x04;
+    vm->output_pending = switches & 0x08;
+    vm->stopped = switches & 0x10;
+    vm->unit_le = switches & 0x20;
+    vm->unit_started = switches & 0x40;
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Save the settings that affect the state of VM.
+\*/
+static void vm_save_config(const ufold_vm_t* vm, vm_snap_t* snap)
+{
+    const ufold_vm_config_t* config = &vm->config;
+
+    snap_put(snap, config->max_width);
+    snap_put(snap, config->tab_width);
+    snap_put(snap, config->max_lines);
+    snap_put(snap, config->input_encoding);
+    snap_put(snap, vm_config_flags(config));
+    snap_put_u64(snap, (config->width_table != NULL)
+                       ? config->width_table->hash : 0);
+
+    if (config->punctuation != NULL) {
+        size_t len = strlen(config->punctuation);
+
+        snap_put(snap, len + 1);
+        snap_put_data(snap, config->punctuation, len);
+    } else {
+        snap_put(snap, 0);
+    }
+    if (config->ellipsis != NULL) {
+        size_t len = strlen(config->ellipsis);
+
+        snap_put(snap, len + 1);
+        snap_put_data(snap, config->ellipsis, len);
+    } else {
+        snap_put(snap, 0);
+    }
+    // extra widths are those of followers
+    snap_put(snap, vm->follower_count);
+
+    for (size_t i = 0; i < vm->follower_count; ++i) {
+        snap_put(snap, vm->followers[i]->config.max_width);
+    }
+}
+
+/*\
+ / DESCRIPTION
+ /   Check if the saved settings are the given ones.
+\*/
+static bool vm_check_config(const ufold_vm_config_t* config, vm_snap_t* snap)
+{
+    bool valid = (snap_get(snap) == config->max_width);
+
+    valid = (snap_get(snap) == config->tab_width) && valid;
+    valid = (snap_get(snap) == config->max_lines) && valid;
+    valid = (snap_get(snap) == config->input_encoding) && valid;
+    valid = (snap_get(snap) == vm_config_flags(config)) && valid;
+    valid = (snap_get_u64(snap) == ((config->width_table != NULL)
+                                    ? config->width_table->hash : 0)) && valid;
+
+    size_t len = snap_get(snap);
+    const char* chars = (config->punct != NULL)
+        ? config->punct->chars : config->punctuation;
+
+    if (len > 0) {
+        const uint8_t* punctuation = snap_get_data(snap, len - 1);
+
+        valid = valid && chars != NULL &&
+            punctuation != NULL && strlen(chars) == len - 1 &&
+            memcmp(chars, punctuation, len - 1) == 0;
+    } else {
+        valid = valid && chars == NULL;
+    }
+    len = snap_get(snap);
+
+    if (len > 0) {
+        const uint8_t* ellipsis = snap_get_data(snap, len - 1);
+
+        valid = valid && config->ellipsis != NULL &&
+            ellipsis != NULL && strlen(config->ellipsis) == len - 1 &&
+            memcmp(config->ellipsis, ellipsis, len - 1) == 0;
+    } else {
+        valid = valid && config->ellipsis == NULL;
+    }
+    valid = valid && snap_get(snap) == config->extra_count;
+
+    for (size_t i = 0; valid && i < config->extra_count; ++i) {
+        valid = snap_get(snap) == config->extra_widths[i];
+    }
+    return valid && !snap->failed;
+}
+
+/*\
+ / DESCRIPTION
+ /   Pack the switches of settings into bits.
+\*/
+static size_t vm_config_flags(const ufold_vm_config_t* config)
+{
+    return (config->hang_punctuation ? 0x01 : 0) |
+           (config->keep_indentation ? 0x02 : 0) |
+           (config->break_at_spaces ? 0x04 : 0) |
+           (config->ascii_mode ? 0x08 : 0) |
+           (config->line_buffered ? 0x10 : 0) |
+           (config->count_only ? 0x20 : 0) |
+           (config->optimal_fit ? 0x40 : 0) |
+           (config->unicode_breaks ? 0x80 : 0) |
+           (config->graphemes ? 0x100 : 0) |
+           (config->ansi_escapes ? 0x200 : 0) |
+           (config->truncate ? 0x400 : 0) |
+           (config->trusted ? 0x800 : 0) |
+           (config->ambiguous_width > 1 ? 0x1000 : 0);
+}
+
+/*\
+ / DESCRIPTION
+ /   Save a number as a variable-length quantity (7 bits per byte).
+\*/
+static void snap_put(vm_snap_t* snap, size_t value)
+{
+    do {
+        uint8_t byte = value & 0x7F;
+
+        value >>= 7;
+
+        if (value > 0) {
+            byte |= 0x80;
+        }
+        snap_put_data(snap, &byte, 1);
+    } while (value > 0);
+}
+
+/*\
+ / DESCRIPTION
+ /   Save bytes as they are.
+\*/
+static void snap_put_data(vm_snap_t* snap, const void* data, size_t size)
+{
+    if (snap->bytes != NULL && size > 0) {
+        debug_assert(size <= snap->capacity - snap->size);
+        memcpy(snap->bytes + snap->size, data, size);
+    }
+    snap->size += size;
+}
+
+/*\
+ / DESCRIPTION
+ /   Load a number saved by snap_put.
+ /   Malformed state fails the snapshot and gives zero.
+\*/
+static size_t snap_get(vm_snap_t* snap)
+{
+    size_t value = 0;
+
+    for (size_t shift = 0; !snap->failed; shift += 7) {
+        if (snap->size >= snap->capacity || shift >= sizeof(size_t) * 8) {
+            snap->failed = true;
+            break;
+        }
+        uint8_t byte = snap->bytes[snap->size++];
+
+        // check overflow
+        if (((size_t)(byte & 0x7F) << shift >> shift) != (byte & 0x7F)) {
+            snap->failed = true;
+            break;
+        }
+        value |= (size_t)(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    return 0;
+}
+
+/*\
+ / DESCRIPTION
+ /   Save a number as 64-bit little endian.
+\*/
+static void snap_put_u64(vm_snap_t* snap, uint64_t value)
+{
+    uint8_t bytes[8];
+
+    for (size_t i = 0; i < 8; ++i) {
+        bytes[i] = (value >> (i * 8)) & 0xFF;
+    }
+    snap_put_data(snap, bytes, 8);
+}
+
+/*\
+ / DESCRIPTION
+ /   Load a number saved by snap_put_u64.
+ /   Malformed state fails the snapshot and gives zero.
+\*/
+static uint64_t snap_get_u64(vm_snap_t* snap)
+{
+    const uint8_t* bytes = snap_get_data(snap, 8);
+    uint64_t value = 0;
+
+    for (size_t i = 0; bytes != NULL && i < 8; ++i) {
+        value |= (uint64_t)bytes[i] << (i * 8);
+    }
+    return value;
+}
+
+/*\
+ / DESCRIPTION
+ /   Load bytes saved by snap_put_data.
+ /   Malformed state fails the snapshot and gives NULL.
+\*/
+static const uint8_t* snap_get_data(vm_snap_t* snap, size_t size)
+{
+    if (snap->failed || size > snap->capacity - snap->size) {
+        snap->failed = true;
+        return NULL;
+    }
+    const uint8_t* data = snap->bytes + snap->size;
+
+    snap->size += size;
+    return data;
+}
+
+/*\
+ / DESCRIPTION
+ /   Make room for COUNT elements of UNIT bytes in a growing buffer.
+\*/
+static bool buf_reserve(ufold_vm_realloc_t realloc, void** ptr,
+                        size_t* capacity, size_t count, size_t unit)
+{
+    if (count > *capacity) {
+        size_t n = (*capacity > 0) ? *capacity : 64;
+
+        while (n < count) {
+            // check overflow
+            if (!add(&n, n)) {
+                logged_return(false);
+            }
+        }
+        // check overflow
+        if (n > SIZE_MAX / unit) {
+            logged_return(false);
+        }
+        void* buf = realloc(*ptr, n * unit);
+
+        if (buf == NULL) {
+            logged_return(false);
+        }
+        *ptr = buf;
+        *capacity = n;
+    }
+    return true;
+}
+
+/*\
+ / DESCRIPTION
+ /   Find the first visual line starting at or after the offset.
+\*/
+static size_t doc_search(const ufold_doc_t* doc, size_t offset)
+{
+    size_t lo = 0;
+    size_t hi = doc->span_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (doc->spans[mid].start < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*\
+ / DESCRIPTION
+ /   Find the start of the logical line containing the offset.
+ /   A line ending in CR is taken along, since an edit after it may have made
+ /   a CRLF pair of it.
+\*/
+static size_t doc_line_start(const ufold_doc_t* doc, size_t offset)
+{
+    const uint8_t* text = doc->text;
+    size_t start = offset;
+
+    if (start > 0 && text[start - 1] == '\r') {
+        start -= 1;
+    }
+    // NOTE: Line Ending: CRLF, CR, LF
+    while (start > 0 && text[start - 1] != '\n' && text[start - 1] != '\r') {
+        start -= 1;
+    }
+    return start;
+}
+
+/*\
+ / DESCRIPTION
+ /   Find the end of the logical line containing the offset, after its line
+ /   ending if any.
+\*/
+static size_t doc_line_end(const ufold_doc_t* doc, size_t offset)
+{
+    const uint8_t* text = doc->text;
+    size_t size = doc->size;
+    size_t end = offset;
+
+    // NOTE: Line Ending: CRLF, CR, LF
+    while (end < size && text[end] != '\n' && text[end] != '\r') {
+        end += 1;
+    }
+    if (end < size) {
+        end += (text[end] == '\r' && end + 1 < size &&
+                text[end + 1] == '\n') ? 2 : 1;
+    }
+    return end;
+}
+
+/*\
+ / DESCRIPTION
+ /   Write bytes of the index.
+\*/
+static bool index_write(ufold_index_t* index, const void* data, size_t size)
+{
+    if (size > 0 && !index->write(data, size)) {
+        logged_return(false);
+    }
+    // check overflow
+    if (!add(&index->size, size)) {
+        logged_return(false);
+    }
+    return true;
 }
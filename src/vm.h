@@ -11,9 +11,50 @@ typedef struct ufold_vm_struct ufold_vm_t;
 //\ Writer for Output
 typedef bool (*ufold_vm_write_t)(const void* ptr, size_t size);
 
+//\ Writer for Output with Context
+typedef bool (*ufold_vm_write_to_t)(void* context,
+                                    const void* ptr, size_t size);
+
+//\ Writer of a VM Given Its Own Context
+typedef struct ufold_vm_writer_struct {
+    ufold_vm_write_to_t write;  // writer for output (NULL: writer of profile)
+    void* context;              // passed to the writer as it is
+} ufold_vm_writer_t;
+
 //\ Memory Reallocator
 typedef void* (*ufold_vm_realloc_t)(void* ptr, size_t size);
 
+//\ Input Vector for Scatter-Gather Feeding
+typedef struct ufold_vm_iovec_struct {
+    const void* base;  // address of input
+    size_t size;       // size of input in bytes
+    bool clean;        // whether input is known to need no sanitization
+} ufold_vm_iovec_t;
+
+//\ Encoding of Fed Input
+typedef enum ufold_encoding {
+    UFOLD_ENCODING_UTF8,     // UTF-8 (or ASCII for ascii_mode)
+    UFOLD_ENCODING_UTF16,    // UTF-16 ordered by byte order mark (none: BE)
+    UFOLD_ENCODING_UTF16LE,  // UTF-16 little-endian
+    UFOLD_ENCODING_UTF16BE,  // UTF-16 big-endian
+    UFOLD_ENCODING_LATIN1,   // ISO-8859-1
+    UFOLD_ENCODING_CP1252,   // Windows-1252
+} ufold_encoding_t;
+
+//\ Hanging Punctuation Compiled for Sharing among VMs
+typedef struct ufold_punct_struct ufold_punct_t;
+
+//\ VM Settings Compiled for Sharing among VMs
+typedef struct ufold_profile_struct ufold_profile_t;
+
+//\ Width Classes of Characters in Place of utf8proc
+typedef struct ufold_width_table_struct {
+    const uint8_t* index;   // block number of each range (16-bit LE)
+    const uint8_t* blocks;  // width classes (4-bit; even codepoint low)
+    size_t shift;           // log2 of codepoints in a block
+    uint64_t hash;          // digest of the whole table
+} ufold_width_table_t;
+
 //\ VM Configuration
 typedef struct ufold_vm_config_struct {
     ufold_vm_write_t write;      // writer for output (NULL: provided default)
@@ -21,14 +62,118 @@ typedef struct ufold_vm_config_struct {
     size_t max_width;            // maximum columns allowed for text
     size_t tab_width;            // maximum columns allowed for tab
     char* punctuation;           // hanging punctuation
+    const ufold_punct_t* punct;  // compiled punctuation (NULL: compile own)
+    char* ellipsis;              // text to mark truncated lines (NULL: none)
     bool hang_punctuation;       // whether to hang punctuation at line start
     bool keep_indentation;       // whether to keep indentation for wrapped text
     bool break_at_spaces;        // whether to break lines at spaces
     bool ascii_mode;             // whether to count bytes rather than columns
     bool line_buffered;          // whether to support line-buffered output
+    bool count_only;             // whether to count output rather than write it
+    bool optimal_fit;            // whether to even out lines (with spaces)
+    bool unicode_breaks;         // whether to break by UAX #14 (with spaces)
+    bool graphemes;              // whether to keep grapheme clusters whole
+    bool ansi_escapes;           // whether to pass ANSI escape sequences
+    bool truncate;               // whether to cut lines rather than wrap
+    size_t max_lines;            // maximum lines of output (0: no limit)
+    bool trusted;                // whether all input is known to be clean
+    ufold_encoding_t input_encoding;  // encoding of fed input
+    size_t cache_lines;          // input lines cached with output (0: none)
+    size_t ambiguous_width;      // columns of East Asian Ambiguous (0: one)
+    const ufold_width_table_t* width_table;  // widths (NULL: utf8proc)
+    const size_t* extra_widths;  // more maximum columns to wrap input at
+    const ufold_vm_write_t* extra_writes;  // writers for extra widths
+    size_t extra_count;          // number of extra widths
     // TODO: --reserve=width
 } ufold_vm_config_t;
 
+//\ Metrics of Output
+typedef struct ufold_metrics_struct {
+    size_t lines;      // number of lines (the last one may have no line feed)
+    size_t max_width;  // columns of the widest line
+    size_t bytes;      // size of output in bytes
+} ufold_metrics_t;
+
+//\ Statistics of Line Cache
+typedef struct ufold_cache_stats_struct {
+    size_t hits;    // input lines whose output is found in the cache
+    size_t misses;  // input lines wrapped again for the cache
+} ufold_cache_stats_t;
+
+//\ Line Break at the End of Line Span
+typedef enum ufold_break {
+    UFOLD_BREAK_NONE,  // end of input without line feed
+    UFOLD_BREAK_HARD,  // line feed from input
+    UFOLD_BREAK_SOFT,  // line wrapped
+    UFOLD_BREAK_FORCED,  // line wrapped inside a word too long to fit
+} ufold_break_t;
+
+//\ Wrapped Line in Input
+typedef struct ufold_span_struct {
+    size_t start;         // offset of text in input
+    size_t end;           // offset of text end in input (without line feed)
+    size_t width;         // columns of the line (with indent)
+    size_t indent;        // size of indent in bytes to put before text
+    size_t indent_width;  // columns of indent
+    ufold_break_t brk;    // how the line ends
+} ufold_span_t;
+
+//\ Writer of Index from Output Lines to Input
+typedef struct ufold_index_struct ufold_index_t;
+
+//\ Checkpoint in Index to Resume Wrapping from
+typedef struct ufold_checkpoint_struct {
+    size_t line;        // number of line feeds output before checkpoint
+    size_t offset;      // size of input fed before checkpoint
+    const void* state;  // state of VM (see ufold_vm_restore)
+    size_t state_size;  // size of state in bytes
+} ufold_checkpoint_t;
+
+//\ Document Wrapped Incrementally
+typedef struct ufold_doc_struct ufold_doc_t;
+
+//\ Visual Lines Replaced by an Edit
+typedef struct ufold_doc_change_struct {
+    size_t first;    // index of the first visual line replaced
+    size_t removed;  // number of visual lines before the edit
+    size_t added;    // number of visual lines after the edit
+} ufold_doc_change_t;
+
+//\ Line Iterator (members are private)
+typedef struct ufold_iter_struct {
+    ufold_vm_config_t config;
+    const uint8_t* input;
+    const uint8_t* cells;  // decoded properties of input (NULL: decode input)
+    size_t size;
+    size_t origin;  // offset of input in the whole input fed so far
+    size_t line;  // offset of unprocessed line
+    size_t next;  // offset after the last span
+    size_t cursor;
+    size_t cursor_offset;
+    size_t eow;
+    size_t eow_ss;
+    size_t eow_ww;
+    size_t eow_width;
+    size_t cut;
+    size_t cut_width;
+    size_t output_width;
+    size_t indent_size;
+    size_t indent_width;
+    ufold_span_t span;  // span in progress
+    ufold_span_t spans[2];  // spans ready
+    size_t span_count;
+    size_t lines;  // number of lines output
+    int state;
+    int break_class;
+    int grapheme;
+    bool indent_hanging;
+    bool cursor_at_word;
+    bool span_open;
+    bool span_cut;  // whether the span is a line cut before its first text
+    bool stopped;
+    bool more;  // whether more input is to be fed
+} ufold_iter_t;
+
 /*\
  / DESCRIPTION
  /   Reset the settings' value to a normal state.
@@ -41,6 +186,65 @@ void ufold_vm_config_init(ufold_vm_config_t* config);
 /*\
  / DESCRIPTION
  /   Create a new VM for line wrapping.
+ /   With extra widths, the same input is also wrapped at each extra width
+ /   and written by the matching extra writer (NULL: provided default), while
+ /   input is decoded only once for all widths.
+ /   With optimal fit and breaking at spaces, the lines of a paragraph are
+ /   made as even as possible rather than filled one by one, looking ahead at
+ /   most a few dozen lines.  Other ways of wrapping ignore optimal fit.
+ /   With Unicode breaks and breaking at spaces, lines are also broken inside
+ /   words where the Unicode line breaking algorithm (UAX #14) allows, e.g.
+ /   between ideographs or after a slash, but not at no-break spaces.  It
+ /   takes precedence over optimal fit.
+ /
+ /   If graphemes is set, a grapheme cluster (UAX #29), e.g. a letter with
+ /   combining marks or an emoji sequence, is as wide as its first character
+ /   and lines are never broken inside it.  It is ignored in ascii mode.
+ /
+ /   If ansi_escapes is set, ANSI escape sequences (CSI, OSC, etc.) are passed
+ /   through as zero-width text rather than sanitized, and never split across
+ /   lines.  The graphic rendition (SGR) is set again after each line break
+ /   in the output, though not in line spans.  It is ignored in ascii mode.
+ /
+ /   If truncate is set, each line is cut at the maximum width followed by
+ /   the ellipsis, if any, instead of being wrapped, and the rest of the line
+ /   is skipped up to the next line feed without being decoded.  The ellipsis
+ /   must be well-formed text without control characters, and is not part of
+ /   line spans.  Other ways of wrapping and indentation are ignored.
+ /
+ /   If max_lines is not zero, output ends after that many lines including
+ /   the line feed of the last one, and the rest of input is ignored.  It is
+ /   also the maximum number of line spans.
+ /
+ /   If trusted is set, all fed input is treated as clean input of
+ /   ufold_vm_feedv, so it is neither validated nor sanitized nor normalized.
+ /   Input may still be split anywhere, even inside a character.  Without
+ /   extra widths, its lines are wrapped in place.  Debug builds abort when
+ /   trusted input is not clean.
+ /
+ /   If input_encoding is not UTF-8, fed input is transcoded into UTF-8
+ /   before anything else, even if a code unit or a surrogate pair is split
+ /   across feeds.  A byte order mark at the start of UTF-16 input is
+ /   dropped.  Unpaired surrogates and bytes undefined in Windows-1252 become
+ /   '?'.  Input borrowed by other functions is always UTF-8.  It is ignored
+ /   in ascii mode.
+ /
+ /   If cache_lines is not zero, the output of that many recent input lines
+ /   is kept, and a line found again is output from the cache rather than
+ /   wrapped.  A line of at most 64 KiB is kept whole until its end, even
+ /   across flushes, so that it is cached whatever feeds it is split into.
+ /   It is ignored with a zero width, optimal fit or ansi_escapes, where the
+ /   output of a line depends on more than the line itself.
+ /
+ /   If ambiguous_width is 2, characters of East Asian Ambiguous width
+ /   (UAX #11) that are otherwise narrow, e.g. Greek letters, box drawings
+ /   and circles, are as wide as ideographs, as on terminals in CJK locales.
+ /   The columns of each width class are chosen once when the VM is created
+ /   rather than checked per character.  It is ignored in ascii mode.
+ /
+ /   If width_table is not NULL, the width classes of characters are taken
+ /   from it rather than from utf8proc, e.g. to match the widths of a
+ /   terminal.  It must outlive the VM.  It is ignored in ascii mode.
  /
  / PARAMETERS
  /   *config --> VM settings
@@ -51,12 +255,127 @@ void ufold_vm_config_init(ufold_vm_config_t* config);
 \*/
 ufold_vm_t* ufold_vm_new(const ufold_vm_config_t* config);
 
+/*\
+ / DESCRIPTION
+ /   Check a table of width classes and refer to it in place, e.g. a file
+ /   made by mkwidths and mapped into memory, so the data must outlive the
+ /   table.
+ /
+ /   The table consists of (numbers are unsigned and little-endian):
+ /     MAGIC:4 ("ufcw") VERSION:1 (1) SHIFT:1 ZERO:2 COUNT:4 INDEX BLOCKS
+ /   INDEX has a block number of 2 bytes for every 2^SHIFT codepoints up to
+ /   U+10FFFF, and BLOCKS has COUNT blocks of a width class of 4 bits for
+ /   each codepoint, two in a byte with the even codepoint in the low bits.
+ /   Width classes 0, 1 and 2 are widths, and 3 is East Asian Ambiguous,
+ /   which is as wide as ambiguous_width.
+ /
+ / PARAMETERS
+ /   *table <-- width table
+ /     data --> address of table data
+ /     size --> size of table data in bytes
+ /
+ / RETURN
+ /    true :: success
+ /   false :: failure
+\*/
+bool ufold_width_table_init(ufold_width_table_t* table,
+                            const void* data, size_t size);
+
+/*\
+ / DESCRIPTION
+ /   Validate and compile the settings once for any number of VMs, with all
+ /   that does not depend on input: copies of punctuation and ellipsis,
+ /   compiled punctuation, sizes of buffers, the way to decode input, and
+ /   the profiles of extra widths.
+ /   The profile is never changed, so VMs in different threads can share it
+ /   as long as its reallocator and writers are safe to call from them.
+ /   Strings and extra widths of config need not outlive the profile.
+ /
+ / PARAMETERS
+ /   *config --> VM settings
+ /
+ / RETURN
+ /   BEAF :: success
+ /   NULL :: failure
+\*/
+ufold_profile_t* ufold_profile_new(const ufold_vm_config_t* config);
+
+/*\
+ / DESCRIPTION
+ /   Free the memory used by the profile.
+ /   The profile must outlive the VMs created from it.
+\*/
+void ufold_profile_free(ufold_profile_t* profile);
+
+/*\
+ / DESCRIPTION
+ /   Create a new VM for line wrapping with a compiled profile, which only
+ /   allocates the state of the VM and its followers.
+ /   ufold_vm_new is the same as this with a profile owned by the VM.
+ /
+ / PARAMETERS
+ /   *profile --> compiled settings
+ /      write --> writer for output (NULL: writer of profile)
+ /
+ / RETURN
+ /   BEAF :: success
+ /   NULL :: failure
+\*/
+ufold_vm_t* ufold_vm_new_from_profile(const ufold_profile_t* profile,
+                                      ufold_vm_write_t write);
+
+/*\
+ / DESCRIPTION
+ /   Create a new VM like ufold_vm_new_from_profile, with a writer and its
+ /   context for the VM and each VM of its extra widths, so that one profile
+ /   drives any number of groups of VMs writing to different outputs.
+ /
+ / PARAMETERS
+ /   *profile --> compiled settings
+ /   *writers --> writers of the VM followed by those of extra widths
+ /      count --> number of writers (no more than 1 + extra widths)
+ /
+ / RETURN
+ /   BEAF :: success
+ /   NULL :: failure
+\*/
+ufold_vm_t* ufold_vm_new_with_writers(const ufold_profile_t* profile,
+                                      const ufold_vm_writer_t* writers,
+                                      size_t count);
+
 /*\
  / DESCRIPTION
  /   Free the memory used by the VM and its components.
 \*/
 void ufold_vm_free(ufold_vm_t* vm);
 
+/*\
+ / DESCRIPTION
+ /   Compile the punctuation of config for ascii_mode of config into a set
+ /   that matches a character without scanning the punctuation.
+ /   The set is never changed, so any number of VMs with the same ascii_mode
+ /   can share it as punct of their config, which then replaces punctuation.
+ /   A profile given no set compiles its own, shared by its extra widths,
+ /   and so do documents and each call of ufold_measure and ufold_wrap, but
+ /   only if punctuation is hung and not empty.  Iterators never allocate,
+ /   so one given no set scans the punctuation for each character.
+ /   The set must outlive the VMs, iterators and documents that share it.
+ /
+ / PARAMETERS
+ /   *config --> VM settings (only punctuation, ascii_mode and realloc)
+ /
+ / RETURN
+ /   BEAF :: success
+ /   NULL :: failure
+\*/
+ufold_punct_t* ufold_punct_new(const ufold_vm_config_t* config);
+
+/*\
+ / DESCRIPTION
+ /   Free the memory used by the compiled punctuation.
+\*/
+void ufold_punct_free(ufold_punct_t* punct);
+
 /*\
  / DESCRIPTION
  /   Output remaining text in the buffer and stop the VM.
@@ -94,4 +413,361 @@ bool ufold_vm_flush(ufold_vm_t* vm);
 \*/
 bool ufold_vm_feed(ufold_vm_t* vm, const void* input, size_t size);
 
+/*\
+ / DESCRIPTION
+ /   Feed a sequence of inputs into the VM as if they were concatenated.
+ /   Clean input must be well-formed UTF-8 (or ASCII for ascii_mode) without
+ /   any CR, NEL, LS, PS and control characters other than LF and TAB.
+ /   Lines of clean input are wrapped in place rather than copied, except the
+ /   unfinished one at the end.
+ /   Input of another encoding than UTF-8 is never taken as clean.
+ /   Feeding an already stopped VM will return false.
+ /
+ / PARAMETERS
+ /     iov --> array of inputs
+ /   count --> number of inputs
+ /
+ / RETURN
+ /    true :: success
+ /   false :: failure
+\*/
+bool ufold_vm_feedv(ufold_vm_t* vm, const ufold_vm_iovec_t* iov, size_t count);
+
+/*\
+ / DESCRIPTION
+ /   Get the metrics of output produced so far.
+ /   Without count-only mode, only lines are counted unless the library is
+ /   built with UFOLD_METRICS, and output is not measured when max_width is
+ /   zero.
+ /
+ / PARAMETERS
+ /   *metrics <-- metrics of output
+\*/
+void ufold_vm_metrics(const ufold_vm_t* vm, ufold_metrics_t* metrics);
+
+/*\
+ / DESCRIPTION
+ /   Check whether the VM and those for extra widths have output max_lines
+ /   lines, after which input is ignored and needs not be fed any more.
+ /
+ / RETURN
+ /    true :: no more output
+ /   false :: otherwise or without the limit
+\*/
+bool ufold_vm_done(const ufold_vm_t* vm);
+
+/*\
+ / DESCRIPTION
+ /   Get the statistics of the line cache so far (zero without the cache).
+ /
+ / PARAMETERS
+ /   *stats <-- statistics of line cache
+\*/
+void ufold_vm_cache_stats(const ufold_vm_t* vm, ufold_cache_stats_t* stats);
+
+/*\
+ / DESCRIPTION
+ /   Save the state of the VM, including buffered input, into a buffer.
+ /   The state refers to no memory, so it can be restored by another thread
+ /   or process, and nothing is written unless the buffer is large enough.
+ /
+ / PARAMETERS
+ /     buffer --> address of buffer (NULL: only compute the size of state)
+ /   capacity --> size of buffer in bytes
+ /    *needed <-- size of state in bytes
+ /
+ / RETURN
+ /    true :: success
+ /   false :: failure, or the buffer is too small for the needed size
+\*/
+bool ufold_vm_snapshot(const ufold_vm_t* vm,
+                       void* buffer, size_t capacity, size_t* needed);
+
+/*\
+ / DESCRIPTION
+ /   Create a new VM from a state saved by ufold_vm_snapshot.
+ /   Settings must be those of the saved VM, except the writers and the
+ /   reallocator.
+ /
+ / PARAMETERS
+ /   *config --> VM settings
+ /     state --> address of saved state
+ /      size --> size of saved state in bytes
+ /
+ / RETURN
+ /   BEAF :: success
+ /   NULL :: failure, or the state is malformed or saved with other settings
+\*/
+ufold_vm_t* ufold_vm_restore(const ufold_vm_config_t* config,
+                             const void* state, size_t size);
+
+/*\
+ / DESCRIPTION
+ /   Start writing an index of output lines for random access into wrapped
+ /   input. A checkpoint with the state of VM is written about every given
+ /   number of output lines, and is looked up by ufold_index_seek.
+ /
+ / PARAMETERS
+ /      write --> writer for index
+ /    realloc --> memory reallocator (NULL: provided default)
+ /   interval --> number of output lines between checkpoints
+ /
+ / RETURN
+ /   BEAF :: success
+ /   NULL :: failure
+\*/
+ufold_index_t* ufold_index_new(ufold_vm_write_t write,
+                               ufold_vm_realloc_t realloc, size_t interval);
+
+/*\
+ / DESCRIPTION
+ /   Free the memory used by the index writer.
+\*/
+void ufold_index_free(ufold_index_t* index);
+
+/*\
+ / DESCRIPTION
+ /   Write a checkpoint if enough lines have been output since the last one.
+ /   It should be called before feeding input and after every feed, and the
+ /   first call always writes a checkpoint.
+ /   Output is not measured when max_width is zero without count-only mode.
+ /
+ / PARAMETERS
+ /       vm --> VM being indexed
+ /   offset --> size of input fed into the VM so far
+ /
+ / RETURN
+ /    true :: success
+ /   false :: failure
+\*/
+bool ufold_index_update(ufold_index_t* index, const ufold_vm_t* vm,
+                        size_t offset);
+
+/*\
+ / DESCRIPTION
+ /   Finish the index with the table of checkpoints.
+ /
+ / RETURN
+ /    true :: success
+ /   false :: failure
+\*/
+bool ufold_index_finish(ufold_index_t* index);
+
+/*\
+ / DESCRIPTION
+ /   Find the last checkpoint in an index before an output line.
+ /   To output the line, restore the VM from the checkpoint, feed input from
+ /   its offset and skip as many line feeds as the line minus the number of
+ /   line feeds at the checkpoint.
+ /
+ / PARAMETERS
+ /         index --> address of index
+ /          size --> size of index in bytes
+ /          line --> number of output line (from zero)
+ /   *checkpoint <-- checkpoint found (state refers to index)
+ /
+ / RETURN
+ /    true :: success
+ /   false :: failure, or the index is malformed
+\*/
+bool ufold_index_seek(const void* index, size_t size, size_t line,
+                      ufold_checkpoint_t* checkpoint);
+
+/*\
+ / DESCRIPTION
+ /   Measure the output of wrapping input without writing it.
+ /   No memory is allocated, and the writer and the reallocator of config are
+ /   never used, so optimal fit is not supported.
+ /
+ / PARAMETERS
+ /    *config --> VM settings
+ /      input --> address of input
+ /       size --> size of input in bytes
+ /   *metrics <-- metrics of output
+ /
+ / RETURN
+ /    true :: success
+ /   false :: failure, or optimal fit is asked for
+\*/
+bool ufold_measure(const ufold_vm_config_t* config,
+                   const void* input, size_t size, ufold_metrics_t* metrics);
+
+/*\
+ / DESCRIPTION
+ /   Wrap input into a buffer in memory.
+ /   The exact size of output is computed first, and nothing is written
+ /   unless the buffer is large enough.
+ /   No memory is allocated, and the writer and the reallocator of config are
+ /   never used, so optimal fit is not supported.
+ /
+ / PARAMETERS
+ /    *config --> VM settings
+ /      input --> address of input
+ /       size --> size of input in bytes
+ /     output --> address of buffer (NULL: only compute the size of output)
+ /   capacity --> size of buffer in bytes
+ /    *needed <-- size of output in bytes
+ /
+ / RETURN
+ /    true :: success
+ /   false :: failure, optimal fit is asked for, or the buffer is too small
+ /            for the needed size
+\*/
+bool ufold_wrap(const ufold_vm_config_t* config,
+                const void* input, size_t size,
+                void* output, size_t capacity, size_t* needed);
+
+/*\
+ / DESCRIPTION
+ /   Start iterating over lines wrapped from input without writing output.
+ /   The iterator neither allocates memory nor copies input, and lines are
+ /   wrapped lazily one by one with the same rules as the VM.
+ /   Input and punctuation of config must outlive the iterator, and the
+ /   writer and the reallocator of config are never used.
+ /   Optimal fit is not supported, and no line is iterated if asked for.
+ /
+ / PARAMETERS
+ /   *config --> VM settings
+ /     input --> address of input
+ /      size --> size of input in bytes
+\*/
+void ufold_iter_init(ufold_iter_t* iter, const ufold_vm_config_t* config,
+                     const void* input, size_t size);
+
+/*\
+ / DESCRIPTION
+ /   Get the next wrapped line as a span of input.
+ /   Invalid bytes and control characters in the span are treated as '?',
+ /   and the indent of a wrapped line is that of the first line, with any
+ /   hanging punctuation replaced by spaces.
+ /
+ / PARAMETERS
+ /   *span <-- wrapped line
+ /
+ / RETURN
+ /    true :: success
+ /   false :: no more lines or failure
+\*/
+bool ufold_iter_next(ufold_iter_t* iter, ufold_span_t* span);
+
+/*\
+ / DESCRIPTION
+ /   Continue iterating over input that arrives piece by piece.
+ /   New input replaces the old one from the offset given by ufold_iter_rest,
+ /   so the bytes before it can be dropped, and offsets of spans still count
+ /   from the start of the first input.  Until input is fed with no more to
+ /   come, ufold_iter_next holds back bytes that may be continued, such as
+ /   an incomplete character, and returns false when it runs out of input.
+ /   Cells of input are not supported.
+ /
+ / PARAMETERS
+ /   input --> address of input from the offset of the rest
+ /    size --> size of input in bytes
+ /    more --> whether more input is to be fed
+\*/
+void ufold_iter_feed(ufold_iter_t* iter, const void* input, size_t size,
+                     bool more);
+
+/*\
+ / DESCRIPTION
+ /   Get the offset of the first byte of input still needed by the iterator.
+\*/
+size_t ufold_iter_rest(const ufold_iter_t* iter);
+
+/*\
+ / DESCRIPTION
+ /   Create an empty document wrapped as text is edited.
+ /   Wrapped lines are kept for each logical line, so an edit only re-wraps
+ /   the logical lines it touches.
+ /   The writer of config is never used, and optimal fit is not supported.
+ /
+ / PARAMETERS
+ /   *config --> VM settings
+ /
+ / RETURN
+ /   BEAF :: success
+ /   NULL :: failure, or optimal fit is asked for
+\*/
+ufold_doc_t* ufold_doc_new(const ufold_vm_config_t* config);
+
+/*\
+ / DESCRIPTION
+ /   Free the memory used by the document.
+\*/
+void ufold_doc_free(ufold_doc_t* doc);
+
+/*\
+ / DESCRIPTION
+ /   Replace a range of text in the document and re-wrap the logical lines
+ /   it touches.
+ /   Visual lines before and after the replaced ones are unchanged, except
+ /   that the offsets of the following lines are moved by the edit.
+ /   Editing a document after a failed edit will return false.
+ /
+ / PARAMETERS
+ /     offset --> offset of the range in text
+ /    deleted --> size of the range in bytes
+ /   inserted --> address of new text
+ /       size --> size of new text in bytes
+ /    *change <-- visual lines replaced (NULL: ignored)
+ /
+ / RETURN
+ /    true :: success
+ /   false :: failure, or the range is out of text
+\*/
+bool ufold_doc_edit(ufold_doc_t* doc, size_t offset, size_t deleted,
+                    const void* inserted, size_t size,
+                    ufold_doc_change_t* change);
+
+/*\
+ / DESCRIPTION
+ /   Re-wrap the document at another width.
+ /   Only the logical lines that were wrapped, cut, or no longer fit are
+ /   re-wrapped, and characters are not decoded again, since their widths
+ /   and classes are kept from the edits that inserted them.
+ /   Resizing a document after a failed edit will return false.
+ /
+ / PARAMETERS
+ /   max_width --> maximum columns allowed for text
+ /
+ / RETURN
+ /    true :: success
+ /   false :: failure
+\*/
+bool ufold_doc_resize(ufold_doc_t* doc, size_t max_width);
+
+/*\
+ / DESCRIPTION
+ /   Get the text of the document.
+ /   The text is valid until the next edit.
+ /
+ / PARAMETERS
+ /   *size <-- size of text in bytes
+ /
+ / RETURN
+ /   address of text
+\*/
+const void* ufold_doc_text(const ufold_doc_t* doc, size_t* size);
+
+/*\
+ / DESCRIPTION
+ /   Get the number of visual lines in the document.
+\*/
+size_t ufold_doc_count(const ufold_doc_t* doc);
+
+/*\
+ / DESCRIPTION
+ /   Get a visual line of the document as a span of its text, as if the
+ /   whole text were iterated by ufold_iter_next.
+ /
+ / PARAMETERS
+ /   index --> index of visual line
+ /   *span <-- wrapped line
+ /
+ / RETURN
+ /    true :: success
+ /   false :: no such line
+\*/
+bool ufold_doc_line(const ufold_doc_t* doc, size_t index, ufold_span_t* span);
+
 #endif  /* UFOLD_VM_H */
@@ -176,12 +176,1189 @@ TEST_START (line_buffered_01)
 TEST_END (line_buffered_01)
 
 
+TEST_START (line_buffered_02)
+    config.line_buffered = true;
+    config.max_width = 10;
+
+    vnew(vm, config);
+    vfeed(vm, "A\nB\r\nC\xE2\x82", 8);
+    vflush(vm);
+    expect("A\nB\n", 4);
+    vfeed(vm, "\xAC\nD", 3);
+    vflush(vm);
+    expect("A\nB\nC\xE2\x82\xAC\n", 9);
+    vstop(vm);
+
+    char result[] = "A\nB\nC\xE2\x82\xAC\nD";
+    expect(result, sizeof(result) - 1);
+TEST_END (line_buffered_02)
+
+
+TEST_START (feedv_01)
+    config.max_width = 8;
+    config.keep_indentation = true;
+    config.break_at_spaces = true;
+
+    ufold_vm_iovec_t iov[] = {
+        {"hello world\nfoo", 15, true},
+        {"\r", 1, false},
+        {"\nbar", 4, true},
+        {"\xE2", 1, false},
+        {" baz  qux\n  indented line here\ntail", 35, true},
+    };
+
+    vnew(vm, config);
+    if (!ufold_vm_feedv(vm, iov, sizeof(iov) / sizeof(iov[0]))) {
+        goto TEST_FAIL;
+    }
+    vstop(vm);
+
+    char result[] =
+    "hello\nworld\nfoo\nbar? baz\nqux\n"
+    "  indent\n  ed\n  line\n  here\ntail";
+    expect(result, sizeof(result) - 1);
+TEST_END (feedv_01)
+
+
+TEST_START (iter_01)
+    config.max_width = 8;
+    config.keep_indentation = true;
+    config.break_at_spaces = true;
+
+    char input[] = "  hello world\r\nfoo";
+    ufold_iter_t iter;
+    ufold_span_t span;
+
+    ufold_iter_init(&iter, &config, input, sizeof(input) - 1);
+
+    while (ufold_iter_next(&iter, &span)) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%zu-%zu:%zu:%zu:%c\n",
+                         span.start, span.end, span.width, span.indent,
+                         "NHSF"[span.brk]);
+
+        if (n < 0 || !write_to_buf(line, n)) {
+            goto TEST_FAIL;
+        }
+    }
+
+    char result[] = "0-7:7:0:S\n8-13:7:2:H\n15-18:3:0:N\n";
+    expect(result, sizeof(result) - 1);
+TEST_END (iter_01)
+
+
+TEST_START (iter_02)
+    config.max_width = 4;
+    config.break_at_spaces = true;
+
+    // input arrives byte by byte
+    char input[] = "ab abcdefghij \xC3\xA9\r\nxy";
+    size_t size = sizeof(input) - 1;
+    ufold_iter_t iter;
+    ufold_span_t span;
+
+    ufold_iter_init(&iter, &config, NULL, 0);
+
+    for (size_t i = 0; i <= size; ++i) {
+        size_t rest = ufold_iter_rest(&iter);
+
+        ufold_iter_feed(&iter, input + rest, i - rest, i < size);
+
+        while (ufold_iter_next(&iter, &span)) {
+            char line[64];
+            int n = snprintf(line, sizeof(line), "%zu-%zu:%zu:%c\n",
+                             span.start, span.end, span.width,
+                             "NHSF"[span.brk]);
+
+            if (n < 0 || !write_to_buf(line, n)) {
+                goto TEST_FAIL;
+            }
+        }
+    }
+
+    char result[] = "0-2:2:S\n3-7:4:F\n7-11:4:F\n11-16:4:H\n18-20:2:N\n";
+    expect(result, sizeof(result) - 1);
+TEST_END (iter_02)
+
+
+TEST_START (iter_03)
+    config.max_width = 10;
+    config.truncate = true;
+    config.ellipsis = "...";
+
+    // a line is cut before it is truncated in a later chunk
+    char input[] = "abcdefghijklmnop\nxy";
+    size_t size = sizeof(input) - 1;
+    ufold_iter_t iter;
+    ufold_span_t span;
+
+    ufold_iter_init(&iter, &config, NULL, 0);
+
+    for (size_t i = 0; i <= size; i += 8) {
+        size_t n = (i + 8 < size) ? i + 8 : size;
+        size_t rest = ufold_iter_rest(&iter);
+
+        ufold_iter_feed(&iter, input + rest, n - rest, n < size);
+
+        while (ufold_iter_next(&iter, &span)) {
+            char line[64];
+            int k = snprintf(line, sizeof(line), "%zu-%zu:%zu:%c\n",
+                             span.start, span.end, span.width,
+                             "NHSF"[span.brk]);
+
+            if (k < 0 || !write_to_buf(line, k)) {
+                goto TEST_FAIL;
+            }
+        }
+    }
+
+    char result[] = "0-7:7:H\n17-19:2:N\n";
+    expect(result, sizeof(result) - 1);
+TEST_END (iter_03)
+
+
+TEST_START (iter_04)
+    config.max_width = 3;
+    config.truncate = true;
+    config.ellipsis = "...";
+
+    // nothing fits before an ellipsis as wide as lines
+    char input[] = "abcdef\nab\n\xE4\xB8\xADxy\nz";
+    ufold_iter_t iter;
+    ufold_span_t span;
+
+    ufold_iter_init(&iter, &config, input, sizeof(input) - 1);
+
+    while (ufold_iter_next(&iter, &span)) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%zu-%zu:%zu:%c\n",
+                         span.start, span.end, span.width, "NHSF"[span.brk]);
+
+        if (n < 0 || !write_to_buf(line, n)) {
+            goto TEST_FAIL;
+        }
+    }
+
+    char result[] = "0-0:0:H\n7-9:2:H\n10-10:0:H\n16-17:1:N\n";
+    expect(result, sizeof(result) - 1);
+TEST_END (iter_04)
+
+
+TEST_START (iter_05)
+    config.max_width = 5;
+    config.tab_width = 4;
+    config.keep_indentation = true;
+    config.graphemes = true;
+
+    // a cluster too wide for indented lines starts a line of its own
+    char input[] = "\tb,(\xE4\xB8\xAD\xE2\x80\x8D" "c";
+    ufold_iter_t iter;
+    ufold_span_t span;
+
+    ufold_iter_init(&iter, &config, input, sizeof(input) - 1);
+
+    while (ufold_iter_next(&iter, &span)) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%zu-%zu:%zu:%c\n",
+                         span.start, span.end, span.width, "NHSF"[span.brk]);
+
+        if (n < 0 || !write_to_buf(line, n)) {
+            goto TEST_FAIL;
+        }
+    }
+
+    char result[] = "0-2:5:S\n2-3:5:S\n3-4:5:S\n4-10:6:S\n10-11:5:N\n";
+    expect(result, sizeof(result) - 1);
+TEST_END (iter_05)
+
+
+TEST_START (measure_01)
+    config.max_width = 8;
+    config.keep_indentation = true;
+    config.break_at_spaces = true;
+
+    char input[] = "  hello world\r\nfoo";
+    ufold_metrics_t metrics;
+
+    if (!ufold_measure(&config, input, sizeof(input) - 1, &metrics)) {
+        goto TEST_FAIL;
+    }
+    if (metrics.lines != 3 || metrics.max_width != 7 || metrics.bytes != 19) {
+        goto TEST_FAIL;
+    }
+
+    config.count_only = true;
+
+    vnew(vm, config);
+    vfeed(vm, input, sizeof(input) - 1);
+    vstop(vm);
+    ufold_vm_metrics(vm, &metrics);
+
+    if (metrics.lines != 3 || metrics.max_width != 7 || metrics.bytes != 19) {
+        goto TEST_FAIL;
+    }
+    expect("", 0);
+TEST_END (measure_01)
+
+
+TEST_START (wrap_01)
+    config.max_width = 8;
+    config.keep_indentation = true;
+    config.break_at_spaces = true;
+    config.hang_punctuation = true;
+
+    char input[] = "  (hello world)\r\n\xFF" "foo";
+    char output[32];
+    size_t needed = 0;
+
+    if (!ufold_wrap(&config, input, sizeof(input) - 1, NULL, 0, &needed)) {
+        goto TEST_FAIL;
+    }
+    if (ufold_wrap(&config, input, sizeof(input) - 1, output, needed - 1,
+                   &needed)) {
+        goto TEST_FAIL;
+    }
+    if (!ufold_wrap(&config, input, sizeof(input) - 1, output, sizeof(output),
+                    &needed) || !write_to_buf(output, needed)) {
+        goto TEST_FAIL;
+    }
+
+    char result[] = "  (hello\n   world\n   )\n?foo";
+    expect(result, sizeof(result) - 1);
+TEST_END (wrap_01)
+
+
+static char extra_buf[64];
+static size_t extra_len = 0;
+
+static bool write_to_extra(const void* s, size_t n)
+{
+    if (n > sizeof(extra_buf) - extra_len) {
+        return false;
+    }
+    memcpy(extra_buf + extra_len, s, n);
+    extra_len += n;
+    return true;
+}
+
+TEST_START (multi_01)
+    size_t widths[] = {5};
+    ufold_vm_write_t writes[] = {write_to_extra};
+
+    config.max_width = 8;
+    config.tab_width = 4;
+    config.break_at_spaces = true;
+    config.extra_widths = widths;
+    config.extra_writes = writes;
+    config.extra_count = 1;
+    extra_len = 0;
+
+    vnew(vm, config);
+    vfeed(vm, "hello world\r\nab", 15);
+    vflush(vm);
+    vfeed(vm, "\tcd ef", 6);
+    vstop(vm);
+
+    char result[] = "hello\nworld\nab\tcd\nef";
+    char extra[] = "hello\nworld\nab\ncd ef";
+    expect(result, sizeof(result) - 1);
+
+    if (extra_len != sizeof(extra) - 1 || memcmp(extra_buf, extra, extra_len)) {
+        goto TEST_FAIL;
+    }
+TEST_END (multi_01)
+
+
+TEST_START (doc_01)
+    config.max_width = 8;
+    config.break_at_spaces = true;
+
+    ufold_doc_t* doc = ufold_doc_new(&config);
+    ufold_doc_change_t change[3];
+    ufold_span_t span;
+
+    if (doc == NULL) {
+        goto TEST_FAIL;
+    }
+    if (!ufold_doc_edit(doc, 0, 0, "hello world\nfoo\nbar", 19, &change[0])
+            || !ufold_doc_edit(doc, 15, 0, " baz qux", 8, &change[1])
+            || !ufold_doc_edit(doc, 5, 1, "\n", 1, &change[2])) {
+        ufold_doc_free(doc);
+        goto TEST_FAIL;
+    }
+    for (size_t i = 0; i < 3; ++i) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%zu+%zu:%zu\n", change[i].first,
+                         change[i].removed, change[i].added);
+
+        if (n < 0 || !write_to_buf(line, n)) {
+            ufold_doc_free(doc);
+            goto TEST_FAIL;
+        }
+    }
+    for (size_t i = 0; ufold_doc_line(doc, i, &span); ++i) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%zu-%zu:%c\n",
+                         span.start, span.end, "NHSF"[span.brk]);
+
+        if (n < 0 || !write_to_buf(line, n)) {
+            ufold_doc_free(doc);
+            goto TEST_FAIL;
+        }
+    }
+    ufold_doc_free(doc);
+
+    char result[] =
+    "0+0:4\n2+1:2\n0+2:2\n"
+    "0-5:H\n6-11:H\n12-19:S\n20-23:H\n24-27:N\n";
+    expect(result, sizeof(result) - 1);
+TEST_END (doc_01)
+
+
+TEST_START (doc_02)
+    config.max_width = 8;
+    config.break_at_spaces = true;
+
+    ufold_doc_t* doc = ufold_doc_new(&config);
+    ufold_span_t span;
+
+    if (doc == NULL) {
+        goto TEST_FAIL;
+    }
+    if (!ufold_doc_edit(doc, 0, 0, "hello world\nfoo bar baz", 23, NULL)
+            || ufold_doc_count(doc) != 4
+            || !ufold_doc_resize(doc, 16)) {
+        ufold_doc_free(doc);
+        goto TEST_FAIL;
+    }
+    for (size_t i = 0; ufold_doc_line(doc, i, &span); ++i) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%zu-%zu:%zu:%c\n",
+                         span.start, span.end, span.width, "NHSF"[span.brk]);
+
+        if (n < 0 || !write_to_buf(line, n)) {
+            ufold_doc_free(doc);
+            goto TEST_FAIL;
+        }
+    }
+    ufold_doc_free(doc);
+
+    char result[] = "0-11:11:H\n12-23:11:N\n";
+    expect(result, sizeof(result) - 1);
+TEST_END (doc_02)
+
+
+TEST_START (doc_03)
+    config.max_width = 8;
+
+    ufold_doc_t* doc = ufold_doc_new(&config);
+    ufold_doc_change_t change[3];
+    ufold_span_t span;
+
+    if (doc == NULL) {
+        goto TEST_FAIL;
+    }
+    // CR ends logical lines too, and may be paired with a later LF
+    if (!ufold_doc_edit(doc, 0, 0, "a\rbb\rcc", 7, &change[0])
+            || !ufold_doc_edit(doc, 3, 0, "x", 1, &change[1])
+            || !ufold_doc_edit(doc, 2, 0, "\n", 1, &change[2])) {
+        ufold_doc_free(doc);
+        goto TEST_FAIL;
+    }
+    for (size_t i = 0; i < 3; ++i) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%zu+%zu:%zu\n", change[i].first,
+                         change[i].removed, change[i].added);
+
+        if (n < 0 || !write_to_buf(line, n)) {
+            ufold_doc_free(doc);
+            goto TEST_FAIL;
+        }
+    }
+    for (size_t i = 0; ufold_doc_line(doc, i, &span); ++i) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%zu-%zu:%c\n",
+                         span.start, span.end, "NHSF"[span.brk]);
+
+        if (n < 0 || !write_to_buf(line, n)) {
+            ufold_doc_free(doc);
+            goto TEST_FAIL;
+        }
+    }
+    ufold_doc_free(doc);
+
+    char result[] =
+    "0+0:3\n1+1:1\n0+2:2\n"
+    "0-1:H\n3-6:H\n7-9:N\n";
+    expect(result, sizeof(result) - 1);
+TEST_END (doc_03)
+
+
+TEST_START (snapshot_01)
+    config.max_width = 8;
+    config.keep_indentation = true;
+    config.break_at_spaces = true;
+
+    uint8_t state[256];
+    size_t needed = 0;
+
+    vnew(vm, config);
+    vfeed(vm, "  hello wor", 11);
+    vfeed(vm, "\xE4\xB8", 2);
+
+    if (!ufold_vm_snapshot(vm, NULL, 0, &needed) ||
+            ufold_vm_snapshot(vm, state, needed - 1, &needed) ||
+            !ufold_vm_snapshot(vm, state, sizeof(state), &needed)) {
+        goto TEST_FAIL;
+    }
+    ufold_vm_free(vm);
+    vm = NULL;
+
+    config.max_width = 9;
+    if ((vm = ufold_vm_restore(&config, state, needed)) != NULL) {
+        goto TEST_FAIL;
+    }
+    config.max_width = 8;
+    if ((vm = ufold_vm_restore(&config, state, needed)) == NULL) {
+        goto TEST_FAIL;
+    }
+    vfeed(vm, "\xADld foo", 7);
+    vstop(vm);
+
+    char result[] = "  hello\n  wor\xE4\xB8\xADl\n  d foo";
+    expect(result, sizeof(result) - 1);
+TEST_END (snapshot_01)
+
+
+TEST_START (snapshot_02)
+    config.max_width = 5;
+    config.truncate = true;
+    config.ellipsis = "~";
+    config.line_buffered = true;
+
+    uint8_t state[256];
+    size_t needed = 0;
+
+    // saved while the rest of a truncated line is skipped
+    vnew(vm, config);
+    vfeed(vm, "abcdefg", 7);
+    vflush(vm);
+
+    if (!ufold_vm_snapshot(vm, state, sizeof(state), &needed)) {
+        goto TEST_FAIL;
+    }
+    ufold_vm_free(vm);
+
+    if ((vm = ufold_vm_restore(&config, state, needed)) == NULL) {
+        goto TEST_FAIL;
+    }
+    vfeed(vm, "hij\nxyz", 7);
+    vstop(vm);
+
+    char result[] = "abcd~\nxyz";
+    expect(result, sizeof(result) - 1);
+TEST_END (snapshot_02)
+
+
+static char index_buf[1024];
+static size_t index_len = 0;
+
+static bool write_to_index(const void* s, size_t n)
+{
+    if (n > sizeof(index_buf) - index_len) {
+        return false;
+    }
+    memcpy(index_buf + index_len, s, n);
+    index_len += n;
+    return true;
+}
+
+TEST_START (index_01)
+    config.max_width = 4;
+    config.break_at_spaces = true;
+    config.line_buffered = true;
+
+    char input[] = "aaa bbb ccc ddd\neee fff ggg\nhhh";
+    size_t size = sizeof(input) - 1;
+    ufold_index_t* index = NULL;
+    ufold_checkpoint_t checkpoint;
+
+    index_len = 0;
+    index = ufold_index_new(write_to_index, NULL, 2);
+    vnew(vm, config);
+
+    bool done = (index != NULL && ufold_index_update(index, vm, 0));
+
+    for (size_t i = 0; done && i < size; i += 4) {
+        size_t n = (size - i < 4) ? size - i : 4;
+
+        vfeed(vm, input + i, n);
+        vflush(vm);
+        done = ufold_index_update(index, vm, i + n);
+    }
+    if (!done || !ufold_index_finish(index)) {
+        ufold_index_free(index);
+        goto TEST_FAIL;
+    }
+    ufold_index_free(index);
+    vstop(vm);
+    ufold_vm_free(vm);
+    vm = NULL;
+
+    // resume from the checkpoint before the sixth line
+    if (!ufold_index_seek(index_buf, index_len, 5, &checkpoint) ||
+            checkpoint.line > 5 || checkpoint.line < 3) {
+        goto TEST_FAIL;
+    }
+    size_t skip = 5 - checkpoint.line;
+
+    clear_buf();
+
+    vm = ufold_vm_restore(&config, checkpoint.state, checkpoint.state_size);
+
+    if (vm == NULL) {
+        goto TEST_FAIL;
+    }
+    vfeed(vm, input + checkpoint.offset, size - checkpoint.offset);
+    vstop(vm);
+
+    size_t start = 0;
+
+    for (; skip > 0 && start < text_len; ++start) {
+        if (buf[start] == '\n') {
+            skip -= 1;
+        }
+    }
+    char result[] = "fff\nggg\nhhh";
+
+    if (text_len - start != sizeof(result) - 1 ||
+            memcmp(buf + start, result, sizeof(result) - 1) != 0) {
+        goto TEST_FAIL;
+    }
+TEST_END (index_01)
+
+
+TEST_START (optimal_01)
+    config.max_width = 6;
+    config.break_at_spaces = true;
+    config.optimal_fit = true;
+
+    // greedy: "aaa bb\ncc\nddddd\n"
+    char input[] = "aaa bb cc ddddd\n  aaa bb cc";
+    char result[] = "aaa\nbb cc\nddddd\n  aaa\nbb cc";
+
+    vnew(vm, config);
+    for (size_t i = 0; i < sizeof(input) - 1; ++i) {
+        vfeed(vm, input + i, 1);
+    }
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (optimal_01)
+
+
+TEST_START (optimal_02)
+    config.max_width = 6;
+    config.break_at_spaces = true;
+    config.optimal_fit = true;
+
+    // no memory to plan line breaks without a VM
+    char input[] = "aaa bb cc ddddd\n";
+    ufold_metrics_t metrics;
+    ufold_iter_t iter;
+    ufold_span_t span;
+    size_t needed = 0;
+
+    if (ufold_measure(&config, input, sizeof(input) - 1, &metrics) ||
+            ufold_wrap(&config, input, sizeof(input) - 1, NULL, 0, &needed)) {
+        goto TEST_FAIL;
+    }
+    ufold_iter_init(&iter, &config, input, sizeof(input) - 1);
+
+    if (ufold_iter_next(&iter, &span) || ufold_doc_new(&config) != NULL) {
+        goto TEST_FAIL;
+    }
+    expect("", 0);
+TEST_END (optimal_02)
+
+
+TEST_START (unicode_breaks_01)
+    config.max_width = 12;
+    config.break_at_spaces = true;
+    config.unicode_breaks = true;
+
+    // no break before an ideographic full stop, nor after a full stop
+    //   U+65E5 U+672C U+8A9E U+6587 U+3002
+    char input[] = "ab \xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E"
+                   "\xE6\x96\x87\xE3\x80\x82\n"
+                   "see example.com/path/to";
+    char result[] = "ab \xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E\n"
+                    "\xE6\x96\x87\xE3\x80\x82\n"
+                    "see\nexample.com/\npath/to";
+
+    vnew(vm, config);
+    for (size_t i = 0; i < sizeof(input) - 1; ++i) {
+        vfeed(vm, input + i, 1);
+    }
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (unicode_breaks_01)
+
+
+TEST_START (unicode_breaks_02)
+    config.max_width = 5;
+    config.break_at_spaces = true;
+    config.unicode_breaks = true;
+
+    // no break between letters and a prefix or postfix, e.g. ABC$ and abc%
+    char input[] = "a ABC$\nb abc%";
+    char result[] = "a\nABC$\nb\nabc%";
+
+    vnew(vm, config);
+    vfeed(vm, input, sizeof(input) - 1);
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (unicode_breaks_02)
+
+
+TEST_START (graphemes_01)
+    config.max_width = 4;
+    config.graphemes = true;
+
+    // a man and a woman joined into one emoji of two columns
+    //   U+1F468 U+200D U+1F469, and e with U+0301 U+0301
+    char input[] = "ab\xF0\x9F\x91\xA8\xE2\x80\x8D\xF0\x9F\x91\xA9"
+                   "cde\xCC\x81\xCC\x81" "fg";
+    char result[] = "ab\xF0\x9F\x91\xA8\xE2\x80\x8D\xF0\x9F\x91\xA9\n"
+                    "cde\xCC\x81\xCC\x81" "f\ng";
+
+    vnew(vm, config);
+    for (size_t i = 0; i < sizeof(input) - 1; ++i) {
+        vfeed(vm, input + i, 1);
+    }
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (graphemes_01)
+
+
+TEST_START (graphemes_02)
+    config.max_width = 1;
+    config.graphemes = true;
+
+    // a letter after a prepended character U+0600 is never a line start,
+    // however wide the prepended character is
+    char input[] = "\xD8\x80" "a\xD8\x80" "a\xD8\x80" "a";
+
+    vnew(vm, config);
+    vfeed(vm, input, sizeof(input) - 1);
+    vstop(vm);
+
+    for (size_t i = 0; i < text_len; ++i) {
+        if (buf[i] == 'a' && (i == 0 || buf[i - 1] == '\n')) {
+            goto TEST_FAIL;
+        }
+    }
+TEST_END (graphemes_02)
+
+TEST_START (ansi_01)
+    config.max_width = 7;
+    config.break_at_spaces = true;
+    config.ansi_escapes = true;
+
+    // red is reset before the first break and set again after it,
+    // and ESC at the end is invalid
+    char input[] = "\x1B[31mred and \x1B[1mblue\x1B[m end\x1B";
+    char result[] = "\x1B[31mred and\x1B[m\n"
+                    "\x1B[31m\x1B[1mblue\x1B[m\n"
+                    "end?";
+
+    vnew(vm, config);
+    for (size_t i = 0; i < sizeof(input) - 1; ++i) {
+        vfeed(vm, input + i, 1);
+    }
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (ansi_01)
+
+
+TEST_START (ansi_02)
+    config.max_width = 4;
+    config.ansi_escapes = true;
+
+    // a hyperlink longer than 128 bytes with UTF-8 in its URI
+    char input[512] = "\x1B]8;;http://example.com/\xC3\xA9";
+    size_t size = strlen(input);
+
+    memset(input + size, 'a', 300);
+    size += 300;
+    memcpy(input + size, "\x1B\\link\x1B]8;;\x1B\\", 13);
+    size += 13;
+
+    vnew(vm, config);
+    for (size_t i = 0; i < size; ++i) {
+        vfeed(vm, input + i, 1);
+    }
+    vstop(vm);
+    expect(input, size);
+TEST_END (ansi_02)
+
+
+TEST_START (ansi_03)
+    config.max_width = 6;
+    config.truncate = true;
+    config.ansi_escapes = true;
+    config.ellipsis = "~";
+
+    // colors are reset before the ellipsis, and those changed by the text
+    // skipped are kept for the next line
+    char input[] = "\x1B[31mred line\x1B[m gone\nplain\n"
+                   "skip \x1B[32mgreen\ngreen\n";
+    char result[] = "\x1B[31mred l\x1B[m~\nplain\n"
+                    "skip \x1B[32m\x1B[m~\x1B[32m\ngreen\n";
+
+    vnew(vm, config);
+    for (size_t i = 0; i < sizeof(input) - 1; ++i) {
+        vfeed(vm, input + i, 1);
+    }
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (ansi_03)
+
+
+TEST_START (ansi_04)
+    config.max_width = 80;
+    config.ansi_escapes = true;
+
+    // input ends inside an unterminated CSI and OSC sequence
+    vnew(vm, config);
+    vfeed(vm, "ab\x1B[1;2;3", 9);
+    vstop(vm);
+    ufold_vm_free(vm);
+
+    vnew(vm, config);
+    vfeed(vm, "cd\x1B]8;;https://example.com/", 27);
+    vstop(vm);
+
+    char result[] = "ab?[1;2;3cd?]8;;https://example.com/";
+    expect(result, sizeof(result) - 1);
+TEST_END (ansi_04)
+
+
+TEST_START (truncate_01)
+    config.max_width = 6;
+    config.truncate = true;
+    config.ellipsis = "\xE2\x80\xA6";  // U+2026
+
+    // the rest of a long line is skipped up to the line separator U+2028
+    char input[1024] = "short\ntoo long\r\nfits!!\n";
+    char result[] = "short\ntoo l\xE2\x80\xA6\nfits!!\n"
+                    "xxxxx\xE2\x80\xA6\nend";
+    size_t size = strlen(input);
+
+    memset(input + size, 'x', 900);
+    memcpy(input + size + 900, "\xE2\x80\xA8" "end", 6);
+    size += 906;
+
+    vnew(vm, config);
+    vfeed(vm, input, size);
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (truncate_01)
+
+
+TEST_START (max_lines_01)
+    config.max_width = 4;
+    config.max_lines = 3;
+    config.line_buffered = true;
+
+    // the third line ends with its line feed, and the rest is ignored
+    char input[] = "aaaaaaaaaa\nbb\n";
+    char result[] = "aaaa\naaaa\naa\n";
+
+    vnew(vm, config);
+    vfeed(vm, input, sizeof(input) - 1);
+    vflush(vm);
+    if (!ufold_vm_done(vm)) goto TEST_FAIL;
+    vfeed(vm, input, sizeof(input) - 1);
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (max_lines_01)
+
+
+TEST_START (trusted_01)
+    config.max_width = 4;
+    config.trusted = true;
+
+    // characters split across feeds are still whole
+    //   U+65E5 U+672C U+00E9
+    char input[] = "ab\xE6\x97\xA5" "cd\xE6\x9C\xAC\nxyz\xC3\xA9w";
+    char result[] = "ab\xE6\x97\xA5\ncd\xE6\x9C\xAC\nxyz\xC3\xA9\nw";
+
+    vnew(vm, config);
+    for (size_t i = 0; i < sizeof(input) - 1; i += 2) {
+        vfeed(vm, input + i, (i + 3 < sizeof(input)) ? 2 : 1);
+    }
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (trusted_01)
+
+
+TEST_START (trusted_02)
+    config.max_width = 4;
+    config.trusted = true;
+    config.ansi_escapes = true;
+
+    // escape sequences are clean input
+    char input[] = "\x1B[31mred\x1B[m text";
+    char result[] = "\x1B[31mred\x1B[m \ntext";
+
+    vnew(vm, config);
+    vfeed(vm, input, sizeof(input) - 1);
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (trusted_02)
+
+
+TEST_START (encoding_01)
+    config.max_width = 3;
+    config.input_encoding = UFOLD_ENCODING_UTF16;
+
+    // UTF-16LE with a byte order mark, a surrogate pair of U+1F600 and an
+    // unpaired high surrogate, cut off by each feed
+    char input[] = "\xFF\xFE" "a\0b\0" "\x3D\xD8\x00\xDE" "\x00\xD8" "c\0" "d";
+    char result[] = "ab\n\xF0\x9F\x98\x80?\nc?";
+
+    vnew(vm, config);
+    for (size_t i = 0; i < sizeof(input) - 1; ++i) {
+        vfeed(vm, input + i, 1);
+    }
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+TEST_END (encoding_01)
+
+
+TEST_START (cache_01)
+    config.max_width = 5;
+    config.break_at_spaces = true;
+    config.cache_lines = 1;
+
+    // the least recently used line is dropped for another one
+    char input[] = "same line\nsame line\nother\nsame line\n";
+    char result[] = "same\nline\nsame\nline\nother\nsame\nline\n";
+
+    vnew(vm, config);
+    vfeed(vm, input, sizeof(input) - 1);
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+
+    ufold_cache_stats_t stats;
+    ufold_vm_cache_stats(vm, &stats);
+    if (stats.hits != 1 || stats.misses != 3) goto TEST_FAIL;
+TEST_END (cache_01)
+
+
+TEST_START (cache_02)
+    config.max_width = 10;
+    config.break_at_spaces = true;
+    config.cache_lines = 2;
+
+    // a line longer than the line buffer is still cached whole
+    static char input[40000];
+
+    for (size_t i = 0; i < 20000; i += 4) {
+        memcpy(input + i, "abc ", 4);
+    }
+    input[20000 - 1] = '\n';
+    memcpy(input + 20000, input, 20000);
+
+    vnew(vm, config);
+    for (size_t i = 0; i < 40000; i += 100) {
+        vfeed(vm, input + i, 100);
+    }
+    vstop(vm);
+
+    if (text_len % 2 != 0 || !check_buf(buf + text_len / 2, text_len / 2)) {
+        goto TEST_FAIL;
+    }
+    ufold_cache_stats_t stats;
+    ufold_vm_cache_stats(vm, &stats);
+    if (stats.hits != 1 || stats.misses != 1) goto TEST_FAIL;
+TEST_END (cache_02)
+
+
+TEST_START (punct_01)
+    config.max_width = 8;
+    config.keep_indentation = true;
+    config.break_at_spaces = true;
+    config.hang_punctuation = true;
+    config.punctuation = "\xE2\x80\x9C-";
+
+    ufold_punct_t* punct = ufold_punct_new(&config);
+
+    if (punct == NULL) goto TEST_FAIL;
+    config.punctuation = NULL;
+    config.punct = punct;
+
+    // both VMs share the compiled punctuation
+    vnew(vm, config);
+    vfeed(vm, "\xE2\x80\x9Chello world\xE2\x80\x9D\n", 18);
+    vstop(vm);
+    ufold_vm_free(vm);
+    vnew(vm, config);
+    vfeed(vm, "- one two three", 15);
+    vstop(vm);
+
+    char result[] = "\xE2\x80\x9Chello\n world\xE2\x80\x9D\n"
+                    "- one\n two\n three";
+    expect(result, sizeof(result) - 1);
+
+    config.ascii_mode = true;
+    ufold_vm_t* other = ufold_vm_new(&config);
+
+    if (other != NULL) {
+        ufold_vm_free(other);
+        goto TEST_FAIL;
+    }
+    ufold_punct_free(punct);
+TEST_END (punct_01)
+
+
+TEST_START (punct_02)
+    config.max_width = 8;
+    config.keep_indentation = true;
+    config.break_at_spaces = true;
+    config.hang_punctuation = true;
+    config.punctuation = "-";
+
+    // calls given no set compile their own, and nothing hangs if empty
+    char input[] = "- one two three";
+    char result[] = "- one\n two\n three";
+    char output[32];
+    size_t needed = 0;
+
+    if (!ufold_wrap(&config, input, sizeof(input) - 1,
+                    output, sizeof(output), &needed) ||
+            needed != sizeof(result) - 1 ||
+            memcmp(output, result, needed) != 0) goto TEST_FAIL;
+
+    config.punctuation = "";
+    vnew(vm, config);
+    vfeed(vm, input, sizeof(input) - 1);
+    vstop(vm);
+    expect("- one\ntwo\nthree", 15);
+TEST_END (punct_02)
+
+
+TEST_START (profile_01)
+    config.max_width = 5;
+    config.break_at_spaces = true;
+
+    ufold_profile_t* profile = ufold_profile_new(&config);
+
+    if (profile == NULL) goto TEST_FAIL;
+    config.max_width = 0;  // the profile keeps its own settings
+
+    // VMs of the same profile write to their own writers
+    ufold_vm_t* other = ufold_vm_new_from_profile(profile, write_to_extra);
+
+    if (other == NULL) goto TEST_FAIL;
+    vm = ufold_vm_new_from_profile(profile, NULL);
+    extra_len = 0;
+
+    vfeed(vm, "hello world", 11);
+    if (!ufold_vm_feed(other, "foo bar", 7)) goto TEST_FAIL;
+    vstop(vm);
+    if (!ufold_vm_stop(other)) goto TEST_FAIL;
+    ufold_vm_free(other);
+
+    char result[] = "hello\nworld";
+    char extra[] = "foo\nbar";
+    expect(result, sizeof(result) - 1);
+
+    if (extra_len != sizeof(extra) - 1 || memcmp(extra_buf, extra, extra_len)) {
+        goto TEST_FAIL;
+    }
+    ufold_vm_free(vm);
+    vm = NULL;
+    ufold_profile_free(profile);
+TEST_END (profile_01)
+
+
+typedef struct {
+    char data[64];
+    size_t size;
+} sink_t;
+
+static bool write_to_sink(void* context, const void* s, size_t n)
+{
+    sink_t* sink = context;
+
+    if (n > sizeof(sink->data) - sink->size) {
+        return false;
+    }
+    memcpy(sink->data + sink->size, s, n);
+    sink->size += n;
+    return true;
+}
+
+TEST_START (profile_02)
+    config.max_width = 5;
+    config.break_at_spaces = true;
+
+    size_t widths[] = {3};
+    config.extra_widths = widths;
+    config.extra_count = 1;
+
+    ufold_profile_t* profile = ufold_profile_new(&config);
+
+    if (profile == NULL) goto TEST_FAIL;
+
+    // two groups of the same profile write to their own sinks
+    sink_t sinks[4] = {{{0}, 0}};
+    ufold_vm_writer_t writers[4];
+
+    for (size_t i = 0; i < 4; ++i) {
+        writers[i].write = write_to_sink;
+        writers[i].context = sinks + i;
+    }
+    ufold_vm_t* other = ufold_vm_new_with_writers(profile, writers + 2, 2);
+
+    if (other == NULL) goto TEST_FAIL;
+    vm = ufold_vm_new_with_writers(profile, writers, 2);
+
+    if (vm == NULL || ufold_vm_new_with_writers(profile, writers, 3)) {
+        ufold_vm_free(other);
+        goto TEST_FAIL;
+    }
+    bool done = ufold_vm_feed(vm, "ab cd ef", 8) && ufold_vm_stop(vm) &&
+        ufold_vm_feed(other, "one two", 7) && ufold_vm_stop(other);
+    ufold_vm_free(other);
+
+    if (!done) goto TEST_FAIL;
+
+    const char* results[] = {"ab cd\nef", "ab\ncd\nef", "one\ntwo", "one\ntwo"};
+
+    for (size_t i = 0; i < 4; ++i) {
+        if (sinks[i].size != strlen(results[i]) ||
+                memcmp(sinks[i].data, results[i], sinks[i].size) != 0) {
+            goto TEST_FAIL;
+        }
+    }
+    ufold_vm_free(vm);
+    vm = NULL;
+    ufold_profile_free(profile);
+TEST_END (profile_02)
+
+
+TEST_START (ambiguous_01)
+    config.max_width = 5;
+    config.ambiguous_width = 2;
+
+    // circles are ambiguous, while ideographs are always wide
+    char input[] = "\xE2\x97\x8B\xE2\x97\x8B\xE4\xB8\xAD\xE2\x97\x8B";
+    char result[] = "\xE2\x97\x8B\xE2\x97\x8B\n\xE4\xB8\xAD\xE2\x97\x8B";
+
+    vnew(vm, config);
+    vfeed(vm, input, sizeof(input) - 1);
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+
+    ufold_metrics_t metrics;
+    config.ambiguous_width = 1;
+    config.count_only = true;
+
+    if (!ufold_measure(&config, input, sizeof(input) - 1, &metrics) ||
+            metrics.lines != 1 || metrics.max_width != 5) {
+        goto TEST_FAIL;
+    }
+TEST_END (ambiguous_01)
+
+
+TEST_START (width_table_01)
+    static uint8_t data[12 + 17 * 2 + 32768];
+    ufold_width_table_t table;
+
+    // one block for all planes, where x is wide and the rest narrow
+    memcpy(data, "ufcw\x01\x10\x00\x00\x01\x00\x00\x00", 12);
+    memset(data + 12, 0, 17 * 2);
+    memset(data + 12 + 17 * 2, 0x11, 32768);
+    data[12 + 17 * 2 + 'x' / 2] = 0x12;
+
+    if (!ufold_width_table_init(&table, data, sizeof(data))) {
+        goto TEST_FAIL;
+    }
+    config.max_width = 4;
+    config.width_table = &table;
+
+    char input[] = "xxa";
+    char result[] = "xx\na";
+
+    vnew(vm, config);
+    vfeed(vm, input, sizeof(input) - 1);
+    vstop(vm);
+    expect(result, sizeof(result) - 1);
+
+    // reserved bytes of the header must be zero
+    data[7] = 0x01;
+
+    if (ufold_width_table_init(&table, data, sizeof(data))) {
+        goto TEST_FAIL;
+    }
+    data[7] = 0x00;
+
+    // classes above 3 are invalid
+    data[12 + 17 * 2] = 0x14;
+
+    if (ufold_width_table_init(&table, data, sizeof(data))) {
+        goto TEST_FAIL;
+    }
+TEST_END (width_table_01)
+
+
 int main()
 {
     run_test(indent_01);
     run_test(indent_02);
     run_test(indent_03);
     run_test(line_buffered_01);
+    run_test(line_buffered_02);
+    run_test(feedv_01);
+    run_test(iter_01);
+    run_test(iter_02);
+    run_test(iter_03);
+    run_test(iter_04);
+    run_test(iter_05);
+    run_test(measure_01);
+    run_test(wrap_01);
+    run_test(multi_01);
+    run_test(doc_01);
+    run_test(doc_02);
+    run_test(doc_03);
+    run_test(snapshot_01);
+    run_test(snapshot_02);
+    run_test(index_01);
+    run_test(optimal_01);
+    run_test(optimal_02);
+    run_test(unicode_breaks_01);
+    run_test(unicode_breaks_02);
+    run_test(graphemes_01);
+    run_test(graphemes_02);
+    run_test(ansi_01);
+    run_test(ansi_02);
+    run_test(ansi_03);
+    run_test(ansi_04);
+    run_test(truncate_01);
+    run_test(max_lines_01);
+    run_test(trusted_01);
+    run_test(trusted_02);
+    run_test(encoding_01);
+    run_test(cache_01);
+    run_test(cache_02);
+    run_test(punct_01);
+    run_test(punct_02);
+    run_test(profile_01);
+    run_test(profile_02);
+    run_test(ambiguous_01);
+    run_test(width_table_01);
 
     return EXIT_SUCCESS;
 }
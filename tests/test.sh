@@ -14,6 +14,7 @@ ofold=../build/ofold
 urandom=../build/urandom
 uwc=../build/uwc
 ucwidth=../build/ucwidth
+mkwidths=../build/mkwidths
 
 loop=42
 seconds=5
@@ -99,6 +100,55 @@ while read -r flags; do
     i=$(( i + 1 ))
 done < flags.txt
 
+# test when coalesced output appears for partial lines through a pipe
+rm -f tmp_*
+for args in '--latency=60000' '--pending=1048576' '--nonblock --latency=60000'
+do
+    printf '\r[TEST] ufold %-16s  # Partial lines ... ' "${args}"
+    printf '%s\n' "${args}" > tmp_flags
+    printf 'a\nbc\nd' > tmp_stdin
+
+    # complete lines are written once input is idle, partial ones are held
+    {
+        printf 'a\nb'
+        sleep 1
+        cp tmp_stdout tmp_idle_1
+        printf 'c\nd'
+        sleep 1
+        cp tmp_stdout tmp_idle_2
+    } | ufold $args > tmp_stdout 2> tmp_stderr || fail
+
+    mv tmp_stdout tmp_final
+    for stage in 'a\n tmp_idle_1' 'a\nbc\n tmp_idle_2' 'a\nbc\nd tmp_final'
+    do
+        printf "${stage% *}" > tmp_expect
+        cp "${stage#* }" tmp_stdout
+        check
+    done
+    rm -f tmp_*
+
+    printf 'Done\n'
+done
+
+# test a width table made by mkwidths against the widths built in
+if [ -x "${mkwidths}" ]; then
+    rm -f tmp_*
+    "${mkwidths}" > tmp_table
+    for args in '-w4' '-w4 --ambiguous=2'; do
+        printf '\r[TEST] ufold %-16s  # Width table ... ' "${args}"
+        printf '%s\n' "${args}" > tmp_flags
+        printf '\316\261\316\261\316\261\316\261 ' > tmp_stdin  # alpha
+        printf '\342\227\213\342\227\213\n' >> tmp_stdin  # white circle
+
+        ufold $args < tmp_stdin > tmp_expect 2> tmp_stderr || fail
+        ufold $args --width-table=tmp_table \
+            < tmp_stdin > tmp_stdout 2> tmp_stderr || fail
+        check
+
+        printf 'Done\n'
+    done
+fi
+
 # test exit status
 flags_w="$(printf ' -w%s ' 80 8 3 1)"
 flags_t="$(printf ' -t%s ' 8 3 1 0)"